@@ -17,6 +17,7 @@ ALIGN 4
 stack_addr:  dd 0	; Virtual stack address
 entry_point: dd 0
 page_dir:    dd 0	; Physical address to dir that should be loaded
+cr4_value:   dd 0	; Same CR4 as the BSP, needed for large pages and PAE
 
 
 apstart:
@@ -52,11 +53,16 @@ pmode:
 	mov fs, ax
 	mov gs, ax
 
+	mov eax, [cr4_value]
+	mov cr4, eax
+
 	mov eax, [page_dir]
 	mov cr3, eax
 
+	; Enable paging and don't allow supervisor to write to read-only pages,
+	; the same as on the BSP
 	mov eax, cr0
-	or eax, (1 << 31)
+	or eax, (1 << 31) | (1 << 16)
 	mov cr0, eax
 
 	; Stack allocated in main()
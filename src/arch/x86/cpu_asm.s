@@ -8,6 +8,10 @@
 [GLOBAL interrupt_enabled]
 [GLOBAL read_eip]
 [GLOBAL cpu_supported]
+[GLOBAL cpu_features]
+[GLOBAL cpu_ext_features]
+[GLOBAL read_msr]
+[GLOBAL write_msr]
 
 ; CPUID specification from Intel
 ; http://bochs.sourceforge.net/techspec/24161821.pdf
@@ -120,6 +124,63 @@ cpu_supported:
 	ret
 
 
+; Get the feature flags from CPUID, returns EDX
+cpu_features:
+	push ebp
+	mov ebp, esp
+	push ebx	; Changed by cpuid
+
+	mov eax, 1
+	cpuid
+	mov eax, edx
+
+	pop ebx
+	pop ebp
+	ret
+
+
+; Get the extended feature flags from CPUID, returns EDX or 0 if the extended
+; functions are not available
+cpu_ext_features:
+	push ebp
+	mov ebp, esp
+	push ebx	; Changed by cpuid
+
+	; Highest extended function
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000001
+	jb .none
+
+	mov eax, 0x80000001
+	cpuid
+	mov eax, edx
+	jmp .end
+
+.none:
+	xor eax, eax
+
+.end:
+	pop ebx
+	pop ebp
+	ret
+
+
+; Read MSR, number is passed on the stack, returns value in EDX:EAX
+read_msr:
+	mov ecx, [esp+4]
+	rdmsr
+	ret
+
+; Write MSR, number and 64-bit value is passed on the stack
+write_msr:
+	mov ecx, [esp+4]
+	mov eax, [esp+8]
+	mov edx, [esp+12]
+	wrmsr
+	ret
+
+
 ; Get the vendor ID, function is passed a pointer that can hold 12 characters
 ; pluss an additional 0-byte.
 get_vendor_id:
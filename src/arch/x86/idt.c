@@ -112,6 +112,9 @@ void idt_install()	{
 	idt_set_gate(63, (uint32_t)intr63, 0x08, 0x8E);
 	idt_set_gate(64, (uint32_t)intr64, 0x08, 0x8E);
 
+	// TLB shootdown, goes through isr_handler
+	idt_set_gate(66, (uint32_t)isr66, 0x08, 0x8E);
+
 	idt_set_gate(128, (uint32_t)isr128, 0x08, 0x8E);
 }
 
@@ -166,6 +166,9 @@ IRQ 15, 47
 INTR_NOERRCODE 63
 INTR_NOERRCODE 64
 
+; TLB shootdown
+ISR_NOERRCODE 66
+
 
 ; Syscall
 ISR_NOERRCODE 128
@@ -327,6 +327,29 @@ void lapic_start_ap(uint8_t ID, uint32_t addr)	{
 
 
 
+void lapic_send_ipi(uint8_t id, uint8_t vector)	{
+	lapic_write(LAPIC_ICR_CMD_HI, ((uint32_t)id << 24));
+	lapic_write(LAPIC_ICR_CMD_LO,
+		ICR_DELIVERY_MODE_FIXED |
+		ICR_LEVEL_ASSERT |
+		vector
+	);
+	while(local_apic[LAPIC_ICR_CMD_LO] & ICR_DELIVERY_STAT_PEND);
+}
+
+void lapic_send_ipi_others(uint8_t vector)	{
+	lapic_write(LAPIC_ICR_CMD_HI, 0);
+	lapic_write(LAPIC_ICR_CMD_LO,
+		ICR_DEST_SHORTHAND_ALL_UNSELF |
+		ICR_DELIVERY_MODE_FIXED |
+		ICR_LEVEL_ASSERT |
+		vector
+	);
+	while(local_apic[LAPIC_ICR_CMD_LO] & ICR_DELIVERY_STAT_PEND);
+}
+
+
+
 int lapic_get_bus_freq()	{
 	// http://forum.osdev.org/viewtopic.php?t=10686
 
@@ -10,6 +10,8 @@
 [GLOBAL paging_enable]
 [GLOBAL mov_esp_base]
 [GLOBAL flush_tlb_entry]
+[GLOBAL get_cr4]
+[GLOBAL set_cr4]
 
 [EXTERN interrupt_enabled]
 
@@ -53,6 +55,17 @@ paging_enable:
 	mov cr0, eax
 	ret
 
+; Get the value of CR4
+get_cr4:
+	mov eax, cr4
+	ret
+
+; Set CR4, value is passed on the stack
+set_cr4:
+	mov eax, [esp+4]
+	mov cr4, eax
+	ret
+
 ; Flushes TLB entry. Disables and enables interrupts if necessary.
 flush_tlb_entry:
 	push ebp
@@ -7,6 +7,7 @@
 
 #include "drv/vga.h"
 #include "hal/hal.h"	// outb
+#include "sys/vmm.h"
 
 /** Max number of characters that can be displaye horizontally. */
 #define SCREEN_LENGTH 80
@@ -38,6 +39,18 @@ void vga_init(vga_color fg, vga_color bg)	{
 }
 
 
+void vga_map_wc()	{
+	// The identity mapping is uncached through the MTRRs and no longer used
+	if(vmm_map_page(SCREEN_ADDR, VGA_TEXT_VIRT_ADDR,
+		X86_PAGE_WRITABLE | X86_PAGE_NOEXEC | VMM_CACHE_WC) != VMM_SUCCESS)
+		return;
+
+	spinlock_acquire(&screen.lock);
+	screen.mem = (uint16_t*)VGA_TEXT_VIRT_ADDR;
+	spinlock_release(&screen.lock);
+}
+
+
 void vga_putc(char ch)	{
 	uint16_t write = (uint16_t)ch + ((uint16_t)screen.color << 8);
 
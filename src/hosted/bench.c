@@ -0,0 +1,658 @@
+/**
+* \file bench.c
+* Run the tests and benchmarks for the memory subsystems as a Linux program.
+* The kernel is "booted" with a simulated multiboot memory map and then the
+* same functions as in the kernel are called. The time of each operation is
+* measured to find the latency percentiles, the cost of reading the clock is
+* subtracted.
+*
+* Usage: hosted [test|bench|all] [-m MB] [-n ops] [-t threads] [-v]
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sys/kernel.h"
+#include "sys/multiboot1.h"
+#include "sys/pmm.h"
+#include "sys/vmm.h"
+#include "sys/vma.h"
+#include "sys/heap.h"
+#include "sys/dllist.h"
+#include "hal/hal.h"
+
+#include "hosted.h"
+
+
+cpu_info cpus[MAX_CPUS];
+
+
+/** Size of simulated physical memory in MB. */
+static uint32_t bench_mem = 128;
+
+/** Number of operations in each benchmark. */
+static uint32_t bench_ops = 100000;
+
+/** Number of threads (CPUs) in the parallel benchmark. */
+static uint32_t bench_threads = 4;
+
+/** Time it takes to read the clock, subtracted from each measurement. */
+static uint64_t bench_clock_ns = 0;
+
+/**
+* Physical address of each mapped kernel page, for vmm_virt_to_phys. Indexed
+* by virt / KB4, 0 if not mapped.
+*/
+static paddr_t* bench_phys = NULL;
+
+/** Number of live allocations in the heap benchmark. */
+#define BENCH_HEAP_SLOTS 512
+
+/** Largest allocation in the heap benchmark. */
+#define BENCH_HEAP_MAX_SZ 1024
+
+/** Number of elements in the dllist benchmark, inserting is O(n). */
+#define BENCH_DLLIST_SZ 2000
+
+/** Bytes in each memcpy and memset. */
+#define BENCH_STRING_SZ 4096
+
+/** Frames asked for in each call to pmm_alloc_batch. */
+#define BENCH_BATCH 64
+
+
+/** Time op and store the latency in lat[i]. */
+#define bench_time(lat, i, op) {\
+	uint64_t _t = hosted_ns();\
+	op;\
+	_t = hosted_ns() - _t;\
+	lat[i] = (uint32_t)((_t > bench_clock_ns) ? _t - bench_clock_ns : 0);\
+}
+
+/**
+* Data for one thread in the parallel benchmark.
+*/
+typedef struct	{
+	int cpu;
+	uint32_t ops;
+	uint32_t* frames;
+	uint32_t* lat_alloc, * lat_free;
+} bench_thread;
+
+
+/** Simple generator for random numbers, the same sequence every time. */
+static uint32_t bench_rand_state = 1;
+static inline uint32_t bench_rand()	{
+	bench_rand_state = bench_rand_state * 1103515245 + 12345;
+	return bench_rand_state >> 8;
+}
+
+static int bench_cmp_lat(const void* a, const void* b)	{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+* Print ops/sec and the latency percentiles of one operation.
+* \param[in] name Name of the operation.
+* \param[in] lat Latency of each operation, the array is sorted.
+* \param[in] n Number of operations.
+* \param[in] ns Wall-clock time in ns, if 0 the sum of lat is used.
+*/
+static void bench_report(const char* name, uint32_t* lat, uint32_t n, uint64_t ns)	{
+	uint32_t i;
+	if(n == 0)	return;
+	if(ns == 0)	{
+		for(i = 0; i < n; i++)	ns += lat[i];
+	}
+	if(ns == 0)	ns = 1;
+	qsort(lat, n, sizeof(uint32_t), bench_cmp_lat);
+	printf("%-26s %8u %12llu %7u %7u %7u %7u %8u\n", name, n,
+		(unsigned long long)((uint64_t)n * 1000000000ULL / ns),
+		lat[n / 2], lat[(uint64_t)n * 90 / 100], lat[(uint64_t)n * 99 / 100],
+		lat[(uint64_t)n * 999 / 1000], lat[n - 1]);
+}
+
+/** Median time of reading the clock twice. */
+static uint64_t bench_clock_cost()	{
+	uint32_t lat[1001], i;
+	for(i = 0; i < 1001; i++)	{
+		uint64_t t = hosted_ns();
+		lat[i] = (uint32_t)(hosted_ns() - t);
+	}
+	qsort(lat, 1001, sizeof(uint32_t), bench_cmp_lat);
+	return lat[500];
+}
+
+
+
+
+//---------------- Simulated paging ------------------------
+
+/*
+* The page tables can not be used on Linux, the pages are instead mapped with
+* hosted_map. The kernel prototypes are used here, since paddr_t depends on
+* PAE_ENABLE.
+*/
+
+/** Remember the physical address of [virt, virt+size). */
+static void bench_set_phys(paddr_t phys, uint32_t virt, uint32_t size)	{
+	uint32_t i;
+	if(virt >= USERMODE_START)	return;
+	for(i = 0; i < size / KB4; i++)
+		bench_phys[(virt / KB4) + i] = (phys == 0) ? 0 : phys + (i * KB4);
+}
+
+int vmm_map_page(paddr_t phys, uint32_t virt, uint32_t acl)	{
+	(void)acl;
+	if(hosted_map(phys, virt, KB4) != 0)	return VMM_ERR_PAGE_IN_USE;
+	bench_set_phys(phys, virt, KB4);
+	return VMM_SUCCESS;
+}
+
+bool vmm_large_pages()	{
+	return true;
+}
+
+int vmm_map_large_page(paddr_t phys, uint32_t virt, uint32_t acl)	{
+	(void)acl;
+	if((phys % VMM_LARGE_PAGE_SZ) != 0 || (virt % VMM_LARGE_PAGE_SZ) != 0)
+		return VMM_ERR_NOT_ALIGNED;
+	if(hosted_map(phys, virt, VMM_LARGE_PAGE_SZ) != 0)	return VMM_ERR_PAGE_IN_USE;
+	bench_set_phys(phys, virt, VMM_LARGE_PAGE_SZ);
+	return VMM_SUCCESS;
+}
+
+int vmm_map_range(paddr_t phys, uint32_t virt, uint32_t size, uint32_t acl)	{
+	(void)acl;
+	if((phys % KB4) != 0 || (virt % KB4) != 0 || (size % KB4) != 0)
+		return VMM_ERR_NOT_ALIGNED;
+	if(hosted_map(phys, virt, size) != 0)	return VMM_ERR_PAGE_IN_USE;
+	bench_set_phys(phys, virt, size);
+	return VMM_SUCCESS;
+}
+
+uint32_t vmm_map_frames(uint32_t* frames, uint32_t virt, uint32_t n, uint32_t acl)	{
+	uint32_t i, ret = 0;
+	for(i = 0; i < n; i++)	{
+		if(vmm_map_page(frames[i], virt + (i * KB4), acl) != VMM_SUCCESS)	continue;
+		frames[i] = 0;
+		ret++;
+	}
+	return ret;
+}
+
+int vmm_unmap_page(uint32_t virt)	{
+	bench_set_phys(0, virt, KB4);
+	return hosted_unmap(virt, KB4);
+}
+
+int vmm_unmap_range(uint32_t virt, uint32_t size)	{
+	bench_set_phys(0, virt, size);
+	return hosted_unmap(virt, size);
+}
+
+paddr_t vmm_virt_to_phys(uint32_t virt)	{
+	if(virt >= USERMODE_START || bench_phys[virt / KB4] == 0)	return 0;
+	return bench_phys[virt / KB4] + (virt % KB4);
+}
+
+int vmm_map_zero_page(uint32_t virt, uint32_t acl)	{
+	(void)virt;
+	(void)acl;
+	return VMM_ERR_PAGE_IN_USE;
+}
+
+paddr_t vmm_reclaim_page(uint32_t virt, tlb_batch* tlb, bool* dirty)	{
+	// The simulated memory has no accessed and dirty bits, nothing is taken
+	(void)virt;
+	(void)tlb;
+	*dirty = false;
+	return 0;
+}
+
+bool vmm_swap_finish(uint32_t virt, paddr_t frame, uint32_t slot)	{
+	(void)virt;
+	(void)frame;
+	(void)slot;
+	return false;
+}
+
+int vmm_swap_in(uint32_t virt, uint32_t acl)	{
+	(void)virt;
+	(void)acl;
+	return VMM_ERR_NOT_SWAPPED;
+}
+
+void* vmm_kmap(paddr_t phys)	{
+	// The simulated frames are at their own address
+	return (void*)(uint32_t)phys;
+}
+
+void vmm_kunmap(void* virt)	{
+	(void)virt;
+}
+
+void tlb_batch_init(tlb_batch* b)	{
+	b->count = 0;
+	b->all = false;
+	b->kernel = false;
+}
+
+void tlb_batch_add(tlb_batch* b, uint32_t virt)	{
+	(void)b;
+	(void)virt;
+}
+
+void tlb_batch_flush(tlb_batch* b)	{
+	tlb_batch_init(b);
+}
+
+void tlb_poll()	{
+}
+
+int hosted_page_fault(uint32_t addr)	{
+	// Only kernel areas are used here, they always get a frame of their own
+	return vma_handle_fault(addr, true) ? 0 : -1;
+}
+
+void vmm_zero_page(paddr_t phys)	{
+	memset((void*)(uint32_t)phys, 0x00, KB4);
+}
+
+
+
+
+//---------------- Simulated boot ------------------------
+
+/**
+* Create the memory, the multiboot memory map and initialize the physical
+* memory manager and the reference counts, the same as in kmain.
+*/
+static void hosted_boot()	{
+	multiboot_mmap* mmap = (multiboot_mmap*)HOSTED_MMAP_ADDR;
+	uint32_t end = bench_mem * MB1;
+	bench_phys = calloc(USERMODE_START / KB4, sizeof(paddr_t));
+	if(bench_phys == NULL || hosted_mem_init(end) != 0)	exit(1);
+
+	// 0 - HOSTED_LOW_START is not accessible, so it is reported as reserved
+	mmap[0] = (multiboot_mmap){20, 0, 0, HOSTED_LOW_START, 0, 2};
+	mmap[1] = (multiboot_mmap){20, HOSTED_LOW_START, 0,
+		HOSTED_LOW_END - HOSTED_LOW_START, 0, 1};
+	mmap[2] = (multiboot_mmap){20, HOSTED_LOW_END, 0,
+		HOSTED_HIGH_START - HOSTED_LOW_END, 0, 2};
+	mmap[3] = (multiboot_mmap){20, HOSTED_HIGH_START, 0,
+		end - HOSTED_HIGH_START, 0, 1};
+
+	init_pmm(mmap, sizeof(multiboot_mmap) * 4);
+	pmm_refs_init();
+}
+
+
+
+
+//---------------- Tests ------------------------
+
+/**
+* Take all the memory, one block at a time, check that no block is handed out
+* twice and that the counters are correct when everything is given back.
+*/
+static int hosted_test_pmm()	{
+	uint32_t before = pmm_free_blocks(), n = 0, i;
+	uint32_t blocks = bench_mem * (MB1 / 4096);
+	uint8_t* seen = calloc(blocks, 1);
+	uint32_t* frames = malloc(sizeof(uint32_t) * blocks);
+	void* frame;
+	int ret = 0;
+
+	while((frame = pmm_alloc_first()) != NULL)	{
+		uint32_t b = (uint32_t)frame / 4096;
+		if(b >= blocks || seen[b] || !pmm_is_taken(b))	{
+			ret = 1;
+			break;
+		}
+		seen[b] = 1;
+		frames[n++] = (uint32_t)frame;
+	}
+	if(ret == 0 && pmm_free_blocks() != 0)	ret = 2;
+
+	// Must not hand out inaccessible memory
+	if(ret == 0 && (seen[0] || seen[HOSTED_LOW_START / 4096 - 1]))	ret = 3;
+
+	pmm_free_batch(frames, n);
+	// Some of the blocks can be left in the cache
+	if(ret == 0 && pmm_free_blocks() + PMM_CPU_CACHE_SZ < before)	ret = 4;
+
+	// Zones
+	frame = pmm_alloc_zone(PMM_ZONE_DMA, 16);
+	if(ret == 0 && (frame == NULL || (uint32_t)frame + 16 * 4096 > PMM_ZONE_DMA_END))
+		ret = 5;
+	for(i = 0; frame != NULL && i < 16; i++)	pmm_free((void*)((uint32_t)frame + i * 4096));
+
+	// Aligned runs, as used for 4 MB pages
+	frame = pmm_alloc_aligned(1024, 1024);
+	if(ret == 0 && (frame == NULL || ((uint32_t)frame % MB4) != 0))	ret = 6;
+	for(i = 0; frame != NULL && i < 1024; i++)	pmm_free((void*)((uint32_t)frame + i * 4096));
+
+	frame = pmm_alloc_aligned(40, 64);
+	if(ret == 0 && (frame == NULL || ((uint32_t)frame % (64 * 4096)) != 0))	ret = 7;
+	for(i = 0; frame != NULL && i < 40; i++)	pmm_free((void*)((uint32_t)frame + i * 4096));
+	if(ret == 0 && pmm_alloc_aligned(1, 3) != NULL)	ret = 8;
+
+	// Freeing a cached block twice must not hand it out twice
+	frame = pmm_alloc_first();
+	pmm_free(frame);
+	pmm_free(frame);
+	pmm_free_batch((uint32_t*)&frame, 1);
+	void* a = pmm_alloc_first(), * b = pmm_alloc_first();
+	if(ret == 0 && (frame == NULL || a != frame || b == frame))	ret = 9;
+	pmm_free(a);
+	pmm_free(b);
+
+	free(seen);
+	free(frames);
+	return ret;
+}
+
+/**
+* Reference counts, as used for copy-on-write.
+*/
+static int hosted_test_refs()	{
+	paddr_t frame = pmm_alloc_phys(), other = pmm_alloc_phys();
+	int ret = 0;
+	if(frame == 0 || other == 0)	return 1;
+	if(pmm_ref_count(frame) != 0)	ret = 2;
+
+	pmm_ref_inc(frame);
+	pmm_ref_inc(frame);
+	if(ret == 0 && (pmm_ref_count(frame) != 2 || pmm_ref_count(other) != 0))
+		ret = 3;
+	if(ret == 0 && pmm_ref_dec(frame) != 1)	ret = 4;
+	if(ret == 0 && pmm_ref_dec(frame) != 0)	ret = 5;
+
+	pmm_free_phys(frame);
+	pmm_free_phys(other);
+	return ret;
+}
+
+/**
+* Run the tests in the same order as kmain does.
+*/
+static bool hosted_run_tests()	{
+	unit_test tests[3] = {
+		hosted_test_pmm,
+		hosted_test_refs,
+		NULL
+	};
+	bool ok = true;
+
+	ok = ok && pmm_run_all_tests_before();
+	hosted_boot();
+	ok = ok && string_run_all_tests();
+	ok = ok && lz4_run_all_tests();
+
+	// The heap test expects an empty heap
+	heap_init();
+	ok = ok && heap_run_all_tests();
+	ok = ok && dllist_run_all_tests();
+	ok = ok && vma_run_all_tests();
+	ok = ok && zswap_run_all_tests();
+	ok = ok && kernel_generic_unit_test(tests, "hosted_run_tests()");
+
+	printf("Tests %s\n", ok ? "passed" : "FAILED");
+	return ok;
+}
+
+
+
+
+//---------------- Benchmarks ------------------------
+
+static void bench_pmm_single(uint32_t* lat, uint32_t* frames)	{
+	uint32_t i, n;
+	for(n = 0; n < bench_ops; n++)	{
+		void* frame;
+		bench_time(lat, n, frame = pmm_alloc_first());
+		if(frame == NULL)	break;
+		frames[n] = (uint32_t)frame;
+	}
+	bench_report("pmm_alloc_first", lat, n, 0);
+
+	for(i = 0; i < n; i++)	{
+		bench_time(lat, i, pmm_free((void*)frames[i]));
+	}
+	bench_report("pmm_free", lat, n, 0);
+}
+
+static void bench_pmm_batch(uint32_t* lat, uint32_t* frames)	{
+	uint32_t i, calls = 0, got;
+	while((calls + 1) * BENCH_BATCH <= bench_ops)	{
+		uint32_t* f = frames + calls * BENCH_BATCH;
+		bench_time(lat, calls, got = pmm_alloc_batch(f, BENCH_BATCH));
+
+		// Out of memory, only full batches are measured
+		if(got < BENCH_BATCH)	{
+			pmm_free_batch(f, got);
+			break;
+		}
+		calls++;
+	}
+	bench_report("pmm_alloc_batch(64)", lat, calls, 0);
+
+	for(i = 0; i < calls; i++)	{
+		bench_time(lat, i, pmm_free_batch(frames + i * BENCH_BATCH, BENCH_BATCH));
+	}
+	bench_report("pmm_free_batch(64)", lat, calls, 0);
+}
+
+static void bench_pmm_zeroed(uint32_t* lat, uint32_t* frames)	{
+	uint32_t n;
+	pmm_zero_stats st;
+
+	// Half the time the pool is full, to see both cases
+	for(n = 0; n < bench_ops; n++)	{
+		void* frame;
+		if(n % (2 * PMM_ZERO_POOL_SZ) == 0)	{
+			while(pmm_zero_pool_fill() != 0);
+		}
+		bench_time(lat, n, frame = pmm_alloc_zeroed());
+		if(frame == NULL)	break;
+		frames[n] = (uint32_t)frame;
+	}
+	bench_report("pmm_alloc_zeroed", lat, n, 0);
+	pmm_free_batch(frames, n);
+
+	pmm_zero_pool_stats(&st);
+	printf("%-26s hits %u misses %u\n", "  zero pool", st.hits, st.misses);
+}
+
+static void* bench_pmm_thread(void* arg)	{
+	bench_thread* t = (bench_thread*)arg;
+	uint32_t i;
+	hosted_set_cpu(t->cpu);
+
+	for(i = 0; i < t->ops; i++)	{
+		void* frame;
+		bench_time(t->lat_alloc, i, frame = pmm_alloc_first());
+		if(frame == NULL)	PANIC("Out of memory");
+		t->frames[i] = (uint32_t)frame;
+	}
+	for(i = 0; i < t->ops; i++)	{
+		bench_time(t->lat_free, i, pmm_free((void*)t->frames[i]));
+	}
+	return NULL;
+}
+
+static void bench_pmm_parallel(uint32_t* lat, uint32_t* frames)	{
+	pthread_t threads[MAX_CPUS];
+	bench_thread data[MAX_CPUS];
+	uint32_t* lat_free = malloc(sizeof(uint32_t) * bench_ops);
+	uint32_t i, per = bench_ops;
+	char name[32];
+	uint64_t start;
+
+	// Leave some memory, so that no thread runs out
+	if(per > pmm_free_blocks() / 2)	per = pmm_free_blocks() / 2;
+	per /= bench_threads;
+
+	for(i = 0; i < bench_threads; i++)	{
+		data[i].cpu = i;
+		data[i].ops = per;
+		data[i].frames = frames + i * per;
+		data[i].lat_alloc = lat + i * per;
+		data[i].lat_free = lat_free + i * per;
+	}
+
+	start = hosted_ns();
+	for(i = 0; i < bench_threads; i++)
+		pthread_create(&threads[i], NULL, bench_pmm_thread, &data[i]);
+	for(i = 0; i < bench_threads; i++)
+		pthread_join(threads[i], NULL);
+	start = hosted_ns() - start;
+
+	// Each thread did both alloc and free, so the throughput is for both
+	sprintf(name, "pmm_alloc_first x%u", bench_threads);
+	bench_report(name, lat, per * bench_threads, start);
+	sprintf(name, "pmm_free x%u", bench_threads);
+	bench_report(name, lat_free, per * bench_threads, start);
+	free(lat_free);
+}
+
+static void bench_heap(uint32_t* lat, uint32_t* lat_free)	{
+	void* slots[BENCH_HEAP_SLOTS] = {0};
+	uint32_t i, n_alloc = 0, n_free = 0;
+
+	for(i = 0; i < bench_ops; i++)	{
+		uint32_t s = bench_rand() % BENCH_HEAP_SLOTS;
+		if(slots[s] == NULL)	{
+			uint32_t sz = 1 + bench_rand() % BENCH_HEAP_MAX_SZ;
+			bench_time(lat, n_alloc, slots[s] = heap_malloc(sz));
+			n_alloc++;
+		}
+		else	{
+			bench_time(lat_free, n_free, heap_free(slots[s]));
+			slots[s] = NULL;
+			n_free++;
+		}
+	}
+	for(i = 0; i < BENCH_HEAP_SLOTS; i++)	{
+		if(slots[i] != NULL)	heap_free(slots[i]);
+	}
+	bench_report("heap_malloc", lat, n_alloc, 0);
+	bench_report("heap_free", lat_free, n_free, 0);
+}
+
+static int8_t bench_dllist_lessthan(void* a, void* b)	{
+	return *(uint32_t*)a < *(uint32_t*)b;
+}
+
+static int8_t bench_dllist_find(void* a, void* b)	{
+	return (*(uint32_t*)a == *(uint32_t*)b) ? 0 : 1;
+}
+
+static void bench_dllist(uint32_t* lat, uint32_t* vals)	{
+	dllist_head* l = dllist_init(NULL, bench_dllist_lessthan, bench_dllist_find);
+	uint32_t i;
+
+	for(i = 0; i < BENCH_DLLIST_SZ; i++)	vals[i] = bench_rand();
+	for(i = 0; i < BENCH_DLLIST_SZ; i++)	{
+		bench_time(lat, i, dllist_insert(l, &vals[i]));
+	}
+	bench_report("dllist_insert", lat, BENCH_DLLIST_SZ, 0);
+
+	for(i = 0; i < BENCH_DLLIST_SZ; i++)	{
+		bench_time(lat, i, dllist_remove(l, &vals[i]));
+	}
+	bench_report("dllist_remove", lat, BENCH_DLLIST_SZ, 0);
+	heap_free(l);
+}
+
+static void bench_string(uint32_t* lat)	{
+	uint8_t* src = heap_malloc(BENCH_STRING_SZ - sizeof(LLMalloc)),
+		* dst = heap_malloc(BENCH_STRING_SZ - sizeof(LLMalloc));
+	uint32_t i, sz = BENCH_STRING_SZ - sizeof(LLMalloc);
+
+	for(i = 0; i < bench_ops; i++)	{
+		bench_time(lat, i, memset(dst, (int8_t)i, sz));
+	}
+	bench_report("memset(4080)", lat, bench_ops, 0);
+
+	for(i = 0; i < bench_ops; i++)	{
+		bench_time(lat, i, memcpy(dst, src, sz));
+	}
+	bench_report("memcpy(4080)", lat, bench_ops, 0);
+
+	heap_free(src);
+	heap_free(dst);
+}
+
+static void hosted_run_benchmarks()	{
+	uint32_t* lat = malloc(sizeof(uint32_t) * bench_ops);
+	uint32_t* lat2 = malloc(sizeof(uint32_t) * bench_ops);
+	uint32_t* frames = malloc(sizeof(uint32_t) * bench_ops);
+
+	bench_clock_ns = bench_clock_cost();
+	printf("%u MB memory, %u ops, clock overhead %u ns subtracted\n",
+		bench_mem, bench_ops, (uint32_t)bench_clock_ns);
+	printf("%-26s %8s %12s %7s %7s %7s %7s %8s\n", "operation (ns)", "ops",
+		"ops/sec", "p50", "p90", "p99", "p99.9", "max");
+
+	bench_pmm_single(lat, frames);
+	bench_pmm_batch(lat, frames);
+	bench_pmm_zeroed(lat, frames);
+	if(bench_threads > 1)	bench_pmm_parallel(lat, frames);
+	bench_heap(lat, lat2);
+	bench_dllist(lat, frames);
+	bench_string(lat);
+
+	pmm_print_stats(K_LOW_INFO);
+
+	free(lat);
+	free(lat2);
+	free(frames);
+}
+
+
+
+
+int main(int argc, char** argv)	{
+	bool test = true, bench = true;
+	int i;
+
+	for(i = 1; i < argc; i++)	{
+		if(strcmp(argv[i], "test") == 0)	bench = false;
+		else if(strcmp(argv[i], "bench") == 0)	test = false;
+		else if(strcmp(argv[i], "all") == 0)	test = bench = true;
+		else if(strcmp(argv[i], "-v") == 0)	hosted_kprintf_level = K_BOCHS_OUT;
+		else if(i + 1 < argc && strcmp(argv[i], "-m") == 0)
+			bench_mem = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			bench_ops = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			bench_threads = atoi(argv[++i]);
+		else	{
+			printf("Usage: %s [test|bench|all] [-m MB] [-n ops] [-t threads] [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	// Memory must be below the heap and there must be room for the metadata
+	if(bench_mem < 4 || bench_mem * MB1 > HEAP_START || bench_ops == 0 ||
+		bench_threads == 0 || bench_threads > MAX_CPUS)	{
+		printf("Memory must be 4 - %u MB, threads 1 - %u\n",
+			HEAP_START / MB1, MAX_CPUS);
+		return 1;
+	}
+
+	if(test)	{
+		if(hosted_run_tests() == false)	return 1;
+	}
+	else	{
+		hosted_boot();
+		heap_init();
+	}
+
+	if(bench)	hosted_run_benchmarks();
+	return 0;
+}
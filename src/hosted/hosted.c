@@ -0,0 +1,151 @@
+/**
+* \file hosted.c
+* Replacements for the parts of the kernel that are not built on Linux. This
+* file is built against the C library, not the kernel headers, so the
+* prototypes are repeated here and must match the kernel.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "hosted.h"
+
+
+/** Same as K_LOW_INFO in lib/stdio.h. */
+int hosted_kprintf_level = 2;
+
+/** File that holds the physical memory. */
+static int hosted_mem_fd = -1;
+
+static __thread int hosted_cpu = 0;
+
+
+/**
+* Map the physical range [start, end) at the same virtual address.
+*/
+static int hosted_map_identity(uint32_t start, uint32_t end);
+
+/**
+* Handle SIGSEGV as a page fault, if the page can not be mapped the default
+* action is restored so the access crashes when it is tried again.
+*/
+static void hosted_segv(int sig, siginfo_t* info, void* ctx);
+
+
+//---------------- Simulated hardware ------------------------
+
+int hosted_mem_init(uint32_t size)	{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = hosted_segv;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGSEGV, &sa, NULL) != 0)	{
+		perror("sigaction");
+		return -1;
+	}
+
+	hosted_mem_fd = memfd_create("frod-physical", 0);
+	if(hosted_mem_fd < 0 || ftruncate(hosted_mem_fd, size) != 0)	{
+		perror("memfd");
+		return -1;
+	}
+
+	// Low memory is also needed for the map, which is in reserved memory
+	if(hosted_map_identity(HOSTED_LOW_START, HOSTED_MMAP_ADDR + 0x1000) != 0)
+		return -1;
+	return hosted_map_identity(HOSTED_HIGH_START, size);
+}
+
+void hosted_set_cpu(int id)	{
+	hosted_cpu = id;
+}
+
+uint64_t hosted_ns()	{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+int hosted_map(uint64_t phys, uint32_t virt, uint32_t size)	{
+	void* ret = mmap((void*)(uintptr_t)virt, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED_NOREPLACE, hosted_mem_fd, (off_t)phys);
+	return (ret == MAP_FAILED) ? -1 : 0;
+}
+
+int hosted_unmap(uint32_t virt, uint32_t size)	{
+	return munmap((void*)(uintptr_t)virt, size);
+}
+
+int lapic_cpuid()	{
+	return hosted_cpu;
+}
+
+uint32_t interrupt_enabled()	{
+	return 0;
+}
+
+
+//---------------- Kernel functions ------------------------
+
+int kprintf(int kl, const char* fmt, ...)	{
+	int ret = 0;
+	va_list args;
+	if(kl < hosted_kprintf_level)	return 0;
+
+	va_start(args, fmt);
+	ret = vprintf(fmt, args);
+	va_end(args);
+	return ret;
+}
+
+void panic(const char* msg, const char* file, uint32_t line)	{
+	fflush(stdout);
+	fprintf(stderr, "PANIC: %s:%u: %s\n", file, line, msg);
+	abort();
+}
+
+bool kernel_generic_unit_test(int (**tests)(), const char* func)	{
+	int res = 0, count = 0;
+	do	{
+		if( (res = (*tests[count])()) != 0)	{
+			printf("%s: INDEX: %i FAILED: %i\n", func, count, res);
+			return false;
+		}
+		count++;
+	} while(tests[count] != NULL);
+
+	return true;
+}
+
+
+
+
+//----------------- Internal function implementations -----------------
+
+static int hosted_map_identity(uint32_t start, uint32_t end)	{
+	void* ret = mmap((void*)(uintptr_t)start, end - start, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED_NOREPLACE, hosted_mem_fd, start);
+	if(ret == MAP_FAILED)	{
+		fprintf(stderr, "Unable to map 0x%x - 0x%x: ", start, end);
+		perror("");
+		return -1;
+	}
+	return 0;
+}
+
+static void hosted_segv(int sig, siginfo_t* info, void* ctx)	{
+	(void)ctx;
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	if(addr > UINT32_MAX || hosted_page_fault((uint32_t)addr) != 0)
+		signal(sig, SIG_DFL);
+}
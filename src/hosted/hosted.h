@@ -0,0 +1,78 @@
+/**
+* \file hosted.h
+* Interface between the kernel code built for Linux (bench.c) and the parts
+* that need the C library (hosted.c). Both sides include this file, so it must
+* not depend on any other header from the kernel or the C library.
+*
+* Physical memory is simulated with a memory file where offset X is physical
+* address X. The usable parts are mapped at the same virtual address, the same
+* way as the first 4 MB are identity mapped in the kernel, and vmm_map_page
+* (in bench.c) maps the same file page at a second address.
+*/
+
+#ifndef __HOSTED_H
+#define __HOSTED_H
+
+#include <stdint.h>
+
+
+/** First address of usable low memory, Linux does not allow mappings below. */
+#define HOSTED_LOW_START 0x10000
+
+/** End of usable low memory, the rest up to 1 MB is reserved (EBDA, BIOS). */
+#define HOSTED_LOW_END 0x9F000
+
+/** Where the simulated multiboot memory map is stored, in reserved memory. */
+#define HOSTED_MMAP_ADDR HOSTED_LOW_END
+
+/** Start of memory above 1 MB. */
+#define HOSTED_HIGH_START 0x100000
+
+
+/**
+* Create the simulated physical memory and map the usable parts.
+* \param[in] size Bytes of physical memory, including the first MB.
+* \return Returns 0 on success, -1 on failure.
+*/
+int hosted_mem_init(uint32_t size);
+
+/**
+* Map part of the simulated physical memory, used for vmm_map_page.
+* \param[in] phys Physical address, must be aligned to 4 KB.
+* \param[in] virt Virtual address, must be aligned to 4 KB.
+* \param[in] size Number of bytes.
+* \return Returns 0 on success, -1 if any part of virt is already mapped.
+*/
+int hosted_map(uint64_t phys, uint32_t virt, uint32_t size);
+
+/**
+* Called on SIGSEGV, the same as the not-present branch of
+* vmm_handle_page_fault. Implemented in bench.c.
+* \param[in] addr The address that was accessed.
+* \return Returns 0 if the page was mapped, -1 otherwise.
+*/
+int hosted_page_fault(uint32_t addr);
+
+/**
+* Remove a mapping made with hosted_map.
+* \return Returns 0 on success, -1 on failure.
+*/
+int hosted_unmap(uint32_t virt, uint32_t size);
+
+/**
+* Set which CPU the current thread is, returned by lapic_cpuid.
+* \param[in] id Value from 0 to MAX_CPUS-1.
+*/
+void hosted_set_cpu(int id);
+
+/** Monotonic time in nanoseconds. */
+uint64_t hosted_ns();
+
+/**
+* Print messages from kprintf with a level at or above this. Default is
+* K_LOW_INFO, which is what the tests use.
+*/
+extern int hosted_kprintf_level;
+
+
+#endif
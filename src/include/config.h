@@ -42,6 +42,48 @@
 
 
 
+//-------------------------- Physical memory ------------------------------
+
+/**
+* Number of free frames each CPU keeps in its local cache. Single frames are
+* allocated and freed from this cache without touching the global bitmap.
+*/
+#define PMM_CPU_CACHE_SZ 32
+
+/**
+* Number of frames moved between a CPU cache and the global bitmap each time the
+* cache is empty or full. Must be lower than PMM_CPU_CACHE_SZ.
+*/
+#define PMM_CPU_CACHE_BATCH 16
+
+/**
+* Which allocator the physical memory manager uses, see pmm_backend.h. The
+* bitmap is used if this is false and the buddy system if it is true. The buddy
+* system is better at keeping large consecutive regions of memory, e.g. for DMA.
+*/
+#define PMM_USE_BUDDY false
+
+/**
+* Highest order in the buddy system, the largest block is 2^order * 4 KB.
+*/
+#define PMM_BUDDY_MAX_ORDER 10
+
+/**
+* Number of frames that are zeroed ahead of time, when the CPUs are idle, and
+* handed out by pmm_alloc_zeroed.
+*/
+#define PMM_ZERO_POOL_SZ 64
+
+/**
+* Max number of frames zeroed each time the idle loop refills the pool, lower
+* values make the idle loop check for other work more often.
+*/
+#define PMM_ZERO_POOL_BATCH 8
+
+
+
+
+
 //-------------------------- Virtual memory -------------------------------
 
 /**
@@ -52,16 +94,68 @@
 #define USE_VIRTUAL_MEMORY true
 
 /**
-* Should be able to define this here and use pmm and vmm sizes accordingly. Must
-* also set the appropriate bit for the CPU. Is only possible if PAE is NOT used.
-* See address translation on section 4.3 in I3A. If PAE is enabled, this can
-* mean 2MB pages, which is allowed.
+* Use large pages for large kernel regions that are aligned to them, the
+* identity map of the first 4 MB and each heap block (HEAP_BLOCKS). This saves
+* TLB entries and page tables. Without PAE the pages are 4 MB (PSE) and if the
+* CPU does not support PSE, 4 KB pages are used instead. With PAE the pages are
+* 2 MB. See address translation on section 4.3 and 4.4 in I3A.
+*/
+#define PAGES_LARGE true
+
+/**
+* Mark the kernel pages below KERNEL_MAX_VM as global and enable CR4.PGE, if
+* the CPU supports it. They are the same in all address spaces, so they are
+* kept in the TLB when CR3 is loaded on a task switch, only the user pages are
+* flushed. See section 4.10.2.4 in I3A.
+*/
+#define PAGES_GLOBAL true
+
+/**
+* Program the page attribute table (PAT) if the CPU has it, so that pages can
+* be mapped write-combining (VMM_CACHE_WC). The VGA memory is then written in
+* bursts instead of one uncached write at a time. Without PAT write-combining
+* pages are uncached. See section 11.12 in I3A.
+*/
+#define PAGES_PAT true
+
+/**
+* Reserve the kernel heap as a demand-zero area (vma.h), a frame is only
+* allocated when a page is touched the first time. This saves memory when only
+* part of a heap block is used, but the heap is then mapped with 4 KB pages,
+* PAGES_LARGE is not used for it.
+*/
+#define DEMAND_PAGING true
+
+/**
+* Reclaim pages when fewer frames than this are free, see reclaim.h. Clean
+* pages in demand-zero areas are then taken back by the idle loop and on page
+* faults, so that allocation slows down before memory runs out.
+*/
+#define RECLAIM_LOW_BLOCKS 256
+
+/**
+* Max number of pages the CLOCK hand looks at in one call to reclaim_pages,
+* this bounds the time a page fault can spend on reclaim.
+*/
+#define RECLAIM_MAX_SCAN 4096
+
+/**
+* Compress the dirty user pages reclaim takes instead of keeping them, see
+* zswap.h. Without it only clean pages can be reclaimed.
+*/
+#define ZSWAP_ENABLE true
+
+/**
+* Max MB of memory used for the compressed pages, the arena is reserved in the
+* kernel part of virtual memory.
 */
-#define PAGES_4MB 0
+#define ZSWAP_MB 16
 
 /**
 * Enable PAE extension. See section 4.4 in I3A. This is needed to use
-* execute-disable, see 5.13 in I3A.
+* execute-disable, see 5.13 in I3A, pages mapped with X86_PAGE_NOEXEC can then
+* not be executed if the CPU supports it. With PAE, the physical memory manager
+* also tracks memory above 4 GB (PMM_ZONE_HIGH), up to 64 GB.
 */
 #define PAE_ENABLE false
 
@@ -61,6 +61,12 @@ typedef struct {
 */
 void vga_init(vga_color fg, vga_color bg);
 
+/**
+* Write to the screen through a write-combining mapping (VMM_CACHE_WC), the
+* writes are then combined in bursts. Must be called after vmm_init.
+*/
+void vga_map_wc();
+
 /**
 * Place one character on the screen. This also handle \\n, \\r etc.
 * \param[in] ch The character that should be printed.
@@ -13,6 +13,7 @@
 
 #include "../sys/kernel.h"
 #include "../sys/process.h"
+#include "../sys/pmm.h"
 
 #include "isr.h"
 #include "gdt.h"
@@ -59,6 +60,17 @@ typedef struct	cpu	{
 
 	tss_entry tss;
 
+	/** Free physical blocks owned by this CPU. */
+	pmm_cpu_cache frames;
+
+	/**
+	* Physical address of the page directory this CPU has loaded, used to find
+	* which CPUs must flush a user address, see tlb.h.
+	*/
+	volatile uint32_t pdir;
+
+	/** Number of kmap slots this CPU has in use, see vmm_kmap. */
+	uint32_t kmap_used;
 
 	struct cpu* cpu;
 //	struct proc* proc;
@@ -80,6 +92,20 @@ int lapic_cpuid();
 bool lapic_install();
 uint32_t lapic_read_version();
 void lapic_start_ap(uint8_t id, uint32_t addr);
+void lapic_send_eoi();
+
+/**
+* Send an interrupt to another CPU and wait until it has been accepted.
+* \param[in] id LAPIC ID of the CPU.
+* \param[in] vector The interrupt number.
+*/
+void lapic_send_ipi(uint8_t id, uint8_t vector);
+
+/**
+* Send an interrupt to all CPUs except this one with one write to the ICR.
+* \param[in] vector The interrupt number.
+*/
+void lapic_send_ipi_others(uint8_t vector);
 
 
 /**
@@ -123,6 +149,12 @@ void register_interrupt_handler(uint8_t n, isr_t handler);
 
 uint32_t read_eip();
 
+/**
+* Check if interrupts are enabled on this CPU. Implemented in cpu_asm.s.
+* \return Returns 1 if they are enabled, 0 if they are not.
+*/
+uint32_t interrupt_enabled();
+
 
 /**
 * \ingroup ISR
@@ -163,6 +195,13 @@ enum interrupt_num	{
 #define bochs_break() asm("xchg %bx, %bx")
 
 
+#ifdef HOSTED
+// Built as a normal Linux program (src/hosted), the privileged instructions
+// would fault and there are no interrupts to disable.
+#define enable_int()
+#define clear_int()
+#define halt()
+#else
 /** Enable interrupts */
 #define enable_int() asm("sti")
 
@@ -171,6 +210,7 @@ enum interrupt_num	{
 
 /** Halt the processor. \remark Not a full halt. */
 #define halt() asm("hlt")
+#endif
 
 /** Halt the processor completely. */
 #define full_halt() asm("cli; hlt")
@@ -205,6 +245,57 @@ enum interrupt_num	{
 #define read_cr2(a) asm("mov %%cr2, %0" : "=r" (a))
 
 
+/** Atomically set bit b (0-31) in *a, returns the old value of the bit. */
+static inline bool atomic_bts(volatile uint32_t* a, uint32_t b)	{
+	uint8_t ret;
+	asm volatile("lock btsl %2, %0; setc %1" :
+		"+m" (*a), "=q" (ret) : "r" (b) : "memory", "cc");
+	return ret;
+}
+
+/** Atomically clear bit b (0-31) in *a, returns the old value of the bit. */
+static inline bool atomic_btr(volatile uint32_t* a, uint32_t b)	{
+	uint8_t ret;
+	asm volatile("lock btrl %2, %0; setc %1" :
+		"+m" (*a), "=q" (ret) : "r" (b) : "memory", "cc");
+	return ret;
+}
+
+/**
+* Store n_val in *a if *a is equal to o_val.
+* \return The value *a had before, the store happened if this is o_val.
+*/
+static inline uint32_t cmpxchg(volatile uint32_t* a, uint32_t o_val, uint32_t n_val)	{
+	uint32_t ret;
+	asm volatile("lock cmpxchgl %2, %1" :
+		"=a" (ret), "+m" (*a) : "r" (n_val), "0" (o_val) : "memory", "cc");
+	return ret;
+}
+
+/** Atomically add v to *a, v can be negative. */
+static inline void atomic_add(volatile uint32_t* a, int32_t v)	{
+	asm volatile("lock addl %1, %0" : "+m" (*a) : "r" (v) : "memory", "cc");
+}
+
+/** Atomically add v to *a, returns the value *a had before. */
+static inline uint32_t atomic_xadd(volatile uint32_t* a, int32_t v)	{
+	asm volatile("lock xaddl %0, %1" : "+r" (v), "+m" (*a) : : "memory", "cc");
+	return (uint32_t)v;
+}
+
+/** Read the time-stamp counter, the number of cycles since reset. */
+static inline uint64_t rdtsc()	{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/** Atomically clear the bits in *a that are not set in v. */
+static inline void atomic_and(volatile uint32_t* a, uint32_t v)	{
+	asm volatile("lock andl %1, %0" : "+m" (*a) : "r" (v) : "memory", "cc");
+}
+
+
 /**
 * Send a byte to a given port.
 * Function defined in ports.s
@@ -278,6 +369,27 @@ void load_page_dir_addr(uint32_t addr);
 uint32_t get_page_dir_addr();
 
 
+/** Bit in CR4 for 4 MB pages (page size extension). */
+#define X86_CR4_PSE (1 << 4)
+
+/** Bit in CR4 for PAE paging. */
+#define X86_CR4_PAE (1 << 5)
+
+/** Bit in CR4 for global pages, they are not flushed when CR3 is loaded. */
+#define X86_CR4_PGE (1 << 7)
+
+/**
+* Read the control register CR4. Implemented in memory_asm.s.
+*/
+uint32_t get_cr4();
+
+/**
+* Write the control register CR4. Implemented in memory_asm.s.
+* \param[in] val The new value.
+*/
+void set_cr4(uint32_t val);
+
+
 /**
 * Check if paging is enabled or not. Implemented in memory_asm.s.
 * \return Returns 1 if paging is enabled, 0 if it's not, ZF-flag is also set
@@ -297,6 +409,51 @@ char* get_vendor_id(char* str);
 uint32_t get_eip();
 
 
+/** Bits in the value returned by cpu_features. */
+#define CPUID_FEAT_PSE (1 << 3)
+#define CPUID_FEAT_TSC (1 << 4)
+#define CPUID_FEAT_PGE (1 << 13)
+#define CPUID_FEAT_PAT (1 << 16)
+
+/**
+* Get the feature flags from CPUID (EAX = 1), implemented in cpu_asm.s.
+* \return The value in EDX, use the CPUID_FEAT_* bits.
+*/
+uint32_t cpu_features();
+
+/** Bits in the value returned by cpu_ext_features. */
+#define CPUID_EXT_FEAT_NX (1 << 20)
+
+/**
+* Get the extended feature flags from CPUID (EAX = 0x80000001), implemented in
+* cpu_asm.s.
+* \return The value in EDX, use the CPUID_EXT_FEAT_* bits, 0 if the CPU does
+* not have the extended functions.
+*/
+uint32_t cpu_ext_features();
+
+
+/** Extended feature enable register, bit 11 enables execute-disable. */
+#define MSR_EFER     0xC0000080
+#define MSR_EFER_NXE (1 << 11)
+
+/** Page attribute table, one memory type in each byte. */
+#define MSR_PAT      0x277
+
+/**
+* Read a model specific register, implemented in cpu_asm.s.
+* \param[in] msr Number of the register.
+*/
+uint64_t read_msr(uint32_t msr);
+
+/**
+* Write a model specific register, implemented in cpu_asm.s.
+* \param[in] msr Number of the register.
+* \param[in] val The new value.
+*/
+void write_msr(uint32_t msr, uint64_t val);
+
+
 void change_tss(pcb* p);
 
 
@@ -65,6 +65,8 @@ extern void intr63();
 extern void intr64();
 extern void intr65();
 
+extern void isr66();
+
 
 extern void isr128();
 
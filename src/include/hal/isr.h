@@ -58,6 +58,9 @@ typedef uint32_t (*isr_t)(Registers*);
 #define IRQ_TIMER    64
 #define IRQ_ERROR    65
 
+// Sent by another CPU when it has changed a mapping we may have cached
+#define IRQ_TLB      66
+
 
 
 
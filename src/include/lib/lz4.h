@@ -0,0 +1,50 @@
+#ifndef ___LZ4_H
+#define ___LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* \file lz4.h
+* Compression in the LZ4 block format, used for the compressed swap (zswap.h).
+* The compressor is greedy with one hash table of the last position each 4
+* bytes were seen at, it is fast and pages with repeated data, e.g. zeroes and
+* text, get much smaller. Input is at most 64 KB, so the positions fit in 16
+* bits.
+* \addtogroup c_lz4
+* @{
+*/
+
+/** Bits in the hash of 4 bytes, the table has 2^LZ4_HASH_BITS entries. */
+#define LZ4_HASH_BITS 12
+
+/** Number of uint16_t in the table the caller provides to lz4_compress. */
+#define LZ4_TABLE_SZ (1 << LZ4_HASH_BITS)
+
+
+/**
+* Compress n bytes from src to dst.
+* \param[in] src Data to compress, at most 64 KB.
+* \param[in] n Number of bytes in src.
+* \param[out] dst Where the compressed data is written.
+* \param[in] max Size of dst.
+* \param[in] table Work area of LZ4_TABLE_SZ entries, the content is not used.
+* \return Returns the number of bytes written to dst or 0 if it did not fit.
+*/
+size_t lz4_compress(const void* src, size_t n, void* dst, size_t max,
+	uint16_t* table);
+
+/**
+* Decompress data from lz4_compress.
+* \param[in] src Compressed data.
+* \param[in] n Number of bytes in src.
+* \param[out] dst Where the data is written.
+* \param[in] max Size of dst.
+* \return Returns the number of bytes written to dst or 0 if src is not valid
+* or does not fit in dst.
+*/
+size_t lz4_decompress(const void* src, size_t n, void* dst, size_t max);
+
+/** @} */
+
+#endif
@@ -14,13 +14,16 @@
 #define KB4 0x1000
 
 #define MB1   0x100000
+#define MB2   0x200000
 #define MB4   0x400000
 #define MB16 0x1000000
+#define MB64 0x4000000
 
 #define MB250  0xFA00000
 #define MB256 0x10000000
 
 #define GB1 0x40000000
+#define GB4 0x100000000ULL
 
 
 
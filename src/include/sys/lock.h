@@ -28,6 +28,13 @@ typedef enum	{
 	LOCK_ATA,
 	LOCK_CONSOLE,
 	LOCK_HEAP,
+	LOCK_RECLAIM,
+	LOCK_VMA,
+	LOCK_ZSWAP,
+	LOCK_VMM,
+	LOCK_TLB,
+	LOCK_PMM,
+	LOCK_PMM_ZERO,
 	UNKNOWN
 } lock_resource;
 
@@ -68,9 +75,35 @@ void init_spinlock(spinlock* lock, lock_resource id);
 void spinlock_acquire(spinlock* lock);
 
 
+/**
+* Acquire the lock if it is free, without waiting.
+* \return Returns true if the lock was acquired.
+*/
+bool spinlock_try(spinlock* lock);
+
+
 /**
 * Release the lock.
 */
 void spinlock_release(spinlock* lock);
 
+
+/**
+* Disable interrupts on the current CPU. Calls can be nested and interrupts are
+* only enabled again when the outermost popcli is called, and only if they were
+* enabled before the first pushcli. Idea taken from xv6.
+*/
+void pushcli();
+
+/**
+* Undo one pushcli.
+*/
+void popcli();
+
+/**
+* Number of pushcli that have not been undone on the current CPU. Every lock
+* that is held counts, so 0 means that this CPU holds no lock.
+*/
+int32_t pushcli_depth();
+
 #endif
@@ -3,7 +3,9 @@
 * \file pmm.h
 * Header file for the physical memory manager.
 * About the physical memory manager:
-* - The implementation uses a bitmap to store free or taken blocks.
+* - The implementation uses a bitmap to store free or taken blocks. A buddy
+* system can be used instead by setting PMM_USE_BUDDY in config.h, the API is
+* the same for both, see pmm_backend.h.
 * - Each bit represents 4KB of memory, this is chosen to coincide with the size
 * of pages in virtual memory, which is eventually used.
 * - Initialize the system:
@@ -14,8 +16,23 @@
 *   seperately.
 * - Virtual memory manager can allocate and free blocks as desired, both single
 * and several consecutive blocks.
-* \todo Store last block allocated / last freed block to make it faster to find
-* available blocks.
+* - Memory is divided in zones (pmm_zone) so that callers can ask for memory
+* below 1 MB or below 16 MB. Memory above 4 GB is only tracked if PAE_ENABLE is
+* set and is only handed out as physical addresses (paddr_t), since it can not
+* be reached through a pointer. Each zone has a count of free blocks that is kept
+* up to date on every allocation and free.
+* - Each CPU has a small cache of free blocks (pmm_cpu_cache). Single blocks are
+* allocated and freed from this cache and the cache is refilled from, or drained
+* to, the bitmap PMM_CPU_CACHE_BATCH blocks at a time.
+* - The bitmap is changed with atomic instructions (lock bts/btr, cmpxchg) on
+* whole words, so several CPUs can allocate and free at the same time without a
+* shared lock. The buddy system is protected by a spinlock.
+* - The bitmap is searched one 32-bit word at a time. A summary bitmap with one
+* bit per full word is used to skip memory that is taken and single blocks are
+* allocated next-fit, so the search time does not grow with memory in use.
+* - A pool of PMM_ZERO_POOL_SZ frames is zeroed while the CPUs are idle, so that
+* page tables and other memory that must be cleared can be allocated without
+* doing the zeroing at that time (pmm_alloc_zeroed).
 * \remark There is no way to move physical memory around, so closing small holes
 * to create larger gaps has not been implemented. Since paging is used, it
 * should not be necessary, the kernel should instead pre-allocate some continous
@@ -34,6 +51,160 @@
 #include "multiboot1.h"
 
 
+/** Physical address, large enough for all memory the kernel can use. */
+#if PAE_ENABLE
+typedef uint64_t paddr_t;
+#else
+typedef uint32_t paddr_t;
+#endif
+
+/**
+* Highest physical address we track, PAE uses 36-bit physical addresses.
+* Without PAE the last block is never used, so that the size fits in paddr_t.
+*/
+#if PAE_ENABLE
+#define PMM_MAX_PHYS (GB4 * 16ULL)
+#else
+#define PMM_MAX_PHYS (GB4 - KB4)
+#endif
+
+/** End of the low zone, memory reachable in real mode. */
+#define PMM_ZONE_LOW_END MB1
+
+/** End of the DMA zone, memory reachable by ISA DMA. */
+#define PMM_ZONE_DMA_END MB16
+
+/** End of the normal zone, memory reachable with 32-bit addresses. */
+#define PMM_ZONE_NORMAL_END GB4
+
+/**
+* Zones of physical memory. When memory is allocated from a zone and the zone
+* is full, the zones below it are tried, since they also satisfy the limit.
+*/
+typedef enum	{
+	/** Below PMM_ZONE_LOW_END, e.g. AP trampoline. */
+	PMM_ZONE_LOW = 0,
+
+	/** From PMM_ZONE_LOW_END to PMM_ZONE_DMA_END. */
+	PMM_ZONE_DMA = 1,
+
+	/** From PMM_ZONE_DMA_END to PMM_ZONE_NORMAL_END. */
+	PMM_ZONE_NORMAL = 2,
+
+	/** Above PMM_ZONE_NORMAL_END, only with PAE_ENABLE, see pmm_alloc_phys. */
+	PMM_ZONE_HIGH = 3,
+
+	PMM_ZONES = 4
+} pmm_zone;
+
+
+/**
+* Free blocks owned by one CPU. Is stored in cpu_info and should only be touched
+* by the CPU that owns it, with interrupts disabled. The blocks are marked as
+* taken in the bitmap while they are in the cache, and as cached in a separate
+* bitmap, so that freeing them again does nothing.
+*/
+typedef struct	{
+	/** Number of valid entries in blocks. */
+	uint32_t count;
+
+	/** Block numbers, the last valid entry is handed out first. */
+	uint32_t blocks[PMM_CPU_CACHE_SZ];
+} __attribute__((aligned(64))) pmm_cpu_cache;
+
+
+/**
+* Statistics for the pool of zeroed frames.
+*/
+typedef struct	{
+	/** Number of times pmm_alloc_zeroed got a frame from the pool. */
+	uint32_t hits;
+
+	/** Number of times the pool was empty and the frame was zeroed at once. */
+	uint32_t misses;
+
+	/** Number of frames zeroed by the idle loop. */
+	uint32_t filled;
+
+	/** Number of frames in the pool now. */
+	uint32_t count;
+} pmm_zero_stats;
+
+
+/**
+* Subsystems that report how many blocks they own, see pmm_owner_add.
+*/
+typedef enum	{
+	/** Kernel heap. */
+	PMM_OWNER_HEAP = 0,
+
+	/** Page directories and page tables. */
+	PMM_OWNER_PTABLE = 1,
+
+	/** Kernel stacks for processes and CPUs. */
+	PMM_OWNER_KSTACK = 2,
+
+	/** Modules loaded by Grub. */
+	PMM_OWNER_MODULE = 3,
+
+	/** Reference counts, see pmm_refs_init. */
+	PMM_OWNER_REFS = 4,
+
+	/** Arena of the compressed swap, see zswap.h. */
+	PMM_OWNER_ZSWAP = 5,
+
+	PMM_OWNERS = 6
+} pmm_owner;
+
+/**
+* Number of buckets in the histogram of free runs, bucket i counts runs of
+* 2^i to 2^(i+1)-1 blocks and the last bucket also counts all longer runs.
+*/
+#define PMM_RUN_BUCKETS 12
+
+/**
+* Snapshot of the physical memory, see pmm_stats. All values are number of
+* blocks. total = free + cached + used + reserved.
+*/
+typedef struct	{
+	/** Number of blocks we manage. */
+	uint32_t total;
+
+	/** Free blocks in the allocator. */
+	uint32_t free;
+
+	/** Free blocks held in the CPU caches and the pool of zeroed frames. */
+	uint32_t cached;
+
+	/** Blocks that have been allocated. */
+	uint32_t used;
+
+	/**
+	* Blocks that were never free, i.e. holes and reserved regions in the memory
+	* map, the bitmap and memory marked with pmm_mark_mem_taken.
+	*/
+	uint32_t reserved;
+
+	/** Free blocks in each zone. */
+	uint32_t zone_free[PMM_ZONES];
+
+	/** Longest run of consecutive free blocks in each zone. */
+	uint32_t largest_run[PMM_ZONES];
+
+	/** Histogram of the length of consecutive free runs. */
+	uint32_t runs[PMM_RUN_BUCKETS];
+
+	/**
+	* Blocks owned by each subsystem. This is what the subsystems report and
+	* can overlap with reserved, e.g. for modules.
+	*/
+	uint32_t owner[PMM_OWNERS];
+
+	/** Statistics for the pool of zeroed frames. */
+	pmm_zero_stats zero;
+} pmm_statistics;
+
+
 
 /**
 * Initialize the physical memory manager. This should of course be called early
@@ -45,32 +216,149 @@
 * \param[in] len Length of the mmap structure, also from Grub
 * \returns Returns the highest available address / number of bytes we manage
 * with our bitmap.
-* \remark After this paging can be enabled, but the area containing the bitmap
-* must be identity mapped.
+* \remark The full 64-bit base and length of each region is used, memory above
+* PMM_MAX_PHYS is ignored.
+* \remark The bitmap is placed below 1 MB, after the AP trampoline, so that it
+* is always identity mapped. If there is not enough space there, memory at the
+* top is ignored.
 * \todo
 * - Clean up and divide into internal functions
 */
-uint32_t init_pmm(multiboot_mmap* mmap, uint32_t len);
+paddr_t init_pmm(multiboot_mmap* mmap, uint32_t len);
 
 /**
 * Find, allocate and return the first avaiable block of memory. This can be
-* called whenever you need 1 block of memory.
+* called whenever you need 1 block of memory. The block is taken from the cache
+* of the current CPU, the cache is refilled from the bitmap if it is empty.
+* Blocks are taken from PMM_ZONE_NORMAL as long as possible.
 * \remark Only the virtual memory manager should call this as this is physical
 * memory.
-* \return Returns the address to the block.
-* \todo
-* - Will have very low speed after a while, should at least check whole byte
-* first
+* \return Returns the address to the block or NULL if there is no free memory.
 */
 void* pmm_alloc_first();
 
+/**
+* Allocate up to n blocks, the blocks are not necessarily consecutive. Blocks
+* are first taken from the cache of the current CPU and then from the bitmap in
+* one pass, so this is much faster than calling pmm_alloc_first n times.
+* \param[out] frames Where the addresses of the blocks are stored.
+* \param[in] n Max number of blocks.
+* \return Returns the number of blocks allocated, is less than n if there is
+* not enough free memory.
+*/
+uint32_t pmm_alloc_batch(uint32_t* frames, uint32_t n);
+
 
+/**
+* Find and allocate n consecutive free blocks from PMM_ZONE_NORMAL (or lower
+* zones if that is full). Words that are completely taken are skipped using
+* the summary bitmap.
+* \param[in] n Number of blocks.
+* \return Returns the address of the first block or NULL if there is no range
+* large enough.
+* \remark With the buddy system, n can not be larger than
+* 2^PMM_BUDDY_MAX_ORDER and the first block is aligned to the power of 2 equal
+* to or above n.
+*/
 void* pmm_alloc_first_n_blocks(uint32_t n);
 
+/**
+* Allocate 1 block from any zone, PMM_ZONE_HIGH is used first.
+* \return Returns the physical address of the block or 0 if there is no free
+* memory.
+* \remark The block can be above 4 GB, so it can only be used through a
+* mapping, never as a pointer. Should be freed with pmm_free_phys.
+*/
+paddr_t pmm_alloc_phys();
+
+/**
+* Allocate n consecutive blocks from a given zone. If the zone does not have
+* enough consecutive memory, the zones below it are tried.
+* \param[in] zone The highest zone the memory can be in, PMM_ZONE_HIGH is
+* treated as PMM_ZONE_NORMAL since the address is returned as a pointer.
+* \param[in] n Number of blocks.
+* \return Returns the address of the first block or NULL if there is no range
+* large enough.
+* \remark Blocks should be freed with pmm_free.
+*/
+void* pmm_alloc_zone(pmm_zone zone, uint32_t n);
+
+/**
+* Allocate n consecutive blocks where the address of the first block is a
+* multiple of align blocks, used for large pages. Taken from PMM_ZONE_NORMAL or
+* lower zones if that is full.
+* \param[in] n Number of blocks.
+* \param[in] align Alignment in blocks, must be a power of 2.
+* \return Returns the address of the first block or NULL if there is no such
+* range.
+* \remark With the buddy system, neither n nor align can be larger than
+* 2^PMM_BUDDY_MAX_ORDER.
+*/
+void* pmm_alloc_aligned(uint32_t n, uint32_t align);
+
+/**
+* Get the number of free blocks in a zone. Runs in constant time.
+* \remark Blocks in the CPU caches are not counted as free.
+*/
+uint32_t pmm_zone_free_blocks(pmm_zone zone);
+
+/**
+* Get the number of free blocks in all zones. Runs in constant time.
+*/
+uint32_t pmm_free_blocks();
+
+/**
+* Allocate 1 block where all the bytes are 0. The block is taken from the pool
+* of zeroed frames, if the pool is empty a block is allocated with
+* pmm_alloc_first and zeroed before it is returned.
+* \return Returns the address of the block or NULL if there is no free memory.
+* \remark Can be called before paging is enabled.
+*/
+void* pmm_alloc_zeroed();
+
+/**
+* Zero up to PMM_ZERO_POOL_BATCH frames and place them in the pool. Should be
+* called when the CPU has nothing else to do.
+* \return Returns the number of frames that was added.
+*/
+uint32_t pmm_zero_pool_fill();
+
+/**
+* Get statistics about the pool of zeroed frames.
+* \param[out] stats Where the statistics are stored.
+*/
+void pmm_zero_pool_stats(pmm_zero_stats* stats);
+
+/**
+* Update the number of blocks owned by a subsystem, this is only used for
+* statistics.
+* \param[in] owner The subsystem.
+* \param[in] blocks Number of blocks allocated, negative if they were freed.
+*/
+void pmm_owner_add(pmm_owner owner, int32_t blocks);
+
+/**
+* Take a snapshot of the physical memory. The runs of free blocks are found by
+* going through all blocks, so this should not be called often.
+* \param[out] stats Where the statistics are stored.
+* \remark The numbers can be slightly off if other CPUs allocate or free at the
+* same time.
+*/
+void pmm_stats(pmm_statistics* stats);
+
+/**
+* Print the statistics from pmm_stats.
+* \param[in] kl Level to print with, K_BOCHS_OUT prints to the debug port.
+*/
+void pmm_print_stats(enum KM_Level kl);
+
 /**
 * Mark region of memory as taken.
 * \param[in] start Start address of memory region. Will be aligned downwards.
 * \param[in] end End address of memory region. Will be aligned upwards.
+* \remark The cache of the current CPU is emptied first, so that none of the
+* blocks can be handed out afterwards. Caches on other CPUs are not touched, so
+* this should only be called before the APs are started.
 */
 void pmm_mark_mem_taken(uint32_t start, uint32_t end);
 
@@ -80,9 +368,56 @@ void pmm_mark_mem_taken(uint32_t start, uint32_t end);
 * \param[in] block Address of the block, should be aligned on 4 KB boundary.
 * \remark The address is aligned downwards and if the block is already free,
 * nothing happens.
+* \remark The block is placed in the cache of the current CPU, if the cache is
+* full, PMM_CPU_CACHE_BATCH blocks are given back to the bitmap first. Blocks
+* from PMM_ZONE_LOW and PMM_ZONE_DMA are never cached.
 */
 void pmm_free(void* block);
 
+/**
+* Free n blocks, works like calling pmm_free on each of them, but the lock for
+* the allocator is only taken once.
+* \param[in] frames Addresses of the blocks.
+* \param[in] n Number of blocks.
+*/
+void pmm_free_batch(uint32_t* frames, uint32_t n);
+
+/**
+* Free a block of memory from any zone, works like pmm_free.
+* \param[in] addr Physical address of the block.
+*/
+void pmm_free_phys(paddr_t addr);
+
+
+/**
+* Create the reference counts for all blocks, they are mapped at
+* FRAME_REFS_START and all are 0. Must be called after paging is enabled and
+* before any of the pmm_ref_* functions.
+*/
+void pmm_refs_init();
+
+/**
+* Add a reference to a block that is mapped in one more place, used when an
+* address space is cloned (copy-on-write).
+* \param[in] addr Physical address of the block.
+*/
+void pmm_ref_inc(paddr_t addr);
+
+/**
+* Remove a reference added with pmm_ref_inc.
+* \param[in] addr Physical address of the block.
+* \return Returns the number of references that are left.
+*/
+uint32_t pmm_ref_dec(paddr_t addr);
+
+/**
+* Number of references added with pmm_ref_inc.
+* \param[in] addr Physical address of the block.
+* \return Returns 0 if the block is only mapped in one place.
+* \remark A block should not be freed while this is not 0.
+*/
+uint32_t pmm_ref_count(paddr_t addr);
+
 
 /**
 * Check if a block is taken.
@@ -0,0 +1,158 @@
+/**
+* \ingroup pmm
+* \file pmm_backend.h
+* Interface between the physical memory manager (pmm.c) and the allocator that
+* keeps track of which blocks are free. There are two allocators and which one
+* is used is decided by PMM_USE_BUDDY in config.h:
+* - pmm_bitmap.c - One bit per block and a summary bitmap with one bit per full
+* word. Works well for single blocks.
+* - pmm_buddy.c - Buddy system with blocks of order 0 (4 KB) to
+* PMM_BUDDY_MAX_ORDER (4 MB). Is better at keeping memory in large consecutive
+* regions.
+*
+* All blocks are referred to by their number, i.e. address / PMM_BLK_SZ. If the
+* allocator is not lockless (PMM_BACKEND_LOCKLESS), pmm_lock must be held when
+* calling these functions, unless otherwise noted.
+*
+* A free block never belongs to more than one zone and the allocator must
+* update pmm_zone_free each time a block is freed or taken.
+*/
+
+/**
+* \addtogroup pmm
+* @{
+*/
+
+#ifndef __PMM_BACKEND_H
+#define __PMM_BACKEND_H
+
+#include "kernel.h"
+#include "pmm.h"
+
+
+/**
+* Whether the allocator can be used by several CPUs at the same time without
+* pmm_lock. The bitmap only uses atomic instructions, the buddy system needs
+* the lock.
+*/
+#if PMM_USE_BUDDY
+#define PMM_BACKEND_LOCKLESS false
+#else
+#define PMM_BACKEND_LOCKLESS true
+#endif
+
+/** Size of each block we manage. */
+#define PMM_BLK_SZ 4096
+
+/** Number of blocks in each word of a bitmap. */
+#define PMM_WORD_BITS 32
+
+/** Value of a word where all bits are set. */
+#define PMM_WORD_FULL 0xFFFFFFFF
+
+#define bitmap_set(a,b) a[(b)/PMM_WORD_BITS] |= (1U << ((b) % PMM_WORD_BITS))
+
+#define bitmap_unset(a,b) a[(b)/PMM_WORD_BITS] &= ~(1U << ((b) % PMM_WORD_BITS))
+
+#define bitmap_is_set(a,b) (a[(b)/PMM_WORD_BITS] & (1U << ((b) % PMM_WORD_BITS)))
+
+/** Index of the lowest set bit (bsf), the value can not be 0. */
+#define lowest_set_bit(a) ((uint32_t)__builtin_ctz(a))
+
+
+/** Number of blocks in the system, defined in pmm.c. */
+extern uint32_t pmm_blocks;
+
+/** Number of free blocks in each zone, defined in pmm.c. */
+extern uint32_t pmm_zone_free[PMM_ZONES];
+
+
+/** Block number of the first block after each zone. */
+#define PMM_ZONE_LOW_BLK    (PMM_ZONE_LOW_END / PMM_BLK_SZ)
+#define PMM_ZONE_DMA_BLK    (PMM_ZONE_DMA_END / PMM_BLK_SZ)
+#define PMM_ZONE_NORMAL_BLK ((uint32_t)(PMM_ZONE_NORMAL_END / PMM_BLK_SZ))
+
+
+/** Zone a block belongs to. */
+static inline pmm_zone pmm_block_zone(uint32_t block)	{
+	if(block < PMM_ZONE_LOW_BLK)	return PMM_ZONE_LOW;
+	if(block < PMM_ZONE_DMA_BLK)	return PMM_ZONE_DMA;
+	if(block < PMM_ZONE_NORMAL_BLK)	return PMM_ZONE_NORMAL;
+	return PMM_ZONE_HIGH;
+}
+
+/** First block in a zone. */
+static inline uint32_t pmm_zone_start(pmm_zone zone)	{
+	uint32_t ret = 0;
+	if(zone == PMM_ZONE_DMA)	ret = PMM_ZONE_LOW_BLK;
+	else if(zone == PMM_ZONE_NORMAL)	ret = PMM_ZONE_DMA_BLK;
+	else if(zone == PMM_ZONE_HIGH)	ret = PMM_ZONE_NORMAL_BLK;
+	return (ret < pmm_blocks) ? ret : pmm_blocks;
+}
+
+/** Block after the last block in a zone. */
+static inline uint32_t pmm_zone_end(pmm_zone zone)	{
+	uint32_t ret = pmm_blocks;
+	if(zone == PMM_ZONE_LOW)	ret = PMM_ZONE_LOW_BLK;
+	else if(zone == PMM_ZONE_DMA)	ret = PMM_ZONE_DMA_BLK;
+	else if(zone == PMM_ZONE_NORMAL)	ret = PMM_ZONE_NORMAL_BLK;
+	return (ret < pmm_blocks) ? ret : pmm_blocks;
+}
+
+
+/**
+* Number of bytes the allocator needs to store information about all blocks.
+* \param[in] blocks Number of blocks in the system.
+*/
+uint32_t pmm_backend_size(uint32_t blocks);
+
+/**
+* Initialize the allocator with all blocks marked as taken.
+* \param[in] data Memory of pmm_backend_size() bytes, must be accessible as long
+* as the allocator is used.
+* \param[in] blocks Number of blocks in the system.
+*/
+void pmm_backend_init(void* data, uint32_t blocks);
+
+/**
+* Mark the blocks from start and up to, but not including, end as free.
+* \remark The blocks must be taken.
+*/
+void pmm_backend_free_range(uint32_t start, uint32_t end);
+
+/**
+* Mark the blocks from start and up to, but not including, end as taken. Blocks
+* that are already taken are ignored.
+*/
+void pmm_backend_take_range(uint32_t start, uint32_t end);
+
+/**
+* Find and take up to n free blocks, they are not necessarily consecutive.
+* \param[out] blocks Where the block numbers are placed.
+* \param[in] n Max number of blocks.
+* \param[in] zone Zone the blocks must be taken from.
+* \return Number of blocks placed in blocks.
+*/
+uint32_t pmm_backend_alloc_batch(uint32_t* blocks, uint32_t n, pmm_zone zone);
+
+/**
+* Find and take n consecutive blocks.
+* \param[in] n Number of blocks.
+* \param[in] align The first block must be a multiple of this, must be a power
+* of 2, 1 means no alignment.
+* \param[in] zone Zone the blocks must be taken from.
+* \return Returns the first block or 0 if there is no such range.
+*/
+uint32_t pmm_backend_alloc_n(uint32_t n, uint32_t align, pmm_zone zone);
+
+/**
+* Check if a block is taken.
+* \remark Does not need pmm_lock, but the answer can be outdated if the block
+* is allocated or freed at the same time.
+*/
+bool pmm_backend_is_taken(uint32_t block);
+
+
+#endif	// File
+
+/** @} */	// pmm
@@ -40,22 +40,6 @@
 #define KSTACKSZ KB4
 
 
-typedef struct	{
-	uint16_t type;
-	uint32_t vm_start;
-	uint32_t vm_end;
-
-	uint16_t acl;
-
-} vm_area;
-
-
-typedef struct	{
-	dllist_head* mem_regions;
-
-} memory_desc;
-
-
 typedef struct	{
 	/** How many references to this token. */
 	uint32_t references;
@@ -83,6 +67,9 @@ typedef struct _pcb	{
 
 	uint8_t state;
 
+	/** Areas in the user part of the address space, see vma.h. */
+	struct _memory_desc* mm;
+
 	struct _pcb* next;
 
 } pcb;
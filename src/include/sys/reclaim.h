@@ -0,0 +1,52 @@
+/**
+* \ingroup paging
+* \file reclaim.h
+* Take frames back from the demand-zero areas (vma.h) when memory is low. A
+* CLOCK hand goes through the pages of the areas in address order, a page that
+* has been accessed since the hand passed it last gets a second chance, the
+* accessed bit is cleared. A page that has not been accessed is unmapped and
+* its frame freed (vmm_reclaim_page).
+*
+* A clean page in a demand-zero area has never been written and is still all
+* zero, so it is simply dropped and the next access gets a new zeroed frame in
+* vma_handle_fault. Dirty user pages are compressed to the swap in memory
+* (zswap.h) and decompressed on the next access. Dirty kernel pages are kept.
+*
+* The TLB must be flushed on all CPUs before the frames are freed, so
+* reclaim_pages can only be called when this CPU holds no lock. It is called
+* from the idle loop and from vma_handle_fault when the fault did not happen
+* with a lock held.
+*/
+
+#ifndef __RECLAIM_H
+#define __RECLAIM_H
+
+#include "kernel.h"
+#include "vma.h"
+#include "pmm.h"
+
+
+/** Number of frames to free each time memory is low. */
+#define RECLAIM_BATCH 32
+
+
+/**
+* Move the CLOCK hand until n frames have been freed or RECLAIM_MAX_SCAN pages
+* have been looked at. Returns at once if another CPU is reclaiming.
+* \param[in] n Number of frames to free.
+* \param[in] user The areas in the user part of the current address space, or
+* NULL if only the kernel areas should be scanned.
+* \return Returns the number of frames that were freed.
+* \remark Must be called with no lock held, see pushcli_depth.
+*/
+uint32_t reclaim_pages(uint32_t n, memory_desc* user);
+
+/**
+* Check if free memory is below RECLAIM_LOW_BLOCKS.
+*/
+static inline bool reclaim_needed()	{
+	return pmm_free_blocks() < RECLAIM_LOW_BLOCKS;
+}
+
+
+#endif
@@ -0,0 +1,84 @@
+/**
+* \ingroup paging
+* \file tlb.h
+* Invalidate TLB entries on all CPUs that may have cached them (shootdown).
+* Kernel addresses are mapped in all address spaces, so every started CPU must
+* flush them. User addresses only need to be flushed on CPUs that have the same
+* page directory loaded, cpu_info.pdir.
+*
+* The addresses are collected in a tlb_batch and sent to the other CPUs with one
+* IPI (IRQ_TLB), the sender waits until all of them have flushed. If more than
+* TLB_BATCH_SZ pages are added the whole TLB is flushed instead.
+*/
+
+#ifndef __TLB_H
+#define __TLB_H
+
+#include "kernel.h"
+
+
+/**
+* Number of pages in one batch, if more are added CR3 is reloaded instead.
+*/
+#define TLB_BATCH_SZ 32
+
+
+typedef struct	{
+	/** Pages to invalidate, only valid if all is false. */
+	uint32_t addrs[TLB_BATCH_SZ];
+	uint32_t count;
+
+	/** Too many pages, flush everything. */
+	bool all;
+
+	/** A kernel address is in the batch, all CPUs must flush. */
+	bool kernel;
+} tlb_batch;
+
+
+/**
+* Register the IPI handler, must be called after isr_install.
+*/
+void tlb_init();
+
+/**
+* Set the batch to empty.
+*/
+void tlb_batch_init(tlb_batch* b);
+
+/**
+* Add a page to the batch, nothing is flushed until tlb_batch_flush.
+* \param[in] virt Any address in the page, for a large page one address is
+* enough.
+*/
+void tlb_batch_add(tlb_batch* b, uint32_t virt);
+
+/**
+* Flush the whole TLB instead of a list of pages, used when all user pages have
+* changed.
+*/
+void tlb_batch_add_all(tlb_batch* b);
+
+/**
+* Flush the pages on this CPU and all other CPUs that may have them cached. The
+* batch is empty afterwards.
+* \remark If the batch has kernel pages, must not be called with a lock the
+* other CPUs can wait for with interrupts disabled, they would not answer the
+* IPI. User pages are answered in tlb_poll while they wait.
+*/
+void tlb_batch_flush(tlb_batch* b);
+
+/**
+* Flush one page on all CPUs, same as a batch with one page.
+*/
+void tlb_shootdown(uint32_t virt);
+
+/**
+* Answer a shootdown of user pages if this CPU has not done it yet, called by
+* spinlock_acquire while it waits. Kernel pages are only answered in the IPI,
+* since vmm_sync_kernel needs vmm_kernel_lock which this CPU can hold.
+*/
+void tlb_poll();
+
+
+#endif
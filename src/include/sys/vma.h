@@ -0,0 +1,140 @@
+/**
+* \ingroup paging
+* \file vma.h
+* Virtual memory areas, regions of an address space that are reserved but not
+* necessarily mapped. Pages in a demand-zero area get a zeroed frame the first
+* time they are touched, in the not-present branch of vmm_handle_page_fault.
+* User pages that are read first get the shared zero frame instead
+* (vmm_map_zero_page), the first write then gives them a frame of their own.
+* Pages that are still clean are taken back when memory is low, see reclaim.h.
+*
+* The kernel part (below USERMODE_START) is described by vma_kernel and is the
+* same in all address spaces, the user part by the memory_desc of the current
+* process (vma_user). The areas are kept in an AVL tree sorted by address, so
+* that an area is found in O(log n) also when a process has many of them. The
+* caller provides the memory for each vm_area, so that the heap itself can be
+* an area.
+*/
+
+#ifndef __VMA_H
+#define __VMA_H
+
+#include "kernel.h"
+#include "lock.h"
+#include "pmm.h"
+
+
+#define VMA_ERR_OVERLAP   -1
+#define VMA_ERR_NOT_FOUND -2
+#define VMA_ERR_INVALID   -3
+
+#define VMA_SUCCESS 0
+
+
+/** What happens when a page in the area is touched the first time. */
+typedef enum	{
+	/** All pages are mapped by the owner, a fault is an error. */
+	VMA_MAPPED = 0,
+
+	/** A zeroed frame is mapped in on the first access. */
+	VMA_DEMAND_ZERO = 1,
+} vma_type;
+
+
+typedef struct _vm_area	{
+	uint16_t type;
+
+	/** First address in the area, aligned to 4 KB. */
+	uint32_t vm_start;
+
+	/** Address after the area, aligned to 4 KB. */
+	uint32_t vm_end;
+
+	/** Access bits for the pages, same as for vmm_map_page. */
+	uint16_t acl;
+
+	/**
+	* Who is charged for frames mapped on demand, see pmm_owner_add. PMM_OWNERS
+	* if nobody.
+	*/
+	pmm_owner owner;
+
+	/** Areas with a lower and a higher address in the tree. */
+	struct _vm_area* left, * right;
+
+	/** Height of the subtree with this area as root, a leaf has height 1. */
+	int32_t height;
+} vm_area;
+
+
+typedef struct _memory_desc	{
+	/** Root of the tree of areas, they never overlap. */
+	vm_area* mem_regions;
+
+	/** The area that was found last, faults often come from the same area. */
+	vm_area* cache;
+
+	/** Protects mem_regions and cache. */
+	spinlock lock;
+} memory_desc;
+
+
+/** Areas in the kernel part of memory. */
+extern memory_desc vma_kernel;
+
+/** Areas in the user part of the current address space, can be NULL. */
+extern memory_desc* vma_user;
+
+
+/**
+* Initialize an empty set of areas.
+*/
+void vma_init(memory_desc* mm);
+
+/**
+* Add an area.
+* \param[in] area The area, vm_start, vm_end, type, acl and owner must be set.
+* The memory must be valid until the area is removed.
+* \return Returns VMA_SUCCESS, VMA_ERR_INVALID if the area is empty or not
+* aligned, or VMA_ERR_OVERLAP if it overlaps another area.
+*/
+int vma_insert(memory_desc* mm, vm_area* area);
+
+/**
+* Remove the area that starts at start, the pages are not unmapped.
+* \return Returns the area or NULL if no area starts at start.
+*/
+vm_area* vma_remove(memory_desc* mm, uint32_t start);
+
+/**
+* Find the area addr is in.
+* \return Returns the area or NULL if addr is not in any area.
+*/
+vm_area* vma_find(memory_desc* mm, uint32_t addr);
+
+/**
+* Find the first area that ends after addr, the one addr is in or the next one.
+* \return Returns the area or NULL if there is none.
+* \remark mm->lock must be held, the area can be removed when it is released.
+*/
+vm_area* vma_find_next(memory_desc* mm, uint32_t addr);
+
+/**
+* Copy all areas to an empty memory_desc, used by fork. The new areas are
+* allocated with heap_malloc.
+* \return Returns VMA_SUCCESS.
+*/
+int vma_copy(memory_desc* to, memory_desc* from);
+
+/**
+* Map a page that is not present, called by vmm_handle_page_fault. A page
+* that was compressed by reclaim_pages is decompressed.
+* \param[in] addr The address that was accessed.
+* \param[in] write If the access was a write.
+* \return Returns true if the page was mapped and the access can be tried
+* again, false if addr is not in a demand-zero area.
+*/
+bool vma_handle_fault(uint32_t addr, bool write);
+
+
+#endif
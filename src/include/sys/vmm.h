@@ -7,9 +7,16 @@
 #ifndef __VMM_H
 #define __VMM_H
 
+#include "kernel.h"
+#include "pmm.h"
+#include "tlb.h"
 
 #define VMM_ERR_PAGE_IN_USE      -1
 #define VMM_ERR_NO_PAGEDIR_ENTRY -2
+#define VMM_ERR_NO_LARGE_PAGES   -3
+#define VMM_ERR_NOT_ALIGNED      -4
+#define VMM_ERR_NOT_SWAPPED      -5
+#define VMM_ERR_NO_MEMORY        -6
 
 
 #define VMM_SUCCESS 0
@@ -21,10 +28,18 @@
 #define X86_PAGE_WRITABLE   0x02
 #define X86_PAGE_USER       0x04
 #define X86_PAGE_RESERVED   0x08|0x80|0x100
+#define X86_PAGE_WRITE_THROUGH 0x08
 #define X86_PAGE_CACHE_DIS  0x10
 #define X86_PAGE_ACCESSED   0x20
 #define X86_PAGE_DIRTY      0x40
+#define X86_PAGE_PAT        0x80
+#define X86_PAGE_GLOBAL     0x100
+#if PAE_ENABLE
+#define X86_PAGE_FRAME      0x000FFFFFFFFFF000ULL
+#define X86_PAGE_NX         (1ULL << 63)
+#else
 #define X86_PAGE_FRAME      0xFFFFF000
+#endif
 
 #define X86_PAGEDIR_PRESENT         0x01
 #define X86_PAGEDIR_WRITABLE        0x02
@@ -33,14 +48,34 @@
 #define X86_PAGEDIR_CACHE           0x10
 #define X86_PAGEDIR_ACCESSED        0x20
 #define X86_PAGEDIR_RESERVED        0x40
-#define X86_PAGEDIR_4MB             0x80
+#define X86_PAGEDIR_LARGE           0x80
 #define X86_PAGEDIR_CPU_GLOB        0x100
+#define X86_PAGEDIR_LARGE_PAT       0x1000
 //#define X86_PAGEDIR_LV4_GLOB      0x200
-#define X86_PAGEDIR_FRAME           0xFFFFF000
+#define X86_PAGEDIR_FRAME           X86_PAGE_FRAME
 
 // Our own bit to check if this page was cloned
 #define X86_PAGE_CLONED 0x800
 
+// Our own bits in an entry that is not present, see vmm_reclaim_page. With
+// X86_PAGE_SWAPPED bit 12 and up is a slot in the compressed swap (zswap.h),
+// with X86_PAGE_SWAPPING the page is being compressed and the frame is still in
+// the entry.
+#define X86_PAGE_SWAPPED  0x400
+#define X86_PAGE_SWAPPING 0x200
+
+// Our own bit for acl, the page can not be executed. It is turned into
+// X86_PAGE_NX with PAE if the CPU supports it, otherwise it is ignored.
+#define X86_PAGE_NOEXEC 0x200
+
+// Memory type for acl. X86_PAGE_PAT, X86_PAGE_CACHE_DIS and
+// X86_PAGE_WRITE_THROUGH are the index in the PAT, which is set up in vmm_init.
+// The first four entries are the default, the fifth is write-combining.
+#define VMM_CACHE_WB 0
+#define VMM_CACHE_WT X86_PAGE_WRITE_THROUGH
+#define VMM_CACHE_UC (X86_PAGE_CACHE_DIS | X86_PAGE_WRITE_THROUGH)
+#define VMM_CACHE_WC X86_PAGE_PAT
+
 #define X86_PF_PROTECT  (1 << 0)
 #define X86_PF_WRITE    (1 << 1)
 #define X86_PF_USERMODE (1 << 2)
@@ -48,6 +83,27 @@
 #define X86_PF_ID       (1 << 4)
 
 
+/**
+* One entry in a page table or page directory. With PAE the entries are 64-bit
+* and each table has 512 entries, there are 4 directories and the page directory
+* pointer table (loaded in CR3) points to them.
+*/
+#if PAE_ENABLE
+typedef uint64_t vmm_entry;
+#define VMM_TABLE_ENTRIES 512
+#define VMM_DIRS          4
+#define VMM_LARGE_PAGE_SZ MB2
+#else
+typedef uint32_t vmm_entry;
+#define VMM_TABLE_ENTRIES 1024
+#define VMM_DIRS          1
+#define VMM_LARGE_PAGE_SZ MB4
+#endif
+
+/** Number of directory entries, each covers VMM_LARGE_PAGE_SZ. */
+#define VMM_DIR_ENTRIES (VMM_TABLE_ENTRIES * VMM_DIRS)
+
+
 //typedef struct	{
 	/**
 	* Format of each integer (PTE) is (num. bits):
@@ -90,61 +146,256 @@
 /**
 * Create the page tables and enable paging.
 * Method:
-* - Allocate 1 physical block for kernel page directory (identity mapped)
-* - Allocate 1 physical block for first page table (identity mapped)
-* - Idenity map the first 4 MB of data
-* - The past page directory entry (1023) points back to the page directory
+* - Allocate 1 physical block for kernel page directory (identity mapped), with
+* PAE the page directory pointer table and 4 directories are allocated.
+* - Idenity map the first 4 MB of data, with large pages or a page table.
+* - The last page directory entry (1023) points back to the page directory
 *  - This means that the CPU will interpret the page directory as a page table
 *  in the last 4 MB of virtual memory. That way we can have access to our page
 *  directory when paging is enabled.
+*  - With PAE the last 4 entries in the last directory point to the 4
+*  directories, which then appear in the last 8 MB.
 *  - See
 *  http://www.rohitab.com/discuss/topic/31139-tutorial-paging-memory-mapping-with-a-recursive-page-directory/
 */
 void vmm_init();
 
+/**
+* Set up the parts of paging that are per CPU for an AP, the page tables are
+* already loaded. Must be called before any page with X86_PAGE_NOEXEC is used.
+*/
+void vmm_init_ap();
+
 
 /**
 * Map a physical address with a virtual address.
 * \param[in] phys_addr The physical address that should point to an available
 * block.
 * \param[in] virt_addr A virtual address.
+* \param[in] acl X86_PAGE_* bits, X86_PAGE_NOEXEC and one of the VMM_CACHE_*
+* types can also be used, the default is VMM_CACHE_WB.
 * \return Returns 0 if we are successful or non-zero if we are not.
 * \todo Define error codes.
 */
-int vmm_map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t acl);
+int vmm_map_page(paddr_t phys_addr, uint32_t virt_addr, uint32_t acl);
+
+
+/**
+* Map size bytes of physical memory that is contiguous. Each page table is
+* walked once and large pages are used where phys_addr, virt_addr and the size
+* that is left are aligned to VMM_LARGE_PAGE_SZ.
+* \param[in] phys_addr First physical address, aligned to 4 KB.
+* \param[in] virt_addr First virtual address, aligned to 4 KB.
+* \param[in] size Number of bytes, a multiple of 4 KB.
+* \param[in] acl Access bits, same as for vmm_map_page.
+* \return Returns VMM_SUCCESS, VMM_ERR_NOT_ALIGNED or VMM_ERR_PAGE_IN_USE if
+* any page is already mapped, nothing is then mapped.
+*/
+int vmm_map_range(paddr_t phys_addr, uint32_t virt_addr, uint32_t size,
+	uint32_t acl);
+
+/**
+* Map frames that are not contiguous, for example from pmm_alloc_batch, at
+* consecutive pages. Each page table is walked once.
+* \param[in,out] frames Physical address of each page. The entries for the
+* pages that are mapped are set to 0, pages that are already mapped are skipped
+* and the frames that are left can be freed by the caller.
+* \param[in] virt_addr First virtual address, aligned to 4 KB.
+* \param[in] n Number of frames.
+* \param[in] acl Access bits, same as for vmm_map_page.
+* \return Returns the number of pages that were mapped.
+*/
+uint32_t vmm_map_frames(uint32_t* frames, uint32_t virt_addr, uint32_t n,
+	uint32_t acl);
 
 
 /**
 * Unmap a virtual address from its physical page.
 * \param[in] virt_addr The virtual address that should be unmapped.
+* \remark If the address is in a large page, the whole large page is unmapped.
 */
 int vmm_unmap_page(uint32_t vaddr);
 
+/**
+* Unmap all pages in a range, the frames are not freed. Each page table is
+* walked once, empty tables are freed and the TLB is flushed once at the end
+* (see tlb.h).
+* \param[in] virt_addr First virtual address, aligned to 4 KB.
+* \param[in] size Number of bytes, a multiple of 4 KB.
+* \return Returns VMM_SUCCESS or VMM_ERR_NOT_ALIGNED.
+* \remark Large pages that are partly in the range are unmapped completely.
+* \remark After fork a frame can still be mapped in the other address space,
+* user pages must be unmapped with vmm_release_range if their frames are freed.
+*/
+int vmm_unmap_range(uint32_t virt_addr, uint32_t size);
+
+/**
+* Same as vmm_unmap_range, but the frames of the pages are also given back. A
+* frame that is shared after fork loses one reference (pmm_ref_dec), the last
+* address space that has it frees it. The shared zero frame is kept.
+* \param[in] virt_addr First virtual address, aligned to 4 KB.
+* \param[in] size Number of bytes, a multiple of 4 KB.
+* \return Returns VMM_SUCCESS or VMM_ERR_NOT_ALIGNED.
+* \remark The frames of large pages are not freed.
+*/
+int vmm_release_range(uint32_t virt_addr, uint32_t size);
+
+
+/**
+* Find the physical address a virtual address is mapped to.
+* \param[in] virt Virtual address in the current address space.
+* \return Returns the physical address or 0 if virt is not mapped.
+*/
+paddr_t vmm_virt_to_phys(uint32_t virt);
 
 
 /**
-* Create an empty address space that has the kernel mapped in.
-* \param[in,out] virt_addr A virtual memory address that is mapped to a physical
-* address, must be 4 KB in size.
-* \return Returns the physical address space
+* Check if large pages can be used, decided in vmm_init.
+* \return Returns true if PAGES_LARGE is set and the CPU supports it.
 */
-uint32_t* create_address_space(uint32_t* virt_addr);
+bool vmm_large_pages();
 
+/**
+* The frame that vmm_map_zero_page maps, it is always zero and must never be
+* freed.
+*/
+extern paddr_t vmm_zero_frame;
 
 /**
-* Create a mapping between two address spaces (clone of address space). The
-* purpose of this function is to support fork()-like functionality. This
-* function only copies the addresses in the page directory and marks each PDE
-* that was writeable as readable and cloned (VMM_PAGE_CLONED). The actual
-* copying is handled by handle_page_fault.
-* \param[in,out] pdir_to The new page directory.
-* \param[in] pdir_from The old page directiry.
+* Map the shared zero frame at a page that has not been touched. A writable
+* page is mapped read-only and X86_PAGE_CLONED, the first write then gives it
+* a zeroed frame of its own in the same way as copy-on-write after fork.
+* \param[in] virt_addr Virtual address, aligned to 4 KB.
+* \param[in] acl Access bits, same as for vmm_map_page.
+* \return Returns the same as vmm_map_page.
 */
-//void vmm_map_address_space(uint32_t* pdir_to, uint32_t* pdir_from);
+int vmm_map_zero_page(uint32_t virt_addr, uint32_t acl);
+
+/**
+* Give the page at virt a second chance or take it away, one step of the CLOCK
+* hand in reclaim.h. If the page has been accessed since the last time, the
+* accessed bit is cleared and the page is kept. Otherwise it is unmapped:
+* - A clean page is gone, the next access faults as if it was never touched.
+* - A dirty user page is X86_PAGE_SWAPPING until vmm_swap_finish is called,
+* dirty pages are only taken with ZSWAP_ENABLE.
+*
+* Pages that are X86_PAGE_CLONED or the zero frame are never taken.
+* \param[in] virt Virtual address, aligned to 4 KB.
+* \param[in,out] tlb The page is added if it was unmapped, the frame can be
+* used by other CPUs until the batch is flushed.
+* \param[out] dirty Set to true if the page must be given to vmm_swap_finish.
+* \return Returns the frame that was unmapped or 0 if the page was kept.
+* \remark The lock of the area the page is in must be held, so that it is not
+* faulted in at the same time.
+*/
+paddr_t vmm_reclaim_page(uint32_t virt, tlb_batch* tlb, bool* dirty);
+
+/**
+* Put the slot a dirty page from vmm_reclaim_page was compressed to in the page
+* table entry, after the TLB has been flushed. If the page was faulted in or
+* unmapped while it was compressed, the slot is freed instead.
+* \param[in] virt Virtual address of the page.
+* \param[in] frame The frame vmm_reclaim_page returned.
+* \param[in] slot The slot from zswap_store, 0 if the page could not be
+* stored. The page is then mapped again.
+* \return Returns true if the frame is no longer used and can be freed.
+* \remark The lock of the area must be held.
+*/
+bool vmm_swap_finish(uint32_t virt, paddr_t frame, uint32_t slot);
+
+/**
+* Bring back a page that was taken by vmm_reclaim_page with its data, called by
+* vma_handle_fault. The page is mapped dirty, it is not zero so it must never be
+* dropped as a clean page.
+* \param[in] virt Virtual address, aligned to 4 KB.
+* \param[in] acl Access bits, same as for vmm_map_page.
+* \return Returns VMM_SUCCESS, VMM_ERR_NOT_SWAPPED if the entry is not swapped
+* out or VMM_ERR_NO_MEMORY if there was no frame for it.
+* \remark The lock of the area must be held.
+*/
+int vmm_swap_in(uint32_t virt, uint32_t acl);
+
+/**
+* Map VMM_LARGE_PAGE_SZ (4 MB, 2 MB with PAE) of physical memory with one page
+* directory entry, no page table is used.
+* \param[in] phys_addr Physical address, must be aligned to VMM_LARGE_PAGE_SZ.
+* \param[in] virt_addr Virtual address, must be aligned to VMM_LARGE_PAGE_SZ.
+* \param[in] acl Access bits, same as for vmm_map_page.
+* \return Returns 0 if successful, VMM_ERR_NO_LARGE_PAGES if large pages are
+* not used, VMM_ERR_NOT_ALIGNED or VMM_ERR_PAGE_IN_USE if the directory entry is
+* present. The caller should then fall back to 4 KB pages.
+*/
+int vmm_map_large_page(paddr_t phys_addr, uint32_t virt_addr, uint32_t acl);
+
+
+
+/**
+* Create an empty address space that has the kernel mapped in. The new
+* directory is written through vmm_kmap, it is not mapped anywhere.
+* \return Returns the physical address space, the value that is loaded in CR3.
+*/
+uint32_t* vmm_create_address_space();
+
+
+/**
+* Create a clone of the current address space, for fork. The kernel part is
+* shared as in vmm_create_address_space. The user part is copy-on-write, only
+* the page directory is copied:
+* - Each user page table gets one more reference (pmm_ref_inc) and the
+* directory entry is made read-only and X86_PAGE_CLONED in both address spaces.
+* - On the first write to a cloned table, the table is copied, or taken over if
+* it is the last reference. Writable pages in the table become read-only and
+* X86_PAGE_CLONED, in the same way.
+* - On the first write to a cloned page, the page is copied, or taken over if it
+* is the last reference.
+*
+* The user pages are flushed from the TLB of every CPU that runs in the current
+* address space.
+* \return Returns the physical address space, the value that is loaded in CR3.
+*/
+uint32_t* vmm_clone_address_space();
+
+
+/**
+* Map a physical block in at the next free kmap slot of the current CPU, so that
+* any frame or the page table of another address space can be changed without
+* loading CR3. The slots are only used by this CPU, so the TLB entry is only
+* flushed here. Interrupts are disabled until vmm_kunmap is called.
+* \param[in] phys Physical address of the block.
+* \return Returns the virtual address of the block.
+* \remark At most KMAP_SLOTS blocks can be mapped at the same time, they must
+* be unmapped in the reverse order.
+*/
+void* vmm_kmap(paddr_t phys);
+
+/**
+* Unmap a block that was mapped with vmm_kmap, the last one that was mapped.
+* \param[in] virt The address vmm_kmap returned.
+*/
+void vmm_kunmap(void* virt);
+
+/**
+* Set all the bytes in a physical block to 0. The block is mapped in with
+* vmm_kmap while it is zeroed.
+* \param[in] phys Physical address of the block.
+* \remark Can be called before paging is enabled.
+*/
+void vmm_zero_page(paddr_t phys);
 
 
 void vmm_switch_pdir(uint32_t* pdir);
 
+/**
+* Bring the kernel part of the current address space up to date. The kernel
+* page tables are shared by all address spaces, but when a directory entry for
+* the kernel part is added or removed, only the current address space is
+* changed and a generation counter is incremented. The other address spaces
+* are updated here, when they are loaded, on a page fault in kernel memory or
+* on a TLB shootdown.
+* \return Returns true if any entry was changed.
+*/
+bool vmm_sync_kernel();
+
 
 
 #endif
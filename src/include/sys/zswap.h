@@ -0,0 +1,89 @@
+/**
+* \ingroup paging
+* \file zswap.h
+* Compressed swap in memory. There is no disk to swap to, but cold pages often
+* compress to a fraction of a page. Dirty user pages that reclaim_pages takes
+* are compressed (lz4.h) and kept in an arena at ZSWAP_START, the page table
+* entry then holds the slot (X86_PAGE_SWAPPED). The page is decompressed when
+* it is touched again, in vma_handle_fault (vmm_swap_in).
+*
+* The arena is divided in units of ZSWAP_UNIT bytes and a compressed page takes
+* a run of units. The frames behind the arena are allocated from the PMM when a
+* page of it is first used and given back by zswap_shrink when it is empty.
+* Pages where all words are the same, e.g. all zero, only use a slot.
+*/
+
+#ifndef __ZSWAP_H
+#define __ZSWAP_H
+
+#include "kernel.h"
+
+
+/** Bytes in one unit of the arena. */
+#define ZSWAP_UNIT 64
+
+/** Number of slots, enough for a full arena with pages compressed to half. */
+#define ZSWAP_SLOTS ((ZSWAP_SIZE / KB4) * 2)
+
+/** Pages that do not compress to this or less are not stored. */
+#define ZSWAP_MAX_LEN ((KB4 * 3) / 4)
+
+
+typedef struct	{
+	/** Pages that are stored. */
+	uint32_t stored;
+
+	/** Stored pages where all words are the same, they use no units. */
+	uint32_t same;
+
+	/** Bytes of compressed data in the arena. */
+	uint32_t bytes;
+
+	/** Frames that are mapped in the arena. */
+	uint32_t frames;
+
+	/** Pages that did not compress well enough or did not fit. */
+	uint32_t rejected;
+} zswap_stats;
+
+
+/**
+* Compress a page and store it.
+* \param[in] page The data, KB4 bytes.
+* \return Returns the slot, with one reference, or 0 if the page was not
+* stored.
+*/
+uint32_t zswap_store(const void* page);
+
+/**
+* Decompress a page and drop one reference to the slot.
+* \param[in] slot Slot from zswap_store.
+* \param[out] page Where the data is written, KB4 bytes.
+* \return Returns true if the data was found.
+*/
+bool zswap_load(uint32_t slot, void* page);
+
+/**
+* Add one reference to the slot, used when a page table is copied after fork.
+*/
+void zswap_dup(uint32_t slot);
+
+/**
+* Drop one reference to the slot, the data is freed with the last one.
+*/
+void zswap_free(uint32_t slot);
+
+/**
+* Give back the frames of arena pages that have no data in them.
+* \return Returns the number of frames that were freed.
+* \remark Must be called with no lock held, since the TLB is flushed.
+*/
+uint32_t zswap_shrink();
+
+/**
+* Get the statistics of the compressed swap.
+*/
+void zswap_get_stats(zswap_stats* stats);
+
+
+#endif
@@ -20,6 +20,15 @@
 typedef int (*unit_test)();
 
 
+/**
+* Run a list of tests and stop at the first that fails. Defined in kernel.c.
+* \param[in] tests NULL-terminated list of tests, each returns 0 on success.
+* \param[in] func Name printed if a test fails.
+* \return Returns true if all tests passed.
+*/
+bool kernel_generic_unit_test(unit_test* tests, const char* func);
+
+
 
 // -------------- Main tests ------------------------------ 
 
@@ -39,22 +48,56 @@ bool heap_run_all_tests();
 
 
 /**
-* \todo Implement
+* Run tests for the doubly linked list, defined in dllist.c. Requires the heap.
+* \return Returns true if successfull and false if we failed.
+*/
+bool dllist_run_all_tests();
+
+
+/**
+* Run the tests for the virtual memory manager, defined in vmm.c. Requires
+* paging and uses the user part of the current address space.
+* \return Returns true if successfull and false if we failed.
 */
 bool vmm_run_all_tests();
 
 /**
-* Run all available tests to check the correctness of our physical memory map
-* implementation.
-* This function assumes that the first block (4 KB) of physical memory is
-* available and it will write to that block.
-* The first block is used to simulate allocations and deallocations of a memory
-* map.
+* Measure a task switch with and without global kernel pages, the switch and
+* reading some heap pages takes more cycles when the kernel TLB entries are
+* lost. Defined in vmm.c.
+* \param[in] rounds Number of switches to average over.
+*/
+void vmm_bench_switch(uint32_t rounds);
+
+/**
+* Run the tests for the virtual memory areas, defined in vma.c. Requires the
+* heap and paging.
+* \return Returns true if successfull and false if we failed.
+*/
+bool vma_run_all_tests();
+
+/**
+* Run the tests for the physical memory manager that do not need the memory
+* map, defined in pmm.c.
 * \return Return true if passed, false if failed
-* \remark This function should be called before any other memory initialization
-* code is called.
+* \remark This function should be called before init_pmm.
+*/
+bool pmm_run_all_tests_before();
+
+
+/**
+* Run the tests for the LZ4 compression, defined in lz4.c. Only depends on the
+* stack.
+* \return Returns true if successfull and false if we failed.
+*/
+bool lz4_run_all_tests();
+
+/**
+* Run the tests for the compressed swap, defined in zswap.c. Requires paging,
+* the arena is mapped as it is used.
+* \return Returns true if successfull and false if we failed.
 */
-bool pmm_run_all_tests();
+bool zswap_run_all_tests();
 
 
 /**
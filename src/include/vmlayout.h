@@ -14,6 +14,9 @@
 #define MAIN_BIOS_START (KB1*0x380)
 #define MAIN_BIOS_END   (MB1-1)
 
+// Real-mode code used to start the APs, see arch/x86/Makefile
+#define AP_BOOT_ADDR    0x7000
+
 // Kernel is at 1MB
 
 // The stack, 2 4KB blocks for each CPU core
@@ -21,13 +24,24 @@
 #define KERNEL_STACK_SZ  (KB4*2)
 
 
-#define LAPIC_PHYS_VIRT_ADDR (KERNEL_STACK_TOP - (KERNEL_STACK_SZ*MAX_CPUS) - KB4)
-#define MODULE1_LOCATION (LAPIC_PHYS_VIRT_ADDR - KB4)
+#define MODULE1_LOCATION (KERNEL_STACK_TOP - (KERNEL_STACK_SZ*MAX_CPUS) - (KB4*2))
 
 //#define MAX_KERNEL_MEM (KERNEL_STACK_TOP - (KERNEL_STACK_SZ*MAX_CPUS))
-//#define MAX_KERNEL_MEM (LAPIC_PHYS_VIRT_ADDR-KB4)
 #define MAX_KERNEL_MEM (MODULE1_LOCATION-KB4)
 
+// KMAP_SLOTS pages for each CPU where physical frames are mapped in for a
+// short time, see vmm_kmap
+#define KMAP_SLOTS 4
+#define KMAP_START MB4
+#define KMAP_SZ    (KB4*KMAP_SLOTS*MAX_CPUS)
+
+// The LAPIC registers, in the same page table as the kmap slots, so that the
+// first 4 MB can be identity mapped with large pages
+#define LAPIC_PHYS_VIRT_ADDR (KMAP_START + KMAP_SZ)
+
+// The VGA text memory mapped write-combining, also in the same page table
+#define VGA_TEXT_VIRT_ADDR (LAPIC_PHYS_VIRT_ADDR + KB4)
+
 
 #define PROC_VMM_START MB256
 #define PROC_VMM_SIZE  MB256
@@ -39,15 +53,62 @@
 #define HEAP_END (HEAP_START + HEAP_SIZE)
 
 
+// Reference count for each physical block (pmm_ref_inc), 4 bytes for each
+// block up to PMM_MAX_PHYS
+#define FRAME_REFS_START HEAP_END
+#if PAE_ENABLE
+	#define FRAME_REFS_SIZE MB64
+#else
+	#define FRAME_REFS_SIZE MB4
+#endif
+#define FRAME_REFS_END (FRAME_REFS_START + FRAME_REFS_SIZE)
+
+// Arena for the compressed swap, the frames are mapped when it is used, see
+// zswap.h
+#define ZSWAP_START FRAME_REFS_END
+#define ZSWAP_SIZE  (ZSWAP_MB * MB1)
+#define ZSWAP_END   (ZSWAP_START + ZSWAP_SIZE)
+
+
 // Must be changed when adding new sections to always represent end of kernel memory
-#define KERNEL_MAX_VM HEAP_END
+#define KERNEL_MAX_VM ZSWAP_END
 
 // First GB is reserved for kernel, then user space
 #define USERMODE_START GB1
 
+// The directory entry for the last large page of kernel memory is never
+// present, it holds the generation of the kernel entries the directory has, see
+// vmm_sync_kernel
+#if PAE_ENABLE
+	#define PDIR_GEN_ADDR (USERMODE_START - MB2)
+#else
+	#define PDIR_GEN_ADDR (USERMODE_START - MB4)
+#endif
+
+// The page directories are mapped in as page tables at the end of virtual
+// memory (recursive mapping), see vmm_init. All page tables are then found as
+// one array at PAGE_TABLES_VIRT and all directory entries at PAGE_DIR_VIRT.
+// With PAE there are 4 directories with 512 entries of 8 bytes, so 8 MB is used.
+#if PAE_ENABLE
+	#define PAGE_TABLES_VIRT 0xFF800000
+	#define PAGE_DIR_VIRT    0xFFFFC000
+#else
+	#define PAGE_TABLES_VIRT 0xFFC00000
+	#define PAGE_DIR_VIRT    0xFFFFF000
+#endif
+
+// The directory entry before the recursive mapping points to a page with the
+// number of present entries in each user page table, see vmm_count_add. The
+// counts are read through the recursive mapping, the addresses are never used.
+#if PAE_ENABLE
+	#define PTABLE_COUNT_ADDR (PAGE_TABLES_VIRT - MB2)
+#else
+	#define PTABLE_COUNT_ADDR (PAGE_TABLES_VIRT - MB4)
+#endif
+
 
 // Sanity check that we are not using too much VM
-#if USERMODE_START < KERNEL_MAX_VM
+#if USERMODE_START < KERNEL_MAX_VM || PDIR_GEN_ADDR < KERNEL_MAX_VM
 	#define VM_VALID false
 #else
 	#define VM_VALID true
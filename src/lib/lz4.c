@@ -0,0 +1,221 @@
+/**
+* \file lib/lz4.c
+* LZ4 block compression, see lz4.h.
+*
+* Each sequence is a token, the literals and a match: the high 4 bits of the
+* token are the number of literals and the low 4 bits the match length minus
+* LZ4_MIN_MATCH. 15 means that more bytes of the length follow, each 255 means
+* that one more follows. The match is a 2 byte offset back in the output. The
+* last sequence only has literals.
+*/
+
+#include "lz4.h"
+#include "string.h"
+#include "../sys/kernel.h"
+
+/** Shortest match that is encoded. */
+#define LZ4_MIN_MATCH 4
+
+/** The last match must start at least this many bytes before the end. */
+#define LZ4_MFLIMIT 12
+
+/** The last bytes are always literals. */
+#define LZ4_LAST_LITERALS 5
+
+
+/** Read 4 bytes, the address does not have to be aligned. */
+static inline uint32_t lz4_read32(const uint8_t* p)	{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t v)	{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/** Write the part of a length that did not fit in the token. */
+static uint8_t* lz4_write_length(uint8_t* op, size_t len)	{
+	if(len < 15)	return op;
+	for(len -= 15; len >= 255; len -= 255)	*op++ = 255;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/** Add the rest of a length to len, returns false if src ends first. */
+static bool lz4_read_length(const uint8_t** ip, const uint8_t* iend, size_t* len)	{
+	uint8_t b;
+	do	{
+		if(*ip >= iend)	return false;
+		b = *(*ip)++;
+		*len += b;
+	} while(b == 255);
+	return true;
+}
+
+/**
+* Write one sequence.
+* \param[in] match Match length, 0 for the last sequence.
+* \return Returns where the next sequence goes or NULL if dst is full.
+*/
+static uint8_t* lz4_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lit,
+	size_t nlit, size_t offset, size_t match)	{
+	size_t ml = (match != 0) ? match - LZ4_MIN_MATCH : 0,
+		need = 1 + nlit + (nlit / 255) + 1 + ((match != 0) ? 3 + (ml / 255) : 0);
+	if(need > (size_t)(oend - op))	return NULL;
+
+	*op++ = (uint8_t)(((nlit >= 15) ? 15 : nlit) << 4) | ((ml >= 15) ? 15 : ml);
+	op = lz4_write_length(op, nlit);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if(match == 0)	return op;
+
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	return lz4_write_length(op, ml);
+}
+
+
+
+
+size_t lz4_compress(const void* src, size_t n, void* dst, size_t max,
+	uint16_t* table)	{
+	const uint8_t* in = (const uint8_t*)src, * ip = in, * anchor = in,
+		* end = in + n;
+	uint8_t* op = (uint8_t*)dst, * oend = op + max;
+	if(n > 0x10000)	return 0;
+	memset(table, 0x00, LZ4_TABLE_SZ * sizeof(uint16_t));
+
+	while(n > LZ4_MFLIMIT && ip < end - LZ4_MFLIMIT)	{
+		uint32_t h = lz4_hash(lz4_read32(ip));
+		const uint8_t* ref = in + table[h];
+		table[h] = (uint16_t)(ip - in);
+
+		// The table is only a hint, the bytes must be compared
+		if(ref >= ip || lz4_read32(ref) != lz4_read32(ip))	{
+			ip++;
+			continue;
+		}
+
+		const uint8_t* m = ip + LZ4_MIN_MATCH, * r = ref + LZ4_MIN_MATCH;
+		while(m < end - LZ4_LAST_LITERALS && *m == *r)	{
+			m++;
+			r++;
+		}
+
+		op = lz4_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+		if(op == NULL)	return 0;
+		ip = anchor = m;
+	}
+
+	op = lz4_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return (op == NULL) ? 0 : (size_t)(op - (uint8_t*)dst);
+}
+
+
+size_t lz4_decompress(const void* src, size_t n, void* dst, size_t max)	{
+	const uint8_t* ip = (const uint8_t*)src, * iend = ip + n;
+	uint8_t* op = (uint8_t*)dst, * oend = op + max;
+	size_t len, offset;
+
+	while(ip < iend)	{
+		uint8_t token = *ip++;
+		len = token >> 4;
+		if(len == 15 && !lz4_read_length(&ip, iend, &len))	return 0;
+		if(len > (size_t)(iend - ip) || len > (size_t)(oend - op))	return 0;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		if(ip == iend)	break;
+
+		if(iend - ip < 2)	return 0;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > (size_t)(op - (uint8_t*)dst))	return 0;
+
+		len = token & 15;
+		if(len == 15 && !lz4_read_length(&ip, iend, &len))	return 0;
+		len += LZ4_MIN_MATCH;
+		if(len > (size_t)(oend - op))	return 0;
+
+		// The match can overlap what is written, so one byte at a time
+		const uint8_t* m = op - offset;
+		while(len-- > 0)	*op++ = *m++;
+	}
+	return op - (uint8_t*)dst;
+}
+
+
+
+
+#ifdef TEST_KERNEL
+
+#define LZ4_TEST_SZ 4096
+
+static uint8_t lz4_test_in[LZ4_TEST_SZ], lz4_test_out[LZ4_TEST_SZ + 64],
+	lz4_test_back[LZ4_TEST_SZ];
+static uint16_t lz4_test_table[LZ4_TABLE_SZ];
+
+/** Compress and decompress, returns the compressed size or 0 on failure. */
+static size_t lz4_test_round(size_t n)	{
+	size_t c = lz4_compress(lz4_test_in, n, lz4_test_out, sizeof(lz4_test_out),
+		lz4_test_table);
+	if(c == 0)	return 0;
+
+	memset(lz4_test_back, 0xEE, sizeof(lz4_test_back));
+	if(lz4_decompress(lz4_test_out, c, lz4_test_back, LZ4_TEST_SZ) != n ||
+		memcmp(lz4_test_in, lz4_test_back, n) != 0)
+		return 0;
+	return c;
+}
+
+int lz4_test_round_trip()	{
+	uint32_t i, seed = 12345;
+	size_t c;
+
+	// Zeroes and a repeated text are much smaller
+	memset(lz4_test_in, 0x00, LZ4_TEST_SZ);
+	if((c = lz4_test_round(LZ4_TEST_SZ)) == 0 || c > 64)	return 1;
+	for(i = 0; i < LZ4_TEST_SZ; i++)	lz4_test_in[i] = "page reclaim "[i % 13];
+	if((c = lz4_test_round(LZ4_TEST_SZ)) == 0 || c > 128)	return 2;
+
+	// Random data still works, but does not fit in less than the input
+	for(i = 0; i < LZ4_TEST_SZ; i++)	{
+		seed = (seed * 1103515245) + 12345;
+		lz4_test_in[i] = (uint8_t)(seed >> 16);
+	}
+	if(lz4_test_round(LZ4_TEST_SZ) == 0)	return 3;
+	if(lz4_compress(lz4_test_in, LZ4_TEST_SZ, lz4_test_out, LZ4_TEST_SZ / 2,
+		lz4_test_table) != 0)
+		return 4;
+
+	// Short inputs are only literals
+	if(lz4_test_round(1) != 2 || lz4_test_round(12) != 13)	return 5;
+	return 0;
+}
+
+int lz4_test_invalid()	{
+	// An offset before the start of the output
+	uint8_t bad[] = {0x10, 'a', 0x05, 0x00};
+	if(lz4_decompress(bad, sizeof(bad), lz4_test_back, LZ4_TEST_SZ) != 0)	return 1;
+
+	// More literals than the input has
+	bad[0] = 0x50;
+	if(lz4_decompress(bad, sizeof(bad), lz4_test_back, LZ4_TEST_SZ) != 0)	return 2;
+
+	// Output does not fit
+	bad[0] = 0x10;
+	bad[2] = 0x01;
+	if(lz4_decompress(bad, sizeof(bad), lz4_test_back, 4) != 0)	return 3;
+	if(lz4_decompress(bad, sizeof(bad), lz4_test_back, 5) != 5)	return 4;
+	return 0;
+}
+
+bool lz4_run_all_tests()	{
+	unit_test tests[3] = {
+		lz4_test_round_trip,
+		lz4_test_invalid,
+		NULL
+	};
+	return kernel_generic_unit_test(tests, "lz4_run_all_tests()");
+}
+
+#endif
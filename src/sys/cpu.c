@@ -5,6 +5,7 @@
 
 #include "sys/kernel.h"
 #include "sys/pmm.h"
+#include "sys/reclaim.h"
 #include "hal/hal.h"
 #include "drv/uart.h"
 
@@ -22,7 +23,7 @@ void cpu_common_main();
 
 void cpu_start_aps()	{
 	int i;
-	uint32_t* code = (uint32_t*)0x7000;
+	uint32_t* code = (uint32_t*)AP_BOOT_ADDR;
 	uint32_t curr_stack = KERNEL_STACK_TOP;
 	for(i = 0; i < num_cpus; i++)	{
 		if(cpus[i].boot_cpu == true)	continue;
@@ -32,6 +33,7 @@ void cpu_start_aps()	{
 		code[2] = (uint32_t)cpu_ap_enter;
 		uint32_t pdir = vmm_return_kernel_dir();
 		code[3] = pdir;
+		code[4] = get_cr4();
 	
 		lapic_start_ap(cpus[i].id, (uint32_t)code); 
 
@@ -42,6 +44,7 @@ void cpu_start_aps()	{
 
 
 void cpu_ap_enter()	{
+	vmm_init_ap();
 	gdt_install();
 	lapic_install();
 	cpu_common_main();
@@ -74,7 +77,13 @@ void cpu_common_main()	{
 	task_enter_usermode();
 
 	// TODO: Rest of the kernel
-	while(1);
+	// Idle, zero frames ahead of time while there is nothing else to do. The
+	// loaded address space is not known to belong to vma_user, so only the
+	// kernel areas are reclaimed here.
+	while(1)	{
+		if(reclaim_needed())	reclaim_pages(RECLAIM_BATCH, NULL);
+		if(pmm_zero_pool_fill() == 0)	halt();
+	}
 }
 
 
@@ -6,22 +6,25 @@
 
 void dllist_insert_location(dllist_element* bef, void* el);
 
+/**
+* Find the list element that holds the element matching val.
+* \return Returns NULL if there is no such element.
+*/
+dllist_element* dllist_find_element(dllist_head* l, void* val);
+
 
 
 
 
 dllist_head* dllist_init(void* el, dllist_lessthan f1, dllist_lessthan f2)	{
 	dllist_head* ret = heap_malloc(sizeof(dllist_head));
-	dllist_element* elem = heap_malloc(sizeof(dllist_element));
-	elem->element = el;
-	ret->elem = elem;
-	ret->elem->prev = ret->elem;
-	ret->elem->next = ret->elem;
+	ret->elem = NULL;
+	ret->elements = 0;
 
 	ret->lessthan = f1;
 	ret->lessthan_find = f2;
 
-	ret->elements = ((el == NULL) ? 0 : 1);
+	if(el != NULL)	dllist_insert_end(ret, el);
 
 	return ret;
 }
@@ -30,28 +33,25 @@ dllist_head* dllist_init(void* el, dllist_lessthan f1, dllist_lessthan f2)	{
 
 void dllist_insert(dllist_head* l, void* el)	{
 	dllist_element* curr = l->elem;
-	dllist_element* prev;
-
-	// Function never (intentionally) fails, so we can just increment
-	// immediately
-	l->elements++;
 
 	// If the list is empty we just insert it
 	if(curr == NULL)	{
-		l->elem = heap_malloc(sizeof(dllist_element));
-		l->elem->element = el;
+		dllist_insert_end(l, el);
 		return;
 	}
 
+	// Function never (intentionally) fails, so we can just increment
+	// immediately
+	l->elements++;
+
 	do	{
 		// If el should come before current
 		if(l->lessthan(el, curr->element) > 0)	{
-			prev = curr->prev;
-			dllist_insert_location(prev, el);
+			dllist_insert_location(curr->prev, el);
 
 			// Extra case if this is the new first element
 			if(l->elem == curr)	{
-				l->elem = prev;
+				l->elem = curr->prev;
 			}
 			
 			return;
@@ -61,49 +61,40 @@ void dllist_insert(dllist_head* l, void* el)	{
 
 	// If we get here, it should be placed at the end of the list
 	// curr is the start
-	prev = curr->prev;
-	dllist_insert_location(prev, el);
+	dllist_insert_location(curr->prev, el);
 }
 
 void dllist_insert_end(dllist_head* l, void* el)	{
-	dllist_element* curr = l->elem;
-	dllist_element* n = heap_malloc(sizeof(dllist_element));
-	n->element = el;
 	l->elements++;
 	// If the list is empty we just insert it
-	if(curr == NULL)	{
+	if(l->elem == NULL)	{
+		l->elem = heap_malloc(sizeof(dllist_element));
 		l->elem->element = el;
+		l->elem->next = l->elem->prev = l->elem;
 	}
 	else	{
-		curr = curr->prev;
-		n->next = curr->next;
-		curr->next = n;
+		dllist_insert_location(l->elem->prev, el);
 	}
 }
 
 void* dllist_find(dllist_head* l, void* val)	{
-	dllist_element* curr = l->elem;
-	if(curr == NULL)	return NULL;
-	int8_t cmp = 0;
-	do	{
-		if((cmp = l->lessthan_find(curr->element, val)) == 0)
-			return curr->element;
-		curr = curr->next;
-	} while(cmp <= 0);
-	return NULL;
+	dllist_element* elem = dllist_find_element(l, val);
+	return (elem == NULL) ? NULL : elem->element;
 }
 
 void* dllist_remove(dllist_head* l, void* val)	{
 	void* ret = NULL;
-	dllist_element* elem = dllist_find(l, val);
+	dllist_element* elem = dllist_find_element(l, val);
 	if(elem == NULL)	return NULL;
 	
 	elem->prev->next = elem->next;
+	elem->next->prev = elem->prev;
 	ret = elem->element;
+	l->elements--;
 
-	// Check if we just removed the last element in the list
+	// Check if we just removed the first or the last element in the list
 	if(l->elem == elem)	{
-		l->elem = NULL;
+		l->elem = (elem->next == elem) ? NULL : elem->next;
 	}
 	heap_free(elem);
 	return ret;
@@ -121,9 +112,20 @@ void dllist_insert_location(dllist_element* bef, void* el)	{
 
 	// Insert after current element
 	elem->next = bef->next;
-	bef->next = elem;
 	elem->prev = bef;
+	bef->next->prev = elem;
+	bef->next = elem;
+}
 
+dllist_element* dllist_find_element(dllist_head* l, void* val)	{
+	dllist_element* curr = l->elem;
+	if(curr == NULL)	return NULL;
+	do	{
+		if(l->lessthan_find(curr->element, val) == 0)
+			return curr;
+		curr = curr->next;
+	} while(curr != l->elem);
+	return NULL;
 }
 
 
@@ -135,8 +137,86 @@ typedef struct	{
 } dllist_test_int;
 
 
+int8_t dllist_test_lessthan(void* a, void* b)	{
+	return ((dllist_test_int*)a)->id < ((dllist_test_int*)b)->id;
+}
+
+int8_t dllist_test_find(void* a, void* id)	{
+	return (((dllist_test_int*)a)->id == *(int*)id) ? 0 : 1;
+}
+
+int dllist_test_sorted()	{
+	dllist_test_int vals[5] = { {3, 30}, {1, 10}, {4, 40}, {0, 0}, {2, 20} };
+	dllist_head* l = dllist_init(NULL, dllist_test_lessthan, dllist_test_find);
+	dllist_element* curr;
+	int i;
+
+	if(l->elem != NULL || l->elements != 0)	return 1;
+
+	for(i = 0; i < 5; i++)	dllist_insert(l, &vals[i]);
+	if(l->elements != 5)	return 2;
+
+	// Should be sorted on id, in both directions
+	curr = l->elem;
+	for(i = 0; i < 5; i++, curr = curr->next)	{
+		if(((dllist_test_int*)curr->element)->id != i)	return 3;
+		if(curr->next->prev != curr)	return 4;
+	}
+	if(curr != l->elem)	return 5;
+
+	i = 2;
+	if(dllist_find(l, &i) != &vals[4])	return 6;
+
+	// Remove from the middle, the start and the end
+	if(dllist_remove(l, &i) != &vals[4])	return 7;
+	if(dllist_find(l, &i) != NULL)	return 8;
+	i = 0;
+	if(dllist_remove(l, &i) != &vals[3])	return 9;
+	if(((dllist_test_int*)l->elem->element)->id != 1)	return 10;
+	i = 4;
+	if(dllist_remove(l, &i) != &vals[2])	return 11;
+	if(l->elements != 2 || l->elem->prev->next != l->elem)	return 12;
+
+	i = 1;
+	dllist_remove(l, &i);
+	i = 3;
+	dllist_remove(l, &i);
+	if(l->elem != NULL || l->elements != 0)	return 13;
+
+	heap_free(l);
+	return 0;
+}
+
+int dllist_test_end()	{
+	dllist_test_int vals[3] = { {2, 20}, {0, 0}, {1, 10} };
+	dllist_head* l = dllist_init(&vals[0], dllist_test_lessthan, dllist_test_find);
+	int i;
 
+	dllist_insert_end(l, &vals[1]);
+	dllist_insert_end(l, &vals[2]);
+	if(l->elements != 3)	return 1;
 
+	// Insertion order is kept
+	if(l->elem->element != &vals[0] || l->elem->next->element != &vals[1] ||
+		l->elem->prev->element != &vals[2])
+		return 2;
 
+	for(i = 0; i < 3; i++)	{
+		if(dllist_remove(l, &i) == NULL)	return 3;
+	}
+	if(l->elem != NULL)	return 4;
+
+	heap_free(l);
+	return 0;
+}
+
+bool dllist_run_all_tests()	{
+	unit_test tests[3] = {
+		dllist_test_sorted,
+		dllist_test_end,
+		NULL
+	};
+	return kernel_generic_unit_test(tests, "dllist_run_all_tests()");
+}
 
 #endif
@@ -13,6 +13,7 @@
 #include "sys/heap.h"
 
 #include "sys/vmm.h"
+#include "sys/vma.h"
 #include "sys/pmm.h"
 
 #include "lib/stdio.h"
@@ -20,6 +21,15 @@
 
 Heap kheap;
 
+#if DEMAND_PAGING
+/** The whole heap is reserved at once, frames are allocated on first use. */
+vm_area heap_area = {VMA_DEMAND_ZERO, HEAP_START, HEAP_END,
+	X86_PAGE_WRITABLE | X86_PAGE_NOEXEC, PMM_OWNER_HEAP, NULL, NULL, 0};
+#endif
+
+/** Number of frames asked for in each call to pmm_alloc_batch. */
+#define HEAP_FRAME_BATCH 64
+
 
 /**
 * Allocate a new virtual block for use by the heap.
@@ -31,6 +41,21 @@ Heap kheap;
 */
 LLMalloc* heap_get_new_block(LLMalloc* prev);
 
+/**
+* Map a new heap block with large pages, if the block is a multiple of
+* VMM_LARGE_PAGE_SZ, large pages are used and enough aligned physical memory is
+* free.
+* \param[in] virt Virtual address of the new block.
+* \return Returns true if the block was mapped, if false, nothing was changed.
+*/
+bool heap_map_large_block(uint32_t virt);
+
+/**
+* Merge the element after b into b, the two must be next to each other in
+* memory and the element after b must be free.
+*/
+void heap_merge_next(LLMalloc* b);
+
 
 
 
@@ -38,6 +63,11 @@ LLMalloc* heap_get_new_block(LLMalloc* prev);
 //---------------- Public API implementation ------------------------
 
 void heap_init()	{
+#if DEMAND_PAGING
+	if(vma_insert(&vma_kernel, &heap_area) != VMA_SUCCESS)	{
+		PANIC("Unable to reserve the heap");
+	}
+#endif
 	init_spinlock(&kheap.lock, LOCK_HEAP);
 	spinlock_acquire(&kheap.lock);
 
@@ -50,10 +80,10 @@ void heap_init()	{
 
 void* heap_malloc(uint32_t sz)	{
 	// We always align on 4 B boundaries
-	sz += (sz%4);
+	sz = (sz + 3) & ~3;
 
 	// Check in the beginning, that it can be possible
-	if(sz > (4096 - sizeof(LLMalloc)) )	{
+	if(sz > ((4096*HEAP_BLOCKS) - sizeof(LLMalloc)) )	{
 		PANIC("We don't have memory pages that big\n");
 	}
 
@@ -75,14 +105,17 @@ void* heap_malloc(uint32_t sz)	{
 
 		// Check if we need to split it up
 		if( (it->size - sz) > sizeof(LLMalloc) )	{
-			LLMalloc* n = (LLMalloc*)((uint32_t)it + sz + + sizeof(LLMalloc));
+			LLMalloc* n = (LLMalloc*)((uint32_t)it + sz + sizeof(LLMalloc));
 			n->used = 0;
+			n->magic1 = 0xabcd;
+			n->magic2 = 0xef;
 			// New size = old size - struct size - taken size
 			n->size = it->size - sizeof(LLMalloc) - sz;
 
 			// Insert the new element
 			n->next = it->next;
 			n->prev = it;
+			it->next->prev = n;
 			it->next = n;
 
 			// New size of allocated block
@@ -100,9 +133,6 @@ void* heap_malloc(uint32_t sz)	{
 	return ret;
 }
 
-/**
-* \todo Must verify that the contigous memory check makes sense.
-*/
 void heap_free(void* addr)	{
 	LLMalloc* free = (LLMalloc*)( (uint32_t)addr - sizeof(LLMalloc));
 	
@@ -111,33 +141,22 @@ void heap_free(void* addr)	{
 		PANIC("Heap magic value does not fit.\n");
 	}
 
+	free->used = 0;
+
 	// If previous is different and consist of free space, we should connect
 	// previous and this.
 	if(free->prev != free && free->prev->used == 0 &&
-		((uint32_t)free->prev + free->prev->size) == (uint32_t)free )	{
+		((uint32_t)free->prev + sizeof(LLMalloc) + free->prev->size) == (uint32_t)free )	{
 		free = free->prev;
-		free->size += free->next->size + sizeof(LLMalloc);
-		// Special case if there are only two elements
-		if(free->prev == free->next)	{
-			free->next = free->prev = free;
-		}
-		// All other cases
-		else	{
-			free->next = free->next->next;
-		}
+		heap_merge_next(free);
 	}
 
 	// Do the same thing as above, but for the next node, both can happen.
 	// Because this happens every time, there should only be 1 free block in a
 	// row. Therefore we only need to do this once on each free
-	if(free->next != free && free->next->used == 0)	{
-		free->size += free->next->size + sizeof(LLMalloc);
-		if(free->next == free->prev)	{
-			free->next = free->prev = free;
-		}
-		else	{
-			free->next = free->next->next;
-		}
+	if(free->next != free && free->next->used == 0 &&
+		((uint32_t)free + sizeof(LLMalloc) + free->size) == (uint32_t)free->next)	{
+		heap_merge_next(free);
 	}
 
 	addr = NULL;
@@ -149,23 +168,42 @@ void heap_free(void* addr)	{
 //----------------- Internal function implementations -----------------
 
 LLMalloc* heap_get_new_block(LLMalloc* prev)	{
-	uint32_t i = 0, heap_start = HEAP_START+(kheap.blocks_allocked*4096), phys;
-	// We allocate 4 MB each time
-	for(i = 0; i < HEAP_BLOCKS; i++)	{
-		phys = (uint32_t)pmm_alloc_first();
-
-		if(vmm_map_page(phys, (HEAP_START+(kheap.blocks_allocked*4096)),
-			X86_PAGE_WRITABLE))	{
-			printf("i = %i, phys = %p\n", i, phys);
+	uint32_t i = 0, got, heap_start = HEAP_START+(kheap.blocks_allocked*4096);
+	uint32_t frames[HEAP_FRAME_BATCH];
+
+#if DEMAND_PAGING
+	// Pages are mapped when they are touched, in vma_handle_fault
+	kheap.blocks_allocked += HEAP_BLOCKS;
+	i = HEAP_BLOCKS;
+#else
+	// Try to map the whole block with large pages
+	if(heap_map_large_block(heap_start))	i = HEAP_BLOCKS;
+#endif
+
+	// We allocate 4 MB each time, the frames are fetched in batches to keep the
+	// stack small
+	for(; i < HEAP_BLOCKS; i += got)	{
+		got = HEAP_BLOCKS - i;
+		if(got > HEAP_FRAME_BATCH)	got = HEAP_FRAME_BATCH;
+		got = pmm_alloc_batch(frames, got);
+		if(got == 0)	{
+			PANIC("No more physical memory");
+		}
+		pmm_owner_add(PMM_OWNER_HEAP, got);
+
+		if(vmm_map_frames(frames, (HEAP_START+(kheap.blocks_allocked*4096)), got,
+			X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) != got)	{
+			printf("i = %i\n", i);
 			PANIC("Unable to map page");
 		}
-		kheap.blocks_allocked++;
+		kheap.blocks_allocked += got;
 	}
 
 	LLMalloc* ret = (LLMalloc*)heap_start;
 	if(prev != NULL)	{
 		ret->next = prev->next;
 		ret->prev = prev;
+		prev->next->prev = ret;
 		prev->next = ret;
 	}
 	else	{
@@ -183,6 +221,35 @@ LLMalloc* heap_get_new_block(LLMalloc* prev)	{
 }
 
 
+bool heap_map_large_block(uint32_t virt)	{
+	uint32_t j, frame;
+	if(((HEAP_BLOCKS*4096) % VMM_LARGE_PAGE_SZ) != 0 ||
+		(virt % VMM_LARGE_PAGE_SZ) != 0 || !vmm_large_pages())
+		return false;
+
+	frame = (uint32_t)pmm_alloc_aligned(HEAP_BLOCKS, VMM_LARGE_PAGE_SZ / 4096);
+	if(frame == 0)	return false;
+
+	// With PAE each large page is 2 MB, so there are several
+	if(vmm_map_range(frame, virt, HEAP_BLOCKS*4096,
+		X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) != VMM_SUCCESS)	{
+		for(j = 0; j < HEAP_BLOCKS; j++)	pmm_free((void*)(frame + (j*4096)));
+		return false;
+	}
+	pmm_owner_add(PMM_OWNER_HEAP, HEAP_BLOCKS);
+	kheap.blocks_allocked += HEAP_BLOCKS;
+	return true;
+}
+
+void heap_merge_next(LLMalloc* b)	{
+	LLMalloc* n = b->next;
+	b->size += n->size + sizeof(LLMalloc);
+	b->next = n->next;
+	n->next->prev = b;
+
+	// The list must not start with the element that is gone
+	if(kheap.kern_heap == n)	kheap.kern_heap = b;
+}
 
 
 //----------- Testing code --------------------
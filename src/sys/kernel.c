@@ -41,10 +41,22 @@ inline uint32_t xchg(volatile uint32_t* addr, uint32_t n_val)   {
 
 
 void move_stack(uint32_t new_stack, uint32_t sz, uint32_t init_esp)	{
-	uint32_t i;
-	for(i = new_stack; i >= (new_stack - sz); i -= 4096)	{
-		uint32_t phys = (uint32_t)pmm_alloc_first();
-		vmm_map_page(phys, i, X86_PAGE_WRITABLE);
+	uint32_t i, j, n, frames[16];
+
+	// The stack is below new_stack
+	for(i = new_stack - sz; i < new_stack; i += n * 4096)	{
+		n = (new_stack - i) / 4096;
+		if(n > 16)	n = 16;
+		if( (n = pmm_alloc_batch(frames, n)) == 0)	{
+			PANIC("Unable to allocate stack");
+		}
+
+		// Pages that are already mapped do not need the frame
+		pmm_owner_add(PMM_OWNER_KSTACK,
+			vmm_map_frames(frames, i, n, X86_PAGE_WRITABLE | X86_PAGE_NOEXEC));
+		for(j = 0; j < n; j++)	{
+			if(frames[j] != 0)	pmm_free((void*)frames[j]);
+		}
 	}
 	uint32_t old_stack;
 	get_esp(old_stack);
@@ -60,7 +72,7 @@ void move_stack(uint32_t new_stack, uint32_t sz, uint32_t init_esp)	{
 	memcpy((uint8_t*)new_stack_ptr, (uint8_t*)old_stack, init_esp-old_stack);
 
 	// Now we change values to fit with the new stack
-	for(i = new_stack; i >= (new_stack - sz); i -= 4)	{
+	for(i = new_stack - 4; i >= (new_stack - sz); i -= 4)	{
 		uint32_t tmp = *(uint32_t*)i;
 		if( (old_stack < tmp) && (tmp < init_esp) )	{
 			tmp += offset;
@@ -15,6 +15,7 @@
 #include "sys/vmm.h"
 #include "sys/process.h"
 #include "sys/heap.h"
+#include "sys/tlb.h"
 
 #include "drv/vga.h"
 #include "drv/ps2.h"
@@ -77,9 +78,11 @@ void kmain(multiboot_info *mboot_ptr, uint32_t mem_start, uint32_t mem_end, uint
 	}
 	kbd_init(MODULE1_LOCATION);
 
-	if(!move_module(mboot_ptr, "bootap.bin", (uint8_t*)0x7000))	{
+	if(!move_module(mboot_ptr, "bootap.bin", (uint8_t*)AP_BOOT_ADDR))	{
 		PANIC("Unable to move bootapp.bin");
 	}
+	// Must not be handed out from PMM_ZONE_LOW
+	pmm_mark_mem_taken(AP_BOOT_ADDR, AP_BOOT_ADDR + KB4);
 	
 	if(cpu_supported() == 0)
 		PANIC("CPU not supported");
@@ -150,6 +153,13 @@ void kmain(multiboot_info *mboot_ptr, uint32_t mem_start, uint32_t mem_end, uint
 	
 	vmm_init();
 	kprintf(K_HIGH_INFO, "[INIT] Paging\n");
+	vga_map_wc();
+
+	// Other CPUs must flush the pages we unmap
+	tlb_init();
+
+	// Needed for copy-on-write
+	pmm_refs_init();
 	
 	move_stack(KERNEL_STACK_TOP, KERNEL_STACK_SZ, stack);
 	kprintf(K_LOW_INFO, "[INFO] Moved stack to VM 0x%x\n", KERNEL_STACK_TOP);
@@ -157,12 +167,22 @@ void kmain(multiboot_info *mboot_ptr, uint32_t mem_start, uint32_t mem_end, uint
 	heap_init();
 	kprintf(K_HIGH_INFO, "[INIT] Kernel Heap\n");
 
+#ifdef TEST_KERNEL
+	if(vmm_run_all_tests() == false)
+		PANIC("vmm_run_all_tests failed");
+	if(zswap_run_all_tests() == false)
+		PANIC("zswap_run_all_tests failed");
+	vmm_bench_switch(1000);
+#endif
+
 	nn = process_init();
 	kprintf(K_HIGH_INFO, "[INIT] Configured kernel process: %i\n", nn);
 
 //	process_start_usermode();
 //	kprintf(K_HIGH_INFO, "[INIT] Configured user mode process\n");
 
+	pmm_print_stats(K_DEBUG);
+
 	kprintf(K_HIGH_INFO, "[INFO] Starting APs\n");
 	cpu_start_aps();
 	
@@ -193,6 +213,8 @@ void test_main(multiboot_info *mboot_ptr, uint32_t mem_start, uint32_t mem_end,
 
 	if(string_run_all_tests() == false)
 		PANIC("string_run_all_tests failed");
+	if(lz4_run_all_tests() == false)
+		PANIC("lz4_run_all_tests failed");
 
 
 	if(kernel_run_all_tests() == false)
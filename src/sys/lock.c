@@ -6,10 +6,10 @@
 
 #include "sys/kernel.h"
 #include "sys/lock.h"
+#include "sys/tlb.h"
 #include "hal/hal.h"
 
-void pushcli();
-void popcli();
+extern cpu_info cpus[];
 
 void init_spinlock(spinlock* lock, lock_resource id)	{
 	lock->locked = 0;
@@ -33,11 +33,19 @@ void spinlock_acquire(spinlock* lock)	{
 	// Busy waiting until it is available
 	// TODO: This is also the time to check how many times we have tried and give
 	// up after X number of times. This can be configured in config.h
-	while(alock(&lock->locked, 1) != 0);
+	// The CPU that holds the lock can be waiting for us to flush user pages
+	while(alock(&lock->locked, 1) != 0)	tlb_poll();
 
 	// TODO: Set the other variables that are useful to have
 }
 
+bool spinlock_try(spinlock* lock)	{
+	pushcli();
+	if(alock(&lock->locked, 1) == 0)	return true;
+	popcli();
+	return false;
+}
+
 void spinlock_release(spinlock* lock)	{
 	// Should check if we are already holding it
 	
@@ -48,13 +56,31 @@ void spinlock_release(spinlock* lock)	{
 
 
 
+// We can not use "cpu" here, locks are used before the GDT is installed
 void pushcli()	{
-
+	uint32_t enabled = interrupt_enabled();
+	clear_int();
+	cpu_info* c = &cpus[lapic_cpuid()];
+	if(c->num_cli++ == 0)	{
+		c->int_enabled = (enabled != 0);
+	}
 }
 
 
 void popcli()	{
-
+	cpu_info* c = &cpus[lapic_cpuid()];
+	if(c->num_cli <= 0)	{
+		PANIC("popcli without pushcli");
+	}
+	if(--c->num_cli == 0 && c->int_enabled)	{
+		enable_int();
+	}
 }
 
 
+int32_t pushcli_depth()	{
+	pushcli();
+	int32_t ret = cpus[lapic_cpuid()].num_cli - 1;
+	popcli();
+	return ret;
+}
@@ -6,6 +6,7 @@
 
 #include "sys/kernel.h"
 #include "sys/multiboot1.h"
+#include "sys/pmm.h"
 #include "lib/string.h"
 
 #define NUM_FLAGS_BITS 12
@@ -218,6 +219,8 @@ bool move_module(multiboot_info* m, char* name, uint8_t* to)	{
 
 			// Mark this memory as taken is the memory manager
 			pmm_mark_mem_taken(mm->start,mm->end);
+			pmm_owner_add(PMM_OWNER_MODULE,
+				((mm->end + KB4 - 1) / KB4) - (mm->start / KB4));
 
 			ret = true;
 			break;
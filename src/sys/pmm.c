@@ -1,10 +1,10 @@
 /**
 * \pmm.c
 * Physical memory manager.
-* A bitmap is used to keep track of pages. Each block has a size of PMM_BLK_SZ
-* bytes, since it is meant to support paging, that size should be 4096 (4 KB).
-* Since all the allocation and deallocation works with blocks and the
-* initialization doesn't care about the block size, any block size should work.
+* The blocks are tracked by one of the allocators in pmm_backend.h, this file
+* handles the memory map from Grub, the per-CPU caches and the public API. Each
+* block has a size of PMM_BLK_SZ bytes, since it is meant to support paging,
+* that size should be 4096 (4 KB).
 * \todo Clean up code and variables.
 * \todo Make a clean API
 * \todo Document all parts
@@ -16,31 +16,66 @@
 
 #include "sys/kernel.h"
 #include "sys/multiboot1.h"
+#include "sys/pmm.h"
+#include "sys/pmm_backend.h"
+#include "sys/vmm.h"
+#include "sys/lock.h"
+
+#include "hal/hal.h"
 
 #include "lib/stdio.h"
 
-#define PMM_BLK_SZ 4096
+#define align_downwards(a,b) a-=(a%(b))
+#define align_upwards(a,b) if(a%b!=0) {a=((a/b)*b)+b;}
 
-#define bitmap_set(a,b) a[(b)/8]|=(1<<((b)%8))
+/** Lowest address where the bitmap can be placed, after the AP trampoline. */
+#define PMM_METADATA_START (AP_BOOT_ADDR + KB4)
 
-#define bitmap_unset(a,b) a[(b)/8] &= ~(1 << ((b) % 8));
 
-#define bitmap_is_set(a,b) (a[(b)/8] & (1 << ((b) % 8)))
 
-#define align_downwards(a,b) a-=(a%(b))
-#define align_upwards(a,b) if(a%b!=0) {a=((a/b)*b)+b;}
 
+/** Number of blocks in the system. */
+uint32_t pmm_blocks = 0;
 
+/**
+* Number of free blocks in each zone, updated by the allocator. Blocks in the
+* CPU caches are not counted as free.
+*/
+uint32_t pmm_zone_free[PMM_ZONES];
 
+/**
+* Protects the allocator if it is not lockless (PMM_BACKEND_LOCKLESS). Single
+* block allocations only take this when the cache of the CPU must be refilled
+* or drained.
+*/
+spinlock pmm_lock;
+
+/** Number of blocks that were never free, see pmm_statistics. */
+uint32_t pmm_reserved = 0;
+
+/** Number of blocks owned by each subsystem, see pmm_owner_add. */
+uint32_t pmm_owner_blocks[PMM_OWNERS];
+
+/** Frames that are already zeroed, the last entry is handed out first. */
+uint32_t pmm_zero_pool[PMM_ZERO_POOL_SZ];
 
-/** Address to the bitmap. */
-uint8_t* pmm_bitmap = NULL;
+/** Statistics for pmm_zero_pool, count is the number of frames in the pool. */
+pmm_zero_stats pmm_zero_info;
+
+/** Protects pmm_zero_pool and pmm_zero_info. */
+spinlock pmm_zero_lock;
+
+/** Number of extra references to each block, see pmm_ref_inc. */
+uint32_t* pmm_refs = NULL;
 
 /**
-* The number of blocks in the system and also the number of bits used after
-* pmm_bitmap to mark available and unavailable space.
+* One bit for each block that is in a CPU cache or in pmm_zero_pool, stored
+* after the data of the backend. Those blocks are taken in the backend, so this
+* is how a free of a block that is already free is caught.
 */
-uint32_t pmm_bitmap_sz = 0;
+volatile uint32_t* pmm_cached = NULL;
+
+extern cpu_info cpus[];
 
 
 
@@ -51,9 +86,111 @@ uint32_t pmm_bitmap_sz = 0;
 * Get highest physical address.
 * \param[in] mmap The memory map we get from Grub
 * \param[in] len The length of mmap which we also get from Grub.
-* \return The highest physical address in the system.
+* \return The highest physical address in the system, at most PMM_MAX_PHYS and
+* aligned to PMM_BLK_SZ.
+*/
+uint64_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len);
+
+/**
+* Find space for the bitmap between PMM_METADATA_START and PMM_ZONE_LOW_END
+* that does not overlap the memory map.
+* \param[in] bytes Number of bytes needed.
+* \param[out] space Size of the space that was found.
+* \return The address of the first space that is large enough, or the largest
+* space if none of them are large enough.
+*/
+uint32_t pmm_find_metadata_space(multiboot_mmap* mmap, uint32_t len,
+	uint32_t bytes, uint32_t* space);
+
+/** Number of bytes the backend and pmm_cached need for a number of blocks, rounded up. */
+static inline uint32_t pmm_metadata_size(uint32_t blocks)	{
+	uint32_t bytes = pmm_backend_size(blocks);
+	bytes += ((blocks + PMM_WORD_BITS - 1) / PMM_WORD_BITS) * sizeof(uint32_t);
+	align_upwards(bytes, PMM_BLK_SZ);
+	return bytes;
+}
+
+/**
+* Mark a block as cached.
+* \return true if the block was already cached.
+*/
+static inline bool pmm_cache_mark(uint32_t num)	{
+	return atomic_bts(&pmm_cached[num / PMM_WORD_BITS], num % PMM_WORD_BITS);
+}
+
+/** Clear the cached mark of a block, before it is handed out or given back. */
+static inline void pmm_cache_unmark(uint32_t num)	{
+	atomic_btr(&pmm_cached[num / PMM_WORD_BITS], num % PMM_WORD_BITS);
+}
+
+/** Full 64-bit start address of a region in the memory map. */
+static inline uint64_t pmm_mmap_base(multiboot_mmap* m)	{
+	return ((uint64_t)m->base_addr_h << 32) | m->base_addr_l;
+}
+
+/** Full 64-bit end address of a region in the memory map. */
+static inline uint64_t pmm_mmap_end(multiboot_mmap* m)	{
+	return pmm_mmap_base(m) + (((uint64_t)m->length_h << 32) | m->length_l);
+}
+
+/**
+* Move PMM_CPU_CACHE_BATCH blocks from the allocator to the cache. Blocks are
+* taken from the highest zone that has free blocks.
+* \remark Interrupts must be disabled.
 */
-uint32_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len);
+void pmm_cache_refill(pmm_cpu_cache* c);
+
+/**
+* Allocate n consecutive blocks aligned to align blocks from zone, or the zones
+* below if there is no such range.
+* \return The address of the first block or NULL.
+*/
+void* pmm_alloc_run(pmm_zone zone, uint32_t n, uint32_t align);
+
+/**
+* Allocate a block from the cache of this CPU, refilled from the allocator if
+* it is empty. Unlike pmm_alloc_first, the pool of zeroed frames is not used.
+* \return The address of the block or NULL if there is no free memory.
+*/
+void* pmm_alloc_cached();
+
+/**
+* Give n blocks from the cache back to the allocator.
+* \remark Interrupts must be disabled.
+*/
+void pmm_cache_drain(pmm_cpu_cache* c, uint32_t n);
+
+/**
+* Find all runs of consecutive free blocks, runs are split at zone boundaries.
+* \param[out] stats largest_run and runs are filled in.
+*/
+void pmm_find_free_runs(pmm_statistics* stats);
+
+/**
+* Take a block from the pool of zeroed frames.
+* \return The block number or 0 if the pool is empty.
+*/
+uint32_t pmm_zero_pool_take();
+
+
+/** Take pmm_lock, unless the allocator can be used without it. */
+static inline void pmm_backend_lock()	{
+#if !PMM_BACKEND_LOCKLESS
+	spinlock_acquire(&pmm_lock);
+#endif
+}
+
+/** Release pmm_lock, unless the allocator can be used without it. */
+static inline void pmm_backend_unlock()	{
+#if !PMM_BACKEND_LOCKLESS
+	spinlock_release(&pmm_lock);
+#endif
+}
+
+/** Cache of the CPU we are executing on. */
+static inline pmm_cpu_cache* pmm_local_cache()	{
+	return &cpus[lapic_cpuid()].frames;
+}
 
 
 
@@ -63,93 +200,88 @@ uint32_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len);
 
 //------------------- Public API function implementations ------------------
 
-uint32_t init_pmm(multiboot_mmap* mmap, uint32_t len)	{
-	multiboot_mmap* copy = mmap;
-	uint32_t max = pmm_get_max_space(copy, len);
-	copy = mmap;
-	
-	// Number of bits needed to mark all blocks
-	pmm_bitmap_sz = (max / PMM_BLK_SZ);
-	
-	uint32_t pmm_bytes = pmm_bitmap_sz/8;
-	if(pmm_bitmap_sz%8 != 0)	{
-		pmm_bytes++;
+paddr_t init_pmm(multiboot_mmap* mmap, uint32_t len)	{
+	init_spinlock(&pmm_lock, LOCK_PMM);
+	init_spinlock(&pmm_zero_lock, LOCK_PMM_ZERO);
+	memset(pmm_zone_free, 0x00, sizeof(pmm_zone_free));
+	memset(&pmm_zero_info, 0x00, sizeof(pmm_zero_info));
+	memset(pmm_owner_blocks, 0x00, sizeof(pmm_owner_blocks));
+
+	uint64_t max = pmm_get_max_space(mmap, len);
+	pmm_blocks = (uint32_t)(max / PMM_BLK_SZ);
+
+	// Find contigous area in low memory to store our bitmap
+	uint32_t space = 0;
+	uint32_t pmm_bytes = pmm_metadata_size(pmm_blocks);
+	uint32_t data = pmm_find_metadata_space(mmap, len, pmm_bytes, &space);
+	if(space == 0)	{
+		PANIC("No space for the bitmap");
 	}
-	
-	// Calculate how many blocks we need to allocate to store bitmap
-	uint32_t blocks_bitmap = pmm_bytes / PMM_BLK_SZ;
-	if( (pmm_bitmap_sz % (PMM_BLK_SZ*8)) != 0)	{
-		blocks_bitmap++;
+
+	// Not enough space, find the largest number of blocks we can track
+	if(space < pmm_bytes)	{
+		uint32_t lo = 0, hi = pmm_blocks;
+		while(lo < hi)	{
+			uint32_t mid = hi - ((hi - lo) / 2);
+			if(pmm_metadata_size(mid) <= space)	lo = mid;
+			else	hi = mid - 1;
+		}
+		kprintf(K_LOW_INFO, "[INFO] Ignoring memory above %i MB\n", lo / (MB1 / PMM_BLK_SZ));
+		pmm_blocks = lo;
+		max = (uint64_t)pmm_blocks * PMM_BLK_SZ;
+		pmm_bytes = pmm_metadata_size(pmm_blocks);
 	}
 
-	
 	// Number of bytes used in bitmap
-	kprintf(K_DEBUG, "Need %i bits, %i blocks, %i bytes to store bitmap @0x%X\n", pmm_bitmap_sz,
-		blocks_bitmap, pmm_bytes, pmm_bitmap);
-	
-	// Find contigous area in memory to store our bitmap
+	kprintf(K_DEBUG, "Have %i blocks, need %i blocks, %i bytes to store bitmap @0x%X\n",
+		pmm_blocks, pmm_bytes / PMM_BLK_SZ, pmm_backend_size(pmm_blocks), data);
+
+	// Everything is taken until we find it in the memory map
+	pmm_backend_init((void*)data, pmm_blocks);
+	pmm_cached = (volatile uint32_t*)(data + pmm_backend_size(pmm_blocks));
+	memset((void*)pmm_cached, 0x00, pmm_bytes - pmm_backend_size(pmm_blocks));
+
+	// Free all available memory, gaps in the specification is never freed
+	multiboot_mmap* copy = mmap;
 	while((uint32_t)copy < (uint32_t)mmap + len)	{
-		if(copy->type == 1 && (copy->length_l / PMM_BLK_SZ) >= blocks_bitmap)	{
-			// We need to make sure the base is aligned
-			uint32_t base = copy->base_addr_l;
+		uint64_t base = pmm_mmap_base(copy), end = pmm_mmap_end(copy);
+		if(copy->type == 1 && base < max)	{
 			align_upwards(base,PMM_BLK_SZ);
-			
-			// Must also align the end address
-			uint32_t end = copy->base_addr_l + copy->length_l;
-			align_downwards(base,PMM_BLK_SZ);
-			
-			if( (end - base) / PMM_BLK_SZ >= blocks_bitmap)	{
-				pmm_bitmap = (uint8_t*)base;
-				uint32_t i = 0;
-				for(i = 0; i < pmm_bytes; i++)	{
-					*(pmm_bitmap+i) = 0x00;
-				}
-				// Must mark the memory region with bitmap as taken
-				for(i = 0; i < blocks_bitmap; i++)	{
-					bitmap_set(pmm_bitmap, (i+(base/PMM_BLK_SZ)));
-				}
-				break;
+			if(end > max)	end = max;
+			align_downwards(end,PMM_BLK_SZ);
+			if(base < end)	{
+				pmm_backend_free_range(base/PMM_BLK_SZ, end/PMM_BLK_SZ);
 			}
 		}
 		copy = (multiboot_mmap*)((uint32_t)copy + (copy->size + 4));
 	}
-	copy = mmap;
-
-	// Mark all reserved memory as taken
-	uint32_t expected = 0;
-	while((uint32_t)copy < (uint32_t)mmap + len && (copy->base_addr_l < max-1))	{
-		// First check if there is a gap in the specification, if there is, that
-		// memory is taken.
-		if(copy->base_addr_l > expected/* && copy->base_addr_l < max-1*/)	{
-			align_downwards(expected,PMM_BLK_SZ);
-
-			while(expected < copy->base_addr_l)	{
-				bitmap_set(pmm_bitmap, expected/PMM_BLK_SZ);
-				expected += PMM_BLK_SZ;
-			}
-		}
 
-		// If this memory is taken and below our max
-		if(copy->type != 1 && (copy->base_addr_l + copy->length_l) < max-1)	{
-			// Mark this memory as taken
-			uint32_t base = copy->base_addr_l;
+	// If available and reserved memory overlap, reserved wins
+	copy = mmap;
+	while((uint32_t)copy < (uint32_t)mmap + len)	{
+		uint64_t base = pmm_mmap_base(copy), end = pmm_mmap_end(copy);
+		if(copy->type != 1 && base < max)	{
 			align_downwards(base,PMM_BLK_SZ);
-			while(base < (copy->base_addr_l + copy->length_l))	{
-				bitmap_set(pmm_bitmap, base/PMM_BLK_SZ);
-				base += PMM_BLK_SZ;
-			}
+			align_upwards(end,PMM_BLK_SZ);
+			if(end > max || end < base)	end = max;
+			pmm_backend_take_range(base/PMM_BLK_SZ, end/PMM_BLK_SZ);
 		}
-		expected = copy->base_addr_l + copy->length_l;
 		copy = (multiboot_mmap*)((uint32_t)copy + (copy->size + 4));
 	}
-	// 0 is error-value, so is always marked as used, might actually be used for
-	// bitmap
-	bitmap_set(pmm_bitmap, 0);
-	return max;
+
+	// Must mark the memory region with bitmap as taken
+	pmm_backend_take_range(data/PMM_BLK_SZ, (data + pmm_bytes)/PMM_BLK_SZ);
+
+	// 0 is error-value, so is always marked as used
+	pmm_backend_take_range(0, 1);
+
+	pmm_reserved = pmm_blocks - pmm_free_blocks();
+	return (paddr_t)max;
 }
 
 bool pmm_is_taken(uint32_t block)	{
-	return bitmap_is_set(pmm_bitmap,block);	
+	if(block >= pmm_blocks)	return true;
+	return pmm_backend_is_taken(block);
 }
 
 
@@ -157,72 +289,497 @@ void pmm_mark_mem_taken(uint32_t start, uint32_t end)	{
 	align_downwards(start, PMM_BLK_SZ);
 	align_upwards(end, PMM_BLK_SZ);
 
+	pushcli();
+	pmm_cpu_cache* c = pmm_local_cache();
+	pmm_cache_drain(c, c->count);
+
 	uint32_t i = start / PMM_BLK_SZ, j = end / PMM_BLK_SZ;
-	for(; i < j; i++)	{
-		bitmap_set(pmm_bitmap, i);
+	if(j > pmm_blocks)	j = pmm_blocks;
+	if(i < j)	{
+		// Only blocks that were free become reserved
+		uint32_t before = pmm_free_blocks();
+		pmm_backend_lock();
+		pmm_backend_take_range(i, j);
+		pmm_backend_unlock();
+		pmm_reserved += before - pmm_free_blocks();
 	}
+	popcli();
 }
 
 
 
-// Is very slow when many of the first are taken, there are several ways around
-// that
 void* pmm_alloc_first()	{
-	uint32_t i = 1;
-	for(i = 1; i< pmm_bitmap_sz; i++)	{
-		if(!bitmap_is_set(pmm_bitmap,i))	{
-			bitmap_set(pmm_bitmap, i);
-			return (void*)(i*PMM_BLK_SZ);
+	void* ret = pmm_alloc_cached();
+
+	// Zeroed frames are also free memory
+	if(ret == NULL)	{
+		ret = (void*)(pmm_zero_pool_take() * PMM_BLK_SZ);
+	}
+	return ret;
+}
+
+uint32_t pmm_alloc_batch(uint32_t* frames, uint32_t n)	{
+	uint32_t found = 0, i;
+	int32_t z;
+
+	pushcli();
+	pmm_cpu_cache* c = pmm_local_cache();
+	while(found < n && c->count > 0)	{
+		frames[found] = c->blocks[--c->count];
+		pmm_cache_unmark(frames[found++]);
+	}
+	popcli();
+
+	// The rest is taken directly from the allocator
+	pmm_backend_lock();
+	for(z = PMM_ZONE_NORMAL; z >= 0 && found < n; z--)	{
+		found += pmm_backend_alloc_batch(&frames[found], n - found, (pmm_zone)z);
+	}
+	pmm_backend_unlock();
+
+	for(i = 0; i < found; i++)	{
+		frames[i] *= PMM_BLK_SZ;
+	}
+	return found;
+}
+
+
+void pmm_free_batch(uint32_t* frames, uint32_t n)	{
+	uint32_t i, num;
+
+	pushcli();
+	pmm_cpu_cache* c = pmm_local_cache();
+	pmm_backend_lock();
+	for(i = 0; i < n; i++)	{
+		num = frames[i] / PMM_BLK_SZ;
+		if(num == 0 || num >= pmm_blocks || !pmm_backend_is_taken(num))
+			continue;
+
+		// Same rules as pmm_free, but blocks go to the allocator when the cache is
+		// full
+		if(pmm_block_zone(num) == PMM_ZONE_NORMAL && c->count < PMM_CPU_CACHE_SZ)	{
+			if(!pmm_cache_mark(num))	c->blocks[c->count++] = num;
 		}
+		else if(!bitmap_is_set(pmm_cached, num))
+			pmm_backend_free_range(num, num + 1);
 	}
-	return NULL;
+	pmm_backend_unlock();
+	popcli();
 }
 
+
 void pmm_free(void* block)	{
-	uint32_t num = (uint32_t)block;
-	num /= PMM_BLK_SZ;
-	bitmap_unset(pmm_bitmap, num);
+	pmm_free_phys((uint32_t)block);
+}
+
+void pmm_free_phys(paddr_t addr)	{
+	if(addr >= (paddr_t)pmm_blocks * PMM_BLK_SZ)	return;
+	uint32_t num = (uint32_t)(addr / PMM_BLK_SZ);
+
+	// Block 0 is never handed out and free blocks should not be cached
+	if(num == 0 || !pmm_backend_is_taken(num))
+		return;
+
+	// Scarce memory goes straight back, so that pmm_alloc_zone can find it, and
+	// blocks above 4 GB can not be handed out as pointers from the cache
+	if(pmm_block_zone(num) != PMM_ZONE_NORMAL)	{
+		pmm_backend_lock();
+		pmm_backend_free_range(num, num + 1);
+		pmm_backend_unlock();
+		return;
+	}
+
+	// A cached block is also taken in the backend, but is already free
+	if(pmm_cache_mark(num))	return;
+
+	pushcli();
+	pmm_cpu_cache* c = pmm_local_cache();
+	if(c->count >= PMM_CPU_CACHE_SZ)	{
+		pmm_cache_drain(c, PMM_CPU_CACHE_BATCH);
+	}
+	c->blocks[c->count++] = num;
+	popcli();
 }
 
 
 
 
 void* pmm_alloc_first_n_blocks(uint32_t n)	{
-	uint32_t found = 0, i;
-	for(i = 1; i < pmm_bitmap_sz; i++)	{
-		if(!bitmap_is_set(pmm_bitmap,i))	{
-			found++;
-			if(found == n)	{
-				for(; found > 0; found--)	{
-					bitmap_set(pmm_bitmap, i-(found-1));
-				}
-				return (void*)((i-(n-1))*PMM_BLK_SZ);
-			}
+	return pmm_alloc_zone(PMM_ZONE_NORMAL, n);
+}
+
+
+paddr_t pmm_alloc_phys()	{
+	uint32_t block = 0;
+	if(pmm_zone_free[PMM_ZONE_HIGH] > 0)	{
+		pmm_backend_lock();
+		if(pmm_backend_alloc_batch(&block, 1, PMM_ZONE_HIGH) == 0)	block = 0;
+		pmm_backend_unlock();
+	}
+	if(block != 0)	return (paddr_t)block * PMM_BLK_SZ;
+
+	// Memory below 4 GB, it is also the fallback without PAE
+	return (paddr_t)(uint32_t)pmm_alloc_first();
+}
+
+
+void* pmm_alloc_zone(pmm_zone zone, uint32_t n)	{
+	if(zone >= PMM_ZONES)	return NULL;
+	return pmm_alloc_run(zone, n, 1);
+}
+
+
+void* pmm_alloc_aligned(uint32_t n, uint32_t align)	{
+	// Must be a power of 2
+	if(align == 0 || (align & (align - 1)) != 0)	return NULL;
+	return pmm_alloc_run(PMM_ZONE_NORMAL, n, align);
+}
+
+
+uint32_t pmm_zone_free_blocks(pmm_zone zone)	{
+	if(zone >= PMM_ZONES)	return 0;
+	return pmm_zone_free[zone];
+}
+
+
+uint32_t pmm_free_blocks()	{
+	uint32_t i, ret = 0;
+	for(i = 0; i < PMM_ZONES; i++)	{
+		ret += pmm_zone_free[i];
+	}
+	return ret;
+}
+
+
+void* pmm_alloc_zeroed()	{
+	uint32_t block = 0;
+
+	spinlock_acquire(&pmm_zero_lock);
+	if(pmm_zero_info.count > 0)	{
+		block = pmm_zero_pool[--pmm_zero_info.count];
+		pmm_cache_unmark(block);
+		pmm_zero_info.hits++;
+	}
+	else	{
+		pmm_zero_info.misses++;
+	}
+	spinlock_release(&pmm_zero_lock);
+
+	if(block != 0)	return (void*)(block * PMM_BLK_SZ);
+
+	// Pool is empty, so the caller has to wait for the zeroing
+	void* ret = pmm_alloc_first();
+	if(ret != NULL)	{
+		vmm_zero_page((uint32_t)ret);
+	}
+	return ret;
+}
+
+
+uint32_t pmm_zero_pool_fill()	{
+	uint32_t added = 0;
+	bool full = false;
+	while(added < PMM_ZERO_POOL_BATCH && pmm_zero_info.count < PMM_ZERO_POOL_SZ)	{
+		// Must not take a frame from the pool itself
+		void* frame = pmm_alloc_cached();
+		if(frame == NULL)	break;
+
+		// Zero it before taking the lock, that is the slow part
+		vmm_zero_page((uint32_t)frame);
+
+		spinlock_acquire(&pmm_zero_lock);
+		full = (pmm_zero_info.count >= PMM_ZERO_POOL_SZ);
+		if(!full)	{
+			pmm_zero_pool[pmm_zero_info.count++] = (uint32_t)frame / PMM_BLK_SZ;
+			pmm_cache_mark((uint32_t)frame / PMM_BLK_SZ);
+			pmm_zero_info.filled++;
+		}
+		spinlock_release(&pmm_zero_lock);
+
+		// Another CPU filled the pool while we were zeroing
+		if(full)	{
+			pmm_free(frame);
+			break;
+		}
+		added++;
+	}
+	return added;
+}
+
+
+void pmm_zero_pool_stats(pmm_zero_stats* stats)	{
+	spinlock_acquire(&pmm_zero_lock);
+	*stats = pmm_zero_info;
+	spinlock_release(&pmm_zero_lock);
+}
+
+
+void pmm_owner_add(pmm_owner owner, int32_t blocks)	{
+	if(owner < PMM_OWNERS)	{
+		atomic_add(&pmm_owner_blocks[owner], blocks);
+	}
+}
+
+
+void pmm_stats(pmm_statistics* stats)	{
+	uint32_t i;
+	memset(stats, 0x00, sizeof(*stats));
+
+	stats->total = pmm_blocks;
+	stats->reserved = pmm_reserved;
+	for(i = 0; i < PMM_ZONES; i++)	{
+		stats->zone_free[i] = pmm_zone_free[i];
+		stats->free += pmm_zone_free[i];
+	}
+	for(i = 0; i < PMM_OWNERS; i++)	{
+		stats->owner[i] = pmm_owner_blocks[i];
+	}
+
+	// Caches of the other CPUs are read without any lock
+	pmm_zero_pool_stats(&stats->zero);
+	stats->cached = stats->zero.count;
+	for(i = 0; i < MAX_CPUS; i++)	{
+		stats->cached += cpus[i].frames.count;
+	}
+
+	uint32_t taken = stats->free + stats->cached + stats->reserved;
+	stats->used = (taken < stats->total) ? stats->total - taken : 0;
+
+	pmm_backend_lock();
+	pmm_find_free_runs(stats);
+	pmm_backend_unlock();
+}
+
+
+void pmm_print_stats(enum KM_Level kl)	{
+	const char* zones[PMM_ZONES] = {"low", "dma", "normal", "high"};
+	const char* owners[PMM_OWNERS] = {"heap", "page tables", "kstacks", "modules",
+		"references", "zswap"};
+	pmm_statistics st;
+	uint32_t i;
+	pmm_stats(&st);
+
+	kprintf(kl, "[PMM] %i blocks: %i free, %i cached, %i used, %i reserved\n",
+		st.total, st.free, st.cached, st.used, st.reserved);
+	for(i = 0; i < PMM_ZONES; i++)	{
+		kprintf(kl, "[PMM] zone %s: %i free, largest run %i\n",
+			zones[i], st.zone_free[i], st.largest_run[i]);
+	}
+	for(i = 0; i < PMM_RUN_BUCKETS; i++)	{
+		if(st.runs[i] == 0)	continue;
+		if(i == PMM_RUN_BUCKETS - 1)
+			kprintf(kl, "[PMM] runs %i+: %i\n", 1 << i, st.runs[i]);
+		else if(i == 0)
+			kprintf(kl, "[PMM] runs 1: %i\n", st.runs[i]);
+		else
+			kprintf(kl, "[PMM] runs %i-%i: %i\n", 1 << i, (2 << i) - 1, st.runs[i]);
+	}
+	for(i = 0; i < PMM_OWNERS; i++)	{
+		kprintf(kl, "[PMM] %s: %i\n", owners[i], st.owner[i]);
+	}
+	kprintf(kl, "[PMM] zero pool: %i hits, %i misses, %i filled, %i in pool\n",
+		st.zero.hits, st.zero.misses, st.zero.filled, st.zero.count);
+}
+
+
+
+
+
+void pmm_refs_init()	{
+	uint32_t i, bytes = pmm_blocks * sizeof(uint32_t);
+	align_upwards(bytes, PMM_BLK_SZ);
+	if(bytes > FRAME_REFS_SIZE)	PANIC("Too many blocks for reference counts");
+
+	for(i = 0; i < bytes; i += PMM_BLK_SZ)	{
+		void* frame = pmm_alloc_zeroed();
+		if(frame == NULL || vmm_map_page((uint32_t)frame, FRAME_REFS_START + i,
+			X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) != VMM_SUCCESS)	{
+			PANIC("Unable to map reference counts");
 		}
-		else	found = 0;
 	}
-	return NULL;
+	pmm_owner_add(PMM_OWNER_REFS, bytes / PMM_BLK_SZ);
+	pmm_refs = (uint32_t*)FRAME_REFS_START;
+}
+
+void pmm_ref_inc(paddr_t addr)	{
+	atomic_add(&pmm_refs[addr / PMM_BLK_SZ], 1);
+}
+
+uint32_t pmm_ref_dec(paddr_t addr)	{
+	uint32_t old = atomic_xadd(&pmm_refs[addr / PMM_BLK_SZ], -1);
+	if(old == 0)	PANIC("Block has no references");
+	return old - 1;
 }
 
+uint32_t pmm_ref_count(paddr_t addr)	{
+	return pmm_refs[addr / PMM_BLK_SZ];
+}
 
 
 
 
 //------------------- Internal function implementation ------------------------
 
-uint32_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len)	{
-	uint32_t max = 0;
+uint64_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len)	{
+	uint64_t max = 0;
 	uint32_t mmap_addr = (uint32_t)mmap;
 	while((uint32_t)mmap < mmap_addr + len)	{
-		if(mmap->type == 1)	{
-			max = ((uint32_t)mmap->base_addr_l + (uint32_t)mmap->length_l);
+		if(mmap->type == 1 && pmm_mmap_end(mmap) > max)	{
+			max = pmm_mmap_end(mmap);
 		}
 		mmap = (multiboot_mmap*)((uint32_t)mmap + (mmap->size + 4));
 	}
+	if(max > PMM_MAX_PHYS)	max = PMM_MAX_PHYS;
+	align_downwards(max, PMM_BLK_SZ);
 	return max;
 }
 
 
+uint32_t pmm_find_metadata_space(multiboot_mmap* mmap, uint32_t len,
+	uint32_t bytes, uint32_t* space)	{
+	uint32_t ret = 0, i;
+	uint32_t map_start = (uint32_t)mmap, map_end = (uint32_t)mmap + len;
+	align_downwards(map_start, PMM_BLK_SZ);
+	align_upwards(map_end, PMM_BLK_SZ);
+
+	*space = 0;
+	multiboot_mmap* copy = mmap;
+	while((uint32_t)copy < (uint32_t)mmap + len)	{
+		uint64_t rbase = pmm_mmap_base(copy), rend = pmm_mmap_end(copy);
+		if(copy->type == 1 && rbase < PMM_ZONE_LOW_END && rend > PMM_METADATA_START)	{
+			uint32_t base = (rbase < PMM_METADATA_START) ?
+				PMM_METADATA_START : (uint32_t)rbase;
+			uint32_t end = (rend > PMM_ZONE_LOW_END) ?
+				PMM_ZONE_LOW_END : (uint32_t)rend;
+			align_upwards(base, PMM_BLK_SZ);
+			align_downwards(end, PMM_BLK_SZ);
+
+			// The memory map is still in use, so the region might be split in two
+			uint32_t starts[2] = {base, map_end}, ends[2] = {map_start, end};
+			if(map_end <= base || map_start >= end)	{
+				ends[0] = end;
+				starts[1] = ends[1] = 0;
+			}
+			for(i = 0; i < 2; i++)	{
+				if(ends[i] <= starts[i] || ends[i] - starts[i] <= *space)	continue;
+				*space = ends[i] - starts[i];
+				ret = starts[i];
+				if(*space >= bytes)	return ret;
+			}
+		}
+		copy = (multiboot_mmap*)((uint32_t)copy + (copy->size + 4));
+	}
+	return ret;
+}
+
+
+void* pmm_alloc_run(pmm_zone zone, uint32_t n, uint32_t align)	{
+	if(n == 0)	return NULL;
+
+	// The address must fit in a pointer
+	if(zone > PMM_ZONE_NORMAL)	zone = PMM_ZONE_NORMAL;
+
+	uint32_t start = 0;
+	int32_t z;
+	pmm_backend_lock();
+	for(z = zone; z >= 0 && start == 0; z--)	{
+		start = pmm_backend_alloc_n(n, align, (pmm_zone)z);
+	}
+	pmm_backend_unlock();
+	return (void*)(start*PMM_BLK_SZ);
+}
+
+
+void* pmm_alloc_cached()	{
+	void* ret = NULL;
+	pushcli();
+	pmm_cpu_cache* c = pmm_local_cache();
+	if(c->count == 0)	{
+		pmm_cache_refill(c);
+	}
+	if(c->count > 0)	{
+		pmm_cache_unmark(c->blocks[--c->count]);
+		ret = (void*)(c->blocks[c->count] * PMM_BLK_SZ);
+	}
+	popcli();
+	return ret;
+}
+
+
+void pmm_cache_refill(pmm_cpu_cache* c)	{
+	uint32_t got[PMM_CPU_CACHE_BATCH];
+	uint32_t n = 0;
+	int32_t z;
+
+	pmm_backend_lock();
+	for(z = PMM_ZONE_NORMAL; z >= 0 && n == 0; z--)	{
+		n = pmm_backend_alloc_batch(got, PMM_CPU_CACHE_BATCH, (pmm_zone)z);
+	}
+	pmm_backend_unlock();
+
+	// First block found is placed last, so that it is handed out first
+	while(n > 0 && c->count < PMM_CPU_CACHE_SZ)	{
+		pmm_cache_mark(got[--n]);
+		c->blocks[c->count++] = got[n];
+	}
+}
+
+
+void pmm_cache_drain(pmm_cpu_cache* c, uint32_t n)	{
+	if(n > c->count)	n = c->count;
+
+	pmm_backend_lock();
+	// Give back the blocks at the bottom, those that have been cached longest
+	uint32_t i;
+	for(i = 0; i < n; i++)	{
+		pmm_cache_unmark(c->blocks[i]);
+		pmm_backend_free_range(c->blocks[i], c->blocks[i] + 1);
+	}
+	pmm_backend_unlock();
+
+	for(i = n; i < c->count; i++)	{
+		c->blocks[i-n] = c->blocks[i];
+	}
+	c->count -= n;
+}
+
+
+void pmm_find_free_runs(pmm_statistics* stats)	{
+	uint32_t z, b, run, bucket;
+	for(z = 0; z < PMM_ZONES; z++)	{
+		uint32_t end = pmm_zone_end((pmm_zone)z);
+		run = 0;
+
+		// One extra round at the end to count the last run
+		for(b = pmm_zone_start((pmm_zone)z); b <= end; b++)	{
+			if(b < end && !pmm_backend_is_taken(b))	{
+				run++;
+				continue;
+			}
+			if(run == 0)	continue;
+
+			for(bucket = 0; bucket < PMM_RUN_BUCKETS - 1 && (2U << bucket) <= run;
+				bucket++);
+			stats->runs[bucket]++;
+			if(run > stats->largest_run[z])	stats->largest_run[z] = run;
+			run = 0;
+		}
+	}
+}
+
+
+uint32_t pmm_zero_pool_take()	{
+	uint32_t ret = 0;
+	spinlock_acquire(&pmm_zero_lock);
+	if(pmm_zero_info.count > 0)	{
+		ret = pmm_zero_pool[--pmm_zero_info.count];
+		pmm_cache_unmark(ret);
+	}
+	spinlock_release(&pmm_zero_lock);
+	return ret;
+}
+
+
 
 //------------- Test-code -------------------------
 
@@ -230,8 +787,8 @@ uint32_t pmm_get_max_space(multiboot_mmap* mmap, uint32_t len)	{
 
 #ifdef TEST_KERNEL
 int pmm_test_defines()	{
-	uint8_t arr[2];
-	memset(arr, 0x00, 2);
+	uint32_t arr[2];
+	memset(arr, 0x00, sizeof(arr));
 	
 	bitmap_set(arr, 1);
 	if(!bitmap_is_set(arr,1))	return 1;
@@ -247,6 +804,14 @@ int pmm_test_defines()	{
 	bitmap_set(arr, 8);
 	if(!bitmap_is_set(arr,8))	return 4;
 
+	// Last bit in the first word and first bit in the second word
+	bitmap_set(arr, 31);
+	bitmap_set(arr, 32);
+	if(arr[0] != 0x8000010C || arr[1] != 0x01)	return 11;
+
+	if(lowest_set_bit(arr[0]) != 2 || lowest_set_bit(0x80000000) != 31)
+		return 12;
+
 	int32_t num = 0;
 
 	align_downwards(num, 4096);
@@ -275,6 +840,13 @@ int pmm_test_defines()	{
 	align_upwards(num, 4096);
 	if(num != 8192)	return 10;
 
+	// Zone boundaries
+	if(pmm_block_zone(0) != PMM_ZONE_LOW || pmm_block_zone(255) != PMM_ZONE_LOW)
+		return 13;
+	if(pmm_block_zone(256) != PMM_ZONE_DMA || pmm_block_zone(4095) != PMM_ZONE_DMA)
+		return 14;
+	if(pmm_block_zone(4096) != PMM_ZONE_NORMAL)	return 15;
+
 	return 0;
 }
 
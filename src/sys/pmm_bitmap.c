@@ -0,0 +1,398 @@
+/**
+* \file pmm_bitmap.c
+* Bitmap allocator for the physical memory manager, see pmm_backend.h.
+* One bit is used for each block, a set bit means that the block is taken. The
+* bitmap is handled one 32-bit word at a time and a second level bitmap
+* (pmm_summary) has one bit for each word that is completely taken, so that
+* full parts of memory can be skipped 32 * 32 blocks at a time. Single blocks
+* are allocated next-fit, starting from where the last search ended in the
+* same zone. The zone boundaries are multiples of 32 blocks, so a word never
+* contains blocks from two zones.
+*
+* The allocator does not need pmm_lock, all changes to the bitmap are atomic:
+* - Blocks are allocated by claiming the free bits of a word with cmpxchg, if
+* another CPU changed the word in the meantime, the word is read again.
+* - Consecutive blocks are claimed one word at a time with cmpxchg, if one of the
+* words is no longer free, the words that were claimed are given back and the
+* search continues after the conflict.
+* - Single blocks are freed and taken with lock btr / lock bts.
+* - The summary is only a hint, a set bit means that the word was full when it
+* was checked. When a bit is set, the word is checked again afterwards and the
+* bit is cleared if a block was freed at the same time, so free blocks are never
+* hidden from the search.
+*/
+/**
+* \addtogroup pmm
+* @{
+*/
+
+#include "sys/kernel.h"
+#include "sys/pmm_backend.h"
+
+#include "hal/hal.h"
+
+#if !PMM_USE_BUDDY
+
+
+/** Address to the bitmap. */
+volatile uint32_t* pmm_bitmap = NULL;
+
+/**
+* The number of blocks in the system and also the number of bits used after
+* pmm_bitmap to mark available and unavailable space.
+*/
+uint32_t pmm_bitmap_sz = 0;
+
+/** Number of words in pmm_bitmap. */
+uint32_t pmm_bitmap_words = 0;
+
+/**
+* One bit for each word in pmm_bitmap, the bit is set if all the blocks in that
+* word are taken. Is stored right after pmm_bitmap.
+*/
+volatile uint32_t* pmm_summary = NULL;
+
+/** Number of words in pmm_summary. */
+uint32_t pmm_summary_words = 0;
+
+/**
+* Word in pmm_bitmap where the search for a single free block starts. Is only
+* a hint and is read and written without any lock.
+*/
+uint32_t pmm_next_word[PMM_ZONES];
+
+
+
+
+//--------------- Internal function definitions ---------------------------
+
+/**
+* Find the first word at or after a given word that has at least one free
+* block, using the summary bitmap.
+* \param[in] from Word index where the search starts.
+* \param[in] end Word index where the search stops.
+* \return Index of the word or end if there is no such word.
+*/
+uint32_t pmm_find_free_word(uint32_t from, uint32_t end);
+
+/**
+* Find n consecutive blocks that are free, without taking them.
+* \param[in] from Word index where the search starts.
+* \param[in] end Word index where the search stops.
+* \param[out] start First block in the range.
+* \return Returns true if a range was found.
+*/
+bool pmm_find_run(uint32_t n, uint32_t from, uint32_t end, uint32_t* start);
+
+/**
+* Same as pmm_find_run, but the first block must be a multiple of align. The
+* runs always start at the beginning of a word, so alignments below
+* PMM_WORD_BITS are rounded up.
+*/
+bool pmm_find_aligned_run(uint32_t n, uint32_t align, uint32_t from, uint32_t end,
+	uint32_t* start);
+
+/**
+* Take n consecutive blocks, one word at a time.
+* \param[out] conflict Word that was no longer free if the claim failed.
+* \return Returns true if all blocks were taken, if false, none of them are.
+*/
+bool pmm_claim_run(uint32_t start, uint32_t n, uint32_t* conflict);
+
+/**
+* Set the summary bit for all words that are completely taken.
+*/
+void pmm_summary_rebuild();
+
+
+/** First word in a zone. */
+static inline uint32_t pmm_zone_first_word(pmm_zone zone)	{
+	return pmm_zone_start(zone) / PMM_WORD_BITS;
+}
+
+/** Word after the last word in a zone. */
+static inline uint32_t pmm_zone_end_word(pmm_zone zone)	{
+	uint32_t end = pmm_zone_end(zone);
+	return (end / PMM_WORD_BITS) + ((end % PMM_WORD_BITS) ? 1 : 0);
+}
+
+/** Mask with up to n of the lowest free bits in word. */
+static inline uint32_t pmm_free_mask(uint32_t word, uint32_t n)	{
+	uint32_t free = ~word, ret = 0;
+	if(n >= PMM_WORD_BITS)	return free;
+	while(free != 0 && n-- > 0)	{
+		ret |= (free & -free);
+		free &= (free - 1);
+	}
+	return ret;
+}
+
+/** Bits of word w that are part of the range from start and up to end. */
+static inline uint32_t pmm_range_mask(uint32_t w, uint32_t start, uint32_t end)	{
+	uint32_t first = w * PMM_WORD_BITS, lo = 0, hi = PMM_WORD_BITS;
+	if(start > first)	lo = start - first;
+	if(end < first + PMM_WORD_BITS)	hi = end - first;
+	uint32_t mask = (hi == PMM_WORD_BITS) ? PMM_WORD_FULL : ((1U << hi) - 1);
+	return mask & (PMM_WORD_FULL << lo);
+}
+
+/** Set the summary bit if the word is full, without hiding a block freed now. */
+static inline void pmm_summary_update(uint32_t w)	{
+	if(pmm_bitmap[w] != PMM_WORD_FULL)	return;
+	atomic_bts(&pmm_summary[w/PMM_WORD_BITS], w % PMM_WORD_BITS);
+
+	// A block might have been freed between the check and the update
+	if(pmm_bitmap[w] != PMM_WORD_FULL)	{
+		atomic_btr(&pmm_summary[w/PMM_WORD_BITS], w % PMM_WORD_BITS);
+	}
+}
+
+/** Mark block as taken and update the summary. */
+static inline void pmm_take_block(uint32_t block)	{
+	uint32_t w = block / PMM_WORD_BITS;
+	if(atomic_bts(&pmm_bitmap[w], block % PMM_WORD_BITS))	return;
+	atomic_add(&pmm_zone_free[pmm_block_zone(block)], -1);
+	pmm_summary_update(w);
+}
+
+/** Mark block as free and update the summary. */
+static inline void pmm_release_block(uint32_t block)	{
+	uint32_t w = block / PMM_WORD_BITS;
+	if(!atomic_btr(&pmm_bitmap[w], block % PMM_WORD_BITS))	return;
+	atomic_add(&pmm_zone_free[pmm_block_zone(block)], 1);
+
+	// Must happen after the block is free, see pmm_summary_update
+	atomic_btr(&pmm_summary[w/PMM_WORD_BITS], w % PMM_WORD_BITS);
+}
+
+
+
+
+//------------------- Backend function implementations ------------------
+
+uint32_t pmm_backend_size(uint32_t blocks)	{
+	uint32_t words = blocks / PMM_WORD_BITS;
+	if(blocks % PMM_WORD_BITS != 0)	words++;
+
+	uint32_t summary = words / PMM_WORD_BITS;
+	if(words % PMM_WORD_BITS != 0)	summary++;
+
+	// Bitmap and summary is stored together
+	return (words + summary) * 4;
+}
+
+
+void pmm_backend_init(void* data, uint32_t blocks)	{
+	pmm_bitmap_sz = blocks;
+	pmm_bitmap_words = blocks / PMM_WORD_BITS;
+	if(blocks % PMM_WORD_BITS != 0)	pmm_bitmap_words++;
+	pmm_summary_words = pmm_bitmap_words / PMM_WORD_BITS;
+	if(pmm_bitmap_words % PMM_WORD_BITS != 0)	pmm_summary_words++;
+
+	pmm_bitmap = (uint32_t*)data;
+	pmm_summary = pmm_bitmap + pmm_bitmap_words;
+
+	uint32_t z;
+	for(z = 0; z < PMM_ZONES; z++)	{
+		pmm_next_word[z] = pmm_zone_first_word((pmm_zone)z);
+	}
+
+	memset((void*)pmm_bitmap, 0xFF, pmm_bitmap_words * 4);
+	pmm_summary_rebuild();
+}
+
+
+void pmm_backend_free_range(uint32_t start, uint32_t end)	{
+	uint32_t i;
+	for(i = start; i < end && i < pmm_bitmap_sz; i++)	{
+		pmm_release_block(i);
+	}
+}
+
+
+void pmm_backend_take_range(uint32_t start, uint32_t end)	{
+	uint32_t i;
+	for(i = start; i < end && i < pmm_bitmap_sz; i++)	{
+		pmm_take_block(i);
+	}
+}
+
+
+bool pmm_backend_is_taken(uint32_t block)	{
+	return bitmap_is_set(pmm_bitmap, block) != 0;
+}
+
+
+uint32_t pmm_backend_alloc_batch(uint32_t* blocks, uint32_t n, pmm_zone zone)	{
+	uint32_t first = pmm_zone_first_word(zone), end = pmm_zone_end_word(zone);
+	uint32_t found = 0, w = pmm_next_word[zone];
+	bool wrapped = false;
+	if(w < first || w >= end)	w = first;
+	while(found < n && pmm_zone_free[zone] > 0)	{
+		w = pmm_find_free_word(w, end);
+		if(w >= end)	{
+			if(wrapped)	break;
+			wrapped = true;
+			w = first;
+			continue;
+		}
+
+		// Claim the free blocks we need, try again if the word was changed
+		uint32_t old, take, cur = pmm_bitmap[w];
+		do	{
+			old = cur;
+			take = pmm_free_mask(old, n - found);
+			if(take == 0)	break;
+		} while((cur = cmpxchg(&pmm_bitmap[w], old, old | take)) != old);
+
+		int32_t taken = 0;
+		while(take != 0)	{
+			blocks[found++] = (w * PMM_WORD_BITS) + lowest_set_bit(take);
+			take &= (take - 1);
+			taken++;
+		}
+		atomic_add(&pmm_zone_free[zone], -taken);
+
+		if(pmm_bitmap[w] == PMM_WORD_FULL)	{
+			pmm_summary_update(w);
+			w++;
+		}
+	}
+	pmm_next_word[zone] = (w < end) ? w : first;
+	return found;
+}
+
+
+uint32_t pmm_backend_alloc_n(uint32_t n, uint32_t align, pmm_zone zone)	{
+	uint32_t end = pmm_zone_end_word(zone), from = pmm_zone_first_word(zone);
+	uint32_t start, w;
+	while(n <= pmm_zone_free[zone] && ((align <= 1) ?
+		pmm_find_run(n, from, end, &start) :
+		pmm_find_aligned_run(n, align, from, end, &start)))	{
+		if(pmm_claim_run(start, n, &from))	{
+			atomic_add(&pmm_zone_free[zone], -(int32_t)n);
+			for(w = start / PMM_WORD_BITS; w <= (start + n - 1) / PMM_WORD_BITS; w++)	{
+				pmm_summary_update(w);
+			}
+			return start;
+		}
+		// Another CPU took some of the blocks, continue from that word
+	}
+	return 0;
+}
+
+
+
+
+//------------------- Internal function implementation ------------------------
+
+uint32_t pmm_find_free_word(uint32_t from, uint32_t end)	{
+	uint32_t s = from / PMM_WORD_BITS, ret;
+	if(from >= end || s >= pmm_summary_words)	return end;
+
+	// Ignore the words before "from" in the first summary word
+	uint32_t free = ~pmm_summary[s] & (PMM_WORD_FULL << (from % PMM_WORD_BITS));
+	while(free == 0)	{
+		if(++s >= pmm_summary_words || s * PMM_WORD_BITS >= end)	return end;
+		free = ~pmm_summary[s];
+	}
+	ret = (s * PMM_WORD_BITS) + lowest_set_bit(free);
+	return (ret < end) ? ret : end;
+}
+
+
+bool pmm_find_run(uint32_t n, uint32_t from, uint32_t end, uint32_t* start)	{
+	uint32_t run = 0, w = from, prev = from, i;
+	while(run < n && (w = pmm_find_free_word(w, end)) < end)	{
+		// Full words were skipped, so the run is broken
+		if(w != prev + 1)	run = 0;
+
+		uint32_t word = pmm_bitmap[w];
+		if(word == 0)	{
+			if(run == 0)	*start = w * PMM_WORD_BITS;
+			run += PMM_WORD_BITS;
+		}
+		else	{
+			for(i = 0; i < PMM_WORD_BITS && run < n; i++)	{
+				if(word & (1U << i))	{
+					run = 0;
+				}
+				else	{
+					if(run == 0)	*start = (w * PMM_WORD_BITS) + i;
+					run++;
+				}
+			}
+		}
+		prev = w++;
+	}
+	return run >= n;
+}
+
+
+bool pmm_find_aligned_run(uint32_t n, uint32_t align, uint32_t from, uint32_t end,
+	uint32_t* start)	{
+	uint32_t step = align / PMM_WORD_BITS, full = n / PMM_WORD_BITS, w, i;
+	uint32_t rest = (1U << (n % PMM_WORD_BITS)) - 1;
+	if(step == 0)	step = 1;
+
+	// First aligned word, w is always a multiple of step
+	w = ((from + step - 1) / step) * step;
+	while(w + full + (rest ? 1 : 0) <= end)	{
+		// The word after the last full word must be checked for the remainder
+		for(i = 0; i < full && pmm_bitmap[w + i] == 0; i++);
+		if(i == full && (rest == 0 || (pmm_bitmap[w + full] & rest) == 0))	{
+			*start = w * PMM_WORD_BITS;
+			return true;
+		}
+
+		// Next aligned word after the one that was taken, the summary is used
+		// to skip taken memory
+		w = pmm_find_free_word(w + i + 1, end);
+		w = ((w + step - 1) / step) * step;
+	}
+	return false;
+}
+
+
+bool pmm_claim_run(uint32_t start, uint32_t n, uint32_t* conflict)	{
+	uint32_t first = start / PMM_WORD_BITS, last = (start + n - 1) / PMM_WORD_BITS;
+	uint32_t w, old, cur, mask;
+	for(w = first; w <= last; w++)	{
+		mask = pmm_range_mask(w, start, start + n);
+		cur = pmm_bitmap[w];
+		do	{
+			old = cur;
+			if(old & mask)	break;
+		} while((cur = cmpxchg(&pmm_bitmap[w], old, old | mask)) != old);
+
+		if(old & mask)	{
+			*conflict = w;
+
+			// Give back what we have claimed so far, the summary is cleared in the
+			// same way as in pmm_release_block
+			while(w-- > first)	{
+				atomic_and(&pmm_bitmap[w], ~pmm_range_mask(w, start, start + n));
+				atomic_btr(&pmm_summary[w/PMM_WORD_BITS], w % PMM_WORD_BITS);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+
+void pmm_summary_rebuild()	{
+	uint32_t i;
+	memset((void*)pmm_summary, 0x00, pmm_summary_words * 4);
+	for(i = 0; i < pmm_summary_words * PMM_WORD_BITS; i++)	{
+		// Words after the end of the bitmap can never be used
+		if(i >= pmm_bitmap_words || pmm_bitmap[i] == PMM_WORD_FULL)	{
+			bitmap_set(pmm_summary, i);
+		}
+	}
+}
+
+
+#endif	// !PMM_USE_BUDDY
+
+/** @} */	// pmm
@@ -0,0 +1,368 @@
+/**
+* \file pmm_buddy.c
+* Buddy allocator for the physical memory manager, see pmm_backend.h.
+* Memory is divided into blocks of order 0 (1 block, 4 KB) up to order
+* PMM_BUDDY_MAX_ORDER (1024 blocks, 4 MB). A block of order k always starts on a
+* multiple of 2^k blocks and the block next to it which together form a block of
+* order k+1 is its buddy.
+*
+* Free blocks are stored in one bitmap per order, bit i is set if the block
+* starting at i * 2^k is free and it is not part of a larger free block. This
+* needs about 2 bits per block in total, which is small enough to be placed in
+* low memory. Each order also has a count of free blocks, so allocation knows
+* which order to split without searching.
+*
+* Above the bitmap of each order are summary levels, like pmm_summary in
+* pmm_bitmap.c, where bit i is set if word i in the level below is not 0. The
+* top level is a single word, so finding the first free block after a given
+* one reads one word per level, 4 levels for 4 GB of order 0 blocks.
+* - Allocation of order k takes a free block from the lowest order >= k and
+* splits it in half until it has order k.
+* - Freeing a block merges it with its buddy as long as the buddy is free, so
+* both is O(log n) in the number of orders and blocks.
+*
+* Blocks are never merged across a zone boundary, so each free block belongs to
+* exactly one zone and the counts and hints are kept per zone.
+*/
+/**
+* \addtogroup pmm
+* @{
+*/
+
+#include "sys/kernel.h"
+#include "sys/pmm_backend.h"
+
+#if PMM_USE_BUDDY
+
+#define PMM_BUDDY_ORDERS (PMM_BUDDY_MAX_ORDER + 1)
+
+/** Max number of levels for each order, enough for 2^30 blocks. */
+#define PMM_BUDDY_LEVELS 6
+
+/** Returned by buddy_next_free if there is no free block. */
+#define PMM_BUDDY_NONE 0xFFFFFFFF
+
+
+/**
+* Bitmaps for each order, level 0 has the free blocks and each level above is a
+* summary of the one below.
+*/
+uint32_t* buddy_map[PMM_BUDDY_ORDERS][PMM_BUDDY_LEVELS];
+
+/** Number of words in each bitmap. */
+uint32_t buddy_words[PMM_BUDDY_ORDERS][PMM_BUDDY_LEVELS];
+
+/** Number of levels for each order, the top one is a single word. */
+uint32_t buddy_levels[PMM_BUDDY_ORDERS];
+
+/** Number of free blocks of each order in each zone. */
+uint32_t buddy_free[PMM_ZONES][PMM_BUDDY_ORDERS];
+
+/** Number of blocks in the system. */
+uint32_t buddy_blocks = 0;
+
+
+
+
+//--------------- Internal function definitions ---------------------------
+
+/**
+* Free a block and merge it with its buddy for as long as possible.
+* \param[in] block First block, must be aligned to the order.
+* \param[in] order Order of the block.
+*/
+void buddy_free_block(uint32_t block, uint32_t order);
+
+/**
+* Take a free block of a given order, splitting a larger one if necessary.
+* \return The first block or 0 if there is no free block large enough.
+*/
+uint32_t buddy_alloc(uint32_t order, pmm_zone zone);
+
+/**
+* Find a free block of a given order in a zone.
+* \return Index of the block in buddy_map[order][0].
+* \remark There must be at least one such block.
+*/
+uint32_t buddy_find_free(uint32_t order, pmm_zone zone);
+
+/**
+* Find the first free block of a given order at or after idx, using the
+* summary levels.
+* \return Index of the block or PMM_BUDDY_NONE.
+*/
+uint32_t buddy_next_free(uint32_t idx, uint32_t order);
+
+/**
+* Mark one free block as taken, the free block it is part of is split.
+* \return Returns the number of blocks that was taken, starting at block. Is 0
+* if the block was already taken.
+* \param[in] limit Blocks at or after this should not be taken.
+*/
+uint32_t buddy_take(uint32_t block, uint32_t limit);
+
+
+/** Number of blocks of the given order in the system. */
+static inline uint32_t buddy_count(uint32_t blocks, uint32_t order)	{
+	return blocks >> order;
+}
+
+/** Number of words needed for a bitmap of n bits. */
+static inline uint32_t buddy_bits_words(uint32_t n)	{
+	return (n + PMM_WORD_BITS - 1) / PMM_WORD_BITS;
+}
+
+static inline bool buddy_is_free(uint32_t idx, uint32_t order)	{
+	return idx < buddy_count(buddy_blocks, order) &&
+		bitmap_is_set(buddy_map[order][0], idx);
+}
+
+/** Set the bit of a block, the levels above are set if the word was 0. */
+static inline void buddy_bit_set(uint32_t idx, uint32_t order)	{
+	uint32_t l;
+	for(l = 0; l < buddy_levels[order]; l++, idx /= PMM_WORD_BITS)	{
+		bool was_empty = (buddy_map[order][l][idx / PMM_WORD_BITS] == 0);
+		bitmap_set(buddy_map[order][l], idx);
+		if(!was_empty)	break;
+	}
+}
+
+/** Clear the bit of a block, the levels above are cleared if the word is 0. */
+static inline void buddy_bit_unset(uint32_t idx, uint32_t order)	{
+	uint32_t l;
+	for(l = 0; l < buddy_levels[order]; l++, idx /= PMM_WORD_BITS)	{
+		bitmap_unset(buddy_map[order][l], idx);
+		if(buddy_map[order][l][idx / PMM_WORD_BITS] != 0)	break;
+	}
+}
+
+static inline void buddy_insert(uint32_t idx, uint32_t order)	{
+	pmm_zone zone = pmm_block_zone(idx << order);
+	buddy_bit_set(idx, order);
+	buddy_free[zone][order]++;
+	pmm_zone_free[zone] += (1U << order);
+}
+
+static inline void buddy_remove(uint32_t idx, uint32_t order)	{
+	pmm_zone zone = pmm_block_zone(idx << order);
+	buddy_bit_unset(idx, order);
+	buddy_free[zone][order]--;
+	pmm_zone_free[zone] -= (1U << order);
+}
+
+/** Check if a block of a given order would be in a single zone. */
+static inline bool buddy_in_one_zone(uint32_t block, uint32_t order)	{
+	return pmm_block_zone(block) == pmm_block_zone(block + (1U << order) - 1);
+}
+
+/**
+* Find the order of the free block that contains a given block.
+* \return The order or PMM_BUDDY_ORDERS if the block is taken.
+*/
+static inline uint32_t buddy_find_order(uint32_t block)	{
+	uint32_t order;
+	for(order = 0; order < PMM_BUDDY_ORDERS; order++)	{
+		if(buddy_is_free(block >> order, order))	break;
+	}
+	return order;
+}
+
+
+
+
+//------------------- Backend function implementations ------------------
+
+uint32_t pmm_backend_size(uint32_t blocks)	{
+	uint32_t order, n, words = 0;
+	for(order = 0; order < PMM_BUDDY_ORDERS; order++)	{
+		// Each level has one bit for each word in the level below
+		n = buddy_count(blocks, order);
+		do	{
+			n = buddy_bits_words(n);
+			words += n;
+		} while(n > 1);
+	}
+	return words * 4;
+}
+
+
+void pmm_backend_init(void* data, uint32_t blocks)	{
+	uint32_t order, z, l, n;
+	uint32_t* next = (uint32_t*)data;
+	buddy_blocks = blocks;
+	for(order = 0; order < PMM_BUDDY_ORDERS; order++)	{
+		n = buddy_count(blocks, order);
+		l = 0;
+		do	{
+			if(l >= PMM_BUDDY_LEVELS)	PANIC("Too many blocks for the buddy allocator");
+			n = buddy_bits_words(n);
+			buddy_map[order][l] = next;
+			buddy_words[order][l++] = n;
+			next += n;
+		} while(n > 1);
+		buddy_levels[order] = l;
+
+		for(z = 0; z < PMM_ZONES; z++)	buddy_free[z][order] = 0;
+	}
+
+	// No free blocks in any order
+	memset(data, 0x00, pmm_backend_size(blocks));
+}
+
+
+void pmm_backend_free_range(uint32_t start, uint32_t end)	{
+	if(end > buddy_blocks)	end = buddy_blocks;
+
+	// Free the largest aligned blocks that fit in the range and the zone
+	while(start < end)	{
+		uint32_t order = 0;
+		while(order < PMM_BUDDY_MAX_ORDER &&
+			(start & ((2U << order) - 1)) == 0 &&
+			start + (2U << order) <= end &&
+			buddy_in_one_zone(start, order + 1))	{
+			order++;
+		}
+		buddy_free_block(start, order);
+		start += (1U << order);
+	}
+}
+
+
+void pmm_backend_take_range(uint32_t start, uint32_t end)	{
+	if(end > buddy_blocks)	end = buddy_blocks;
+
+	while(start < end)	{
+		uint32_t taken = buddy_take(start, end);
+		start += (taken > 0) ? taken : 1;
+	}
+}
+
+
+bool pmm_backend_is_taken(uint32_t block)	{
+	return buddy_find_order(block) == PMM_BUDDY_ORDERS;
+}
+
+
+uint32_t pmm_backend_alloc_batch(uint32_t* blocks, uint32_t n, pmm_zone zone)	{
+	uint32_t found;
+	for(found = 0; found < n; found++)	{
+		if( (blocks[found] = buddy_alloc(0, zone)) == 0)	break;
+	}
+	return found;
+}
+
+
+uint32_t pmm_backend_alloc_n(uint32_t n, uint32_t align, pmm_zone zone)	{
+	uint32_t order = 0;
+
+	// Blocks are aligned to their size, so align is the same as asking for more
+	while((1U << order) < n || (1U << order) < align)	{
+		// Larger than a block of the highest order
+		if(++order > PMM_BUDDY_MAX_ORDER)	return 0;
+	}
+
+	uint32_t block = buddy_alloc(order, zone);
+
+	// Give back what we don't need at the end
+	if(block != 0 && (1U << order) > n)	{
+		pmm_backend_free_range(block + n, block + (1U << order));
+	}
+	return block;
+}
+
+
+
+
+//------------------- Internal function implementation ------------------------
+
+void buddy_free_block(uint32_t block, uint32_t order)	{
+	uint32_t idx = block >> order;
+	while(order < PMM_BUDDY_MAX_ORDER && buddy_is_free(idx ^ 1, order) &&
+		buddy_in_one_zone((idx >> 1) << (order + 1), order + 1))	{
+		buddy_remove(idx ^ 1, order);
+		idx >>= 1;
+		order++;
+	}
+	buddy_insert(idx, order);
+}
+
+
+uint32_t buddy_alloc(uint32_t order, pmm_zone zone)	{
+	uint32_t o = order;
+	while(o < PMM_BUDDY_ORDERS && buddy_free[zone][o] == 0)	o++;
+	if(o >= PMM_BUDDY_ORDERS)	return 0;
+
+	uint32_t idx = buddy_find_free(o, zone);
+	buddy_remove(idx, o);
+
+	// Split, the upper half is free and we continue with the lower half
+	while(o > order)	{
+		o--;
+		idx <<= 1;
+		buddy_insert(idx + 1, o);
+	}
+	return idx << order;
+}
+
+
+uint32_t buddy_find_free(uint32_t order, pmm_zone zone)	{
+	// Free blocks never cross the zone, so the first one at or after the start
+	// of the zone is in it when the zone has one
+	return buddy_next_free(pmm_zone_start(zone) >> order, order);
+}
+
+
+uint32_t buddy_next_free(uint32_t idx, uint32_t order)	{
+	uint32_t l = 0, w, bits;
+
+	// Go up until a word has a bit set at or after idx
+	while(true)	{
+		w = idx / PMM_WORD_BITS;
+		if(w >= buddy_words[order][l])	return PMM_BUDDY_NONE;
+		bits = buddy_map[order][l][w] & (PMM_WORD_FULL << (idx % PMM_WORD_BITS));
+		if(bits != 0)	break;
+		if(++l >= buddy_levels[order])	return PMM_BUDDY_NONE;
+		idx = w + 1;
+	}
+
+	// Go down, a set bit means that the word below is not 0
+	idx = (w * PMM_WORD_BITS) + lowest_set_bit(bits);
+	while(l-- > 0)	{
+		idx = (idx * PMM_WORD_BITS) + lowest_set_bit(buddy_map[order][l][idx]);
+	}
+	return idx;
+}
+
+
+uint32_t buddy_take(uint32_t block, uint32_t limit)	{
+	uint32_t order = buddy_find_order(block);
+	if(order >= PMM_BUDDY_ORDERS)	return 0;
+
+	uint32_t idx = block >> order;
+
+	// The whole free block is inside the range
+	if((idx << order) == block && block + (1U << order) <= limit)	{
+		buddy_remove(idx, order);
+		return (1U << order);
+	}
+
+	// Split towards block, the half that does not contain the block is free
+	buddy_remove(idx, order);
+	while(order > 0)	{
+		order--;
+		idx <<= 1;
+		if((block >> order) == idx + 1)	{
+			buddy_insert(idx, order);
+			idx++;
+		}
+		else	{
+			buddy_insert(idx + 1, order);
+		}
+	}
+	return 1;
+}
+
+
+#endif	// PMM_USE_BUDDY
+
+/** @} */	// pmm
@@ -4,6 +4,7 @@
 
 #include "sys/process.h"
 #include "sys/heap.h"
+#include "sys/vma.h"
 #include "sys/pmm.h"
 #include "sys/dllist.h"
 
@@ -62,6 +63,7 @@ int process_init()	{
 	p->next = p;
 
 	proc_current = p;
+	vma_user = p->mm;
 
 	change_tss(p);
 
@@ -79,19 +81,21 @@ pcb* alloc_proc(uint32_t exit, uint32_t ret2, uint32_t ret_stack)	{
 	/** \todo Handle this scenario. */
 	if(last_pid >= PROC_MAX_PID)	PANIC("Max PID used");
 	p->state = PROC_READY;
+	p->mm = (memory_desc*)heap_malloc(sizeof(memory_desc));
+	vma_init(p->mm);
 	
 
-	// Step 2: Create a kernel stack
-	// TODO: To support any other kernel stack size other than 4KB, we have to
-	// allocate more physical memory
+	// Step 2: Create a kernel stack, all the frames are fetched at once
 	uint32_t virt_addr = (uint32_t)(PROC_VMM_START + (last_pid * KSTACKSZ));
-	uint32_t phys_addr = (uint32_t)pmm_alloc_first();
-	if(phys_addr == 0)	{
+	uint32_t frames[KSTACKSZ / KB4];
+	if(pmm_alloc_batch(frames, KSTACKSZ / KB4) != KSTACKSZ / KB4)	{
 		PANIC("Unable to allocate physical frame");
 	}
-	if(vmm_map_page(phys_addr, virt_addr, X86_PAGE_WRITABLE))	{
+	if(vmm_map_frames(frames, virt_addr, KSTACKSZ / KB4,
+		X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) != KSTACKSZ / KB4)	{
 		PANIC("Unable to map address");
 	}
+	pmm_owner_add(PMM_OWNER_KSTACK, KSTACKSZ / KB4);
 	p->kstack = (uint8_t*)virt_addr;
 
 
@@ -140,11 +144,11 @@ int real_fork(uint32_t ret_stack)	{
 	new_proc->regs->ebp = ebp;
 
 
-	// Create an address space for this process
-	uint32_t virt_addr = (uint32_t)(0x10000000 + (last_pid * 4096));
-	uint32_t phys_addr = vmm_create_address_space(virt_addr);
+	// Create an address space for this process, user memory is copy-on-write
+	uint32_t phys_addr = (uint32_t)vmm_clone_address_space();
 
 	new_proc->dirtable = (uint32_t*)phys_addr;
+	vma_copy(new_proc->mm, proc_current->mm);
 	
 	uint32_t pid = new_proc->pid;
 
@@ -178,6 +182,7 @@ uint32_t switch_task(Registers* regs)	{
 	change_tss(proc_current);
 	
 	vmm_switch_pdir(proc_current->dirtable);
+	vma_user = proc_current->mm;
 	
 	proc_current->state = PROC_RUNNING;
 	
@@ -202,8 +207,7 @@ void process_start_usermode()	{
 	p->regs->cs = 0x18 | 0x03;
 
 	// Set as the current page directoty
-	uint32_t virt_addr = (uint32_t)(0x10000000 + (last_pid * 4096));
-	uint32_t phys_addr = vmm_create_address_space(virt_addr);
+	uint32_t phys_addr = (uint32_t)vmm_create_address_space();
 	p->dirtable = (uint32_t*)phys_addr;
 
 	// Should point to itself
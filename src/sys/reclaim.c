@@ -0,0 +1,115 @@
+/**
+* \ingroup paging
+* \file reclaim.c
+* CLOCK page reclaim, see reclaim.h.
+*/
+
+#include "sys/kernel.h"
+#include "sys/reclaim.h"
+#include "sys/vma.h"
+#include "sys/vmm.h"
+#include "sys/pmm.h"
+#include "sys/tlb.h"
+#include "sys/lock.h"
+#include "sys/zswap.h"
+
+
+/**
+* Only one CPU moves the hand, the others do not wait for it. Initialized here
+* since the first page faults can come before any init function is called.
+*/
+static spinlock reclaim_lock = {LOCK_RECLAIM, 0, 0, NULL};
+
+/** The next page the CLOCK hand looks at, the kernel areas come first. */
+static uint32_t reclaim_hand = 0;
+
+/** A page vmm_reclaim_page took. */
+typedef struct	{
+	paddr_t frame;
+	uint32_t virt;
+
+	/** The data must be kept, it is stored in slot. */
+	bool dirty;
+	uint32_t slot;
+} reclaim_entry;
+
+
+
+//------------------- Public API function implementations ------------------
+
+uint32_t reclaim_pages(uint32_t n, memory_desc* user)	{
+	uint32_t freed = 0, scanned = 0, wraps = 0, nfree, i, before;
+	reclaim_entry taken[TLB_BATCH_SZ];
+	bool dirty = false;
+	tlb_batch tlb;
+	if(!spinlock_try(&reclaim_lock))	return 0;
+	tlb_batch_init(&tlb);
+
+	if(user == NULL && reclaim_hand >= USERMODE_START)	reclaim_hand = 0;
+
+	// Stop when the hand has gone around twice without finding anything, the
+	// first time can have cleared all the accessed bits
+	while(freed < n && scanned < RECLAIM_MAX_SCAN && wraps < 3)	{
+		memory_desc* mm = (reclaim_hand < USERMODE_START) ? &vma_kernel : user;
+		spinlock_acquire(&mm->lock);
+
+		vm_area* a = vma_find_next(mm, reclaim_hand);
+		while(a != NULL && a->type != VMA_DEMAND_ZERO)	a = vma_find_next(mm, a->vm_end);
+		if(a == NULL)	{
+			// Continue with the user part or start over
+			spinlock_release(&mm->lock);
+			reclaim_hand = (mm == &vma_kernel && user != NULL) ? USERMODE_START : 0;
+			if(reclaim_hand == 0)	wraps++;
+			continue;
+		}
+
+		// The area can not be removed while the lock is held, so the frames are
+		// collected and freed after the lock is released
+		pmm_owner owner = a->owner;
+		if(reclaim_hand < a->vm_start)	reclaim_hand = a->vm_start;
+		for(nfree = 0; nfree < TLB_BATCH_SZ && reclaim_hand < a->vm_end &&
+			scanned < RECLAIM_MAX_SCAN; scanned++)	{
+			paddr_t frame = vmm_reclaim_page(reclaim_hand, &tlb, &dirty);
+			if(frame != 0)	taken[nfree++] = (reclaim_entry){frame, reclaim_hand, dirty, 0};
+			reclaim_hand += KB4;
+		}
+		spinlock_release(&mm->lock);
+
+		// Other CPUs can use the frames until they have flushed
+		tlb_batch_flush(&tlb);
+		for(i = 0, dirty = false; i < nfree; i++)	{
+			if(taken[i].dirty)	{
+				// If the page is faulted in while it is compressed, the slot is
+				// thrown away in vmm_swap_finish
+				void* page = vmm_kmap(taken[i].frame);
+				taken[i].slot = zswap_store(page);
+				vmm_kunmap(page);
+				dirty = true;
+			}
+		}
+
+		if(dirty)	{
+			spinlock_acquire(&mm->lock);
+			for(i = 0; i < nfree; i++)	{
+				if(taken[i].dirty && !vmm_swap_finish(taken[i].virt, taken[i].frame,
+					taken[i].slot))
+					taken[i].frame = 0;
+			}
+			spinlock_release(&mm->lock);
+		}
+
+		for(i = 0, before = freed; i < nfree; i++)	{
+			if(taken[i].frame == 0)	continue;
+			pmm_free_phys(taken[i].frame);
+			pmm_owner_add(owner, -1);
+			freed++;
+		}
+		if(freed != before)	wraps = 0;
+	}
+
+	spinlock_release(&reclaim_lock);
+
+	// Arena pages that were emptied when pages were brought back
+	zswap_shrink();
+	return freed;
+}
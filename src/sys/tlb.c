@@ -0,0 +1,168 @@
+/**
+* \ingroup paging
+* \file tlb.c
+* TLB shootdown, see tlb.h.
+*/
+
+#include "sys/kernel.h"
+#include "sys/tlb.h"
+#include "sys/vmm.h"
+#include "sys/lock.h"
+#include "hal/hal.h"
+#include "hal/isr.h"
+
+
+extern cpu_info cpus[];
+extern int num_cpus;
+
+
+/** Only one CPU can send a shootdown at a time. */
+static spinlock tlb_lock;
+
+/** The batch that is being sent, only read while our bit in tlb_pending is set. */
+static tlb_batch* volatile tlb_request = NULL;
+
+/** CPUs that have not flushed tlb_request yet, bit i is cpus[i]. */
+static volatile uint32_t tlb_pending = 0;
+
+
+
+//--------------- Internal function definitions ---------------------------
+
+/** Flush the pages in b on this CPU. */
+static void tlb_flush_local(tlb_batch* b);
+
+/** Flush tlb_request if this CPU has not done it yet. */
+static void tlb_service();
+
+static uint32_t tlb_handle_ipi(Registers* regs);
+
+
+
+
+//------------------- Public API function implementations ------------------
+
+void tlb_init()	{
+	init_spinlock(&tlb_lock, LOCK_TLB);
+	register_interrupt_handler(IRQ_TLB, tlb_handle_ipi);
+}
+
+
+void tlb_batch_init(tlb_batch* b)	{
+	b->count = 0;
+	b->all = false;
+	b->kernel = false;
+}
+
+
+void tlb_batch_add(tlb_batch* b, uint32_t virt)	{
+	if(virt < USERMODE_START)	b->kernel = true;
+	if(b->all)	return;
+
+	if(b->count >= TLB_BATCH_SZ)	b->all = true;
+	else	b->addrs[b->count++] = virt & ~(KB4 - 1);
+}
+
+
+void tlb_batch_add_all(tlb_batch* b)	{
+	b->all = true;
+}
+
+
+void tlb_batch_flush(tlb_batch* b)	{
+	uint32_t targets = 0, sent = 0;
+	int i, me;
+	if(b->count == 0 && !b->all)	return;
+
+	pushcli();
+	me = lapic_cpuid();
+	tlb_flush_local(b);
+
+	// CPUs that have not started have nothing cached
+	for(i = 0; i < num_cpus; i++)	{
+		if(i == me || cpus[i].started == 0)	continue;
+		if(b->kernel || cpus[i].pdir == cpus[me].pdir)	{
+			targets |= (1 << i);
+			sent++;
+		}
+	}
+
+	if(targets != 0)	{
+		// Interrupts are disabled while we wait, so requests from others must be
+		// answered here or we could wait for each other
+		while(!spinlock_try(&tlb_lock))	tlb_service();
+
+		tlb_request = b;
+		tlb_pending = targets;
+		if(sent == (uint32_t)num_cpus - 1)	{
+			lapic_send_ipi_others(IRQ_TLB);
+		}
+		else	{
+			for(i = 0; i < num_cpus; i++)	{
+				if(targets & (1 << i))	lapic_send_ipi(cpus[i].id, IRQ_TLB);
+			}
+		}
+
+		while(tlb_pending != 0);
+		tlb_request = NULL;
+		spinlock_release(&tlb_lock);
+	}
+
+	popcli();
+	tlb_batch_init(b);
+}
+
+
+void tlb_shootdown(uint32_t virt)	{
+	tlb_batch b;
+	tlb_batch_init(&b);
+	tlb_batch_add(&b, virt);
+	tlb_batch_flush(&b);
+}
+
+
+void tlb_poll()	{
+	// tlb_request is valid while our bit is set
+	if((tlb_pending & (1 << lapic_cpuid())) && !tlb_request->kernel)	tlb_service();
+}
+
+
+
+
+//------------------- Internal function implementation ------------------------
+
+static void tlb_flush_local(tlb_batch* b)	{
+	uint32_t i;
+	if(b->all)	{
+		// Global pages are only flushed when CR4.PGE is changed
+		uint32_t cr4 = get_cr4();
+		if(b->kernel && (cr4 & X86_CR4_PGE))	{
+			set_cr4(cr4 & ~X86_CR4_PGE);
+			set_cr4(cr4);
+		}
+		else	{
+			load_page_dir_addr(get_page_dir_addr());
+		}
+		return;
+	}
+	for(i = 0; i < b->count; i++)	flush_tlb_entry(b->addrs[i]);
+}
+
+
+static void tlb_service()	{
+	int me = lapic_cpuid();
+	if(!(tlb_pending & (1 << me)))	return;
+
+	// A kernel directory entry can have been removed
+	if(tlb_request->kernel)	vmm_sync_kernel();
+	tlb_flush_local(tlb_request);
+	atomic_btr(&tlb_pending, me);
+}
+
+
+static uint32_t tlb_handle_ipi(Registers* regs)	{
+	(void)regs;
+	tlb_service();
+	lapic_send_eoi();
+	return 0;
+}
@@ -0,0 +1,483 @@
+/**
+* \ingroup paging
+* \file vma.c
+* Virtual memory areas and demand-zero paging, see vma.h.
+*/
+
+#include "sys/kernel.h"
+#include "sys/vma.h"
+#include "sys/vmm.h"
+#include "sys/pmm.h"
+#include "sys/heap.h"
+#include "sys/lock.h"
+#include "sys/reclaim.h"
+
+#include "lib/stdio.h"
+
+
+memory_desc vma_kernel = {NULL, NULL, {LOCK_VMA, 0, 0, NULL}};
+
+memory_desc* vma_user = NULL;
+
+
+
+//--------------- Internal function definitions ---------------------------
+
+/**
+* Find the area addr is in.
+* \remark mm->lock must be held.
+*/
+static vm_area* vma_find_locked(memory_desc* mm, uint32_t addr);
+
+/** Add area to the subtree, it must not overlap any area in it. */
+static vm_area* vma_tree_insert(vm_area* node, vm_area* area);
+
+/**
+* Remove the area that starts at start from the subtree.
+* \param[out] removed The area or NULL if no area starts at start.
+* \return Returns the new root of the subtree.
+*/
+static vm_area* vma_tree_remove(vm_area* node, uint32_t start, vm_area** removed);
+
+/** Copy the subtree, the copy has the same shape. */
+static vm_area* vma_tree_copy(vm_area* node);
+
+static inline int32_t vma_height(vm_area* node)	{
+	return (node == NULL) ? 0 : node->height;
+}
+
+/** Which set of areas addr belongs to. */
+static inline memory_desc* vma_desc(uint32_t addr)	{
+	return (addr < USERMODE_START) ? &vma_kernel : vma_user;
+}
+
+
+
+
+//------------------- Public API function implementations ------------------
+
+void vma_init(memory_desc* mm)	{
+	mm->mem_regions = NULL;
+	mm->cache = NULL;
+	init_spinlock(&mm->lock, LOCK_VMA);
+}
+
+
+int vma_insert(memory_desc* mm, vm_area* area)	{
+	if(area->vm_start >= area->vm_end || (area->vm_start % KB4) != 0 ||
+		(area->vm_end % KB4) != 0)
+		return VMA_ERR_INVALID;
+
+	spinlock_acquire(&mm->lock);
+
+	// The areas before and after the new one are both on the path down to
+	// where it is added, so they are the only ones that can overlap
+	vm_area* it = mm->mem_regions;
+	while(it != NULL)	{
+		if(it->vm_start < area->vm_end && area->vm_start < it->vm_end)	{
+			spinlock_release(&mm->lock);
+			return VMA_ERR_OVERLAP;
+		}
+		it = (area->vm_start < it->vm_start) ? it->left : it->right;
+	}
+
+	mm->mem_regions = vma_tree_insert(mm->mem_regions, area);
+	spinlock_release(&mm->lock);
+	return VMA_SUCCESS;
+}
+
+
+vm_area* vma_remove(memory_desc* mm, uint32_t start)	{
+	vm_area* ret = NULL;
+	spinlock_acquire(&mm->lock);
+
+	mm->mem_regions = vma_tree_remove(mm->mem_regions, start, &ret);
+	if(ret != NULL && mm->cache == ret)	mm->cache = NULL;
+
+	spinlock_release(&mm->lock);
+	return ret;
+}
+
+
+vm_area* vma_find(memory_desc* mm, uint32_t addr)	{
+	spinlock_acquire(&mm->lock);
+	vm_area* ret = vma_find_locked(mm, addr);
+	spinlock_release(&mm->lock);
+	return ret;
+}
+
+
+vm_area* vma_find_next(memory_desc* mm, uint32_t addr)	{
+	vm_area* it = mm->mem_regions, * ret = NULL;
+	while(it != NULL)	{
+		if(addr < it->vm_end)	{
+			ret = it;
+			it = it->left;
+		}
+		else	{
+			it = it->right;
+		}
+	}
+	return ret;
+}
+
+
+int vma_copy(memory_desc* to, memory_desc* from)	{
+	// The heap must not be used with the lock held
+	spinlock_acquire(&from->lock);
+	vm_area* root = from->mem_regions;
+	spinlock_release(&from->lock);
+
+	// Areas are only added to the current address space, which is the one that
+	// is copied, so the tree can not change
+	to->mem_regions = vma_tree_copy(root);
+	return VMA_SUCCESS;
+}
+
+
+bool vma_handle_fault(uint32_t addr, bool write)	{
+	memory_desc* mm = vma_desc(addr);
+	bool ret = false;
+	if(mm == NULL)	return false;
+
+	// The other CPUs must be able to answer the TLB shootdown, so reclaim is
+	// only done when the fault did not happen with a lock held
+	bool can_reclaim = (pushcli_depth() == 0);
+	if(can_reclaim && reclaim_needed())	reclaim_pages(RECLAIM_BATCH, vma_user);
+
+	bool no_memory = false;
+	spinlock_acquire(&mm->lock);
+	vm_area* a = vma_find_locked(mm, addr);
+	int res = (a != NULL && a->type == VMA_DEMAND_ZERO) ?
+		vmm_swap_in(addr & ~(KB4 - 1), a->acl) : VMM_ERR_NOT_SWAPPED;
+
+	// A page that was compressed by reclaim_pages gets its data back
+	if(res != VMM_ERR_NOT_SWAPPED)	{
+		ret = (res == VMM_SUCCESS);
+		no_memory = (res == VMM_ERR_NO_MEMORY);
+	}
+	// Pages that are only read never need a frame. The kernel areas are written
+	// right after they are touched, so they get a frame at once.
+	else if(a != NULL && a->type == VMA_DEMAND_ZERO && !write && addr >= USERMODE_START)	{
+		res = vmm_map_zero_page(addr & ~(KB4 - 1), a->acl);
+		ret = (res == VMM_SUCCESS || res == VMM_ERR_PAGE_IN_USE);
+	}
+	else if(a != NULL && a->type == VMA_DEMAND_ZERO)	{
+		void* frame = pmm_alloc_zeroed();
+		res = (frame == NULL) ? VMM_ERR_NO_MEMORY :
+			vmm_map_page((uint32_t)frame, addr & ~(KB4 - 1), a->acl);
+		if(res == VMM_SUCCESS)	{
+			pmm_owner_add(a->owner, 1);
+			ret = true;
+		}
+		else if(frame == NULL)	{
+			no_memory = true;
+		}
+		else	{
+			// Another CPU got here first, the access can be tried again
+			pmm_free(frame);
+			ret = (res == VMM_ERR_PAGE_IN_USE);
+		}
+	}
+	spinlock_release(&mm->lock);
+
+	if(no_memory)	{
+		if(!can_reclaim || reclaim_pages(RECLAIM_BATCH, vma_user) == 0)
+			PANIC("No memory for demand-zero page");
+
+		// The access faults again and gets one of the frames
+		ret = true;
+	}
+	return ret;
+}
+
+
+
+
+//------------------- Internal function implementation ------------------------
+
+static vm_area* vma_find_locked(memory_desc* mm, uint32_t addr)	{
+	vm_area* it = mm->cache;
+	if(it != NULL && it->vm_start <= addr && addr < it->vm_end)	return it;
+
+	for(it = mm->mem_regions; it != NULL; )	{
+		if(addr < it->vm_start)		it = it->left;
+		else if(addr >= it->vm_end)	it = it->right;
+		else	{
+			mm->cache = it;
+			return it;
+		}
+	}
+	return NULL;
+}
+
+/** Set the height of node from the height of the children. */
+static inline void vma_update(vm_area* node)	{
+	int32_t l = vma_height(node->left), r = vma_height(node->right);
+	node->height = ((l > r) ? l : r) + 1;
+}
+
+static vm_area* vma_rotate_right(vm_area* node)	{
+	vm_area* l = node->left;
+	node->left = l->right;
+	l->right = node;
+	vma_update(node);
+	vma_update(l);
+	return l;
+}
+
+static vm_area* vma_rotate_left(vm_area* node)	{
+	vm_area* r = node->right;
+	node->right = r->left;
+	r->left = node;
+	vma_update(node);
+	vma_update(r);
+	return r;
+}
+
+/**
+* Rotate if the heights of the subtrees of node differ by more than one.
+* \return Returns the new root of the subtree.
+*/
+static vm_area* vma_balance(vm_area* node)	{
+	int32_t diff = vma_height(node->left) - vma_height(node->right);
+	vma_update(node);
+
+	if(diff > 1)	{
+		if(vma_height(node->left->left) < vma_height(node->left->right))
+			node->left = vma_rotate_left(node->left);
+		return vma_rotate_right(node);
+	}
+	if(diff < -1)	{
+		if(vma_height(node->right->right) < vma_height(node->right->left))
+			node->right = vma_rotate_right(node->right);
+		return vma_rotate_left(node);
+	}
+	return node;
+}
+
+static vm_area* vma_tree_insert(vm_area* node, vm_area* area)	{
+	if(node == NULL)	{
+		area->left = area->right = NULL;
+		area->height = 1;
+		return area;
+	}
+
+	if(area->vm_start < node->vm_start)	node->left = vma_tree_insert(node->left, area);
+	else	node->right = vma_tree_insert(node->right, area);
+	return vma_balance(node);
+}
+
+/**
+* Remove the area with the lowest address from the subtree.
+* \param[out] min The area that was removed.
+* \return Returns the new root of the subtree.
+*/
+static vm_area* vma_tree_remove_min(vm_area* node, vm_area** min)	{
+	if(node->left == NULL)	{
+		*min = node;
+		return node->right;
+	}
+	node->left = vma_tree_remove_min(node->left, min);
+	return vma_balance(node);
+}
+
+static vm_area* vma_tree_remove(vm_area* node, uint32_t start, vm_area** removed)	{
+	if(node == NULL)	return NULL;
+
+	if(start < node->vm_start)	{
+		node->left = vma_tree_remove(node->left, start, removed);
+	}
+	else if(start > node->vm_start)	{
+		node->right = vma_tree_remove(node->right, start, removed);
+	}
+	else	{
+		*removed = node;
+		if(node->left == NULL || node->right == NULL)	{
+			vm_area* child = (node->left != NULL) ? node->left : node->right;
+			node->left = node->right = NULL;
+			return child;
+		}
+
+		// The next area takes its place
+		vm_area* next;
+		vm_area* right = vma_tree_remove_min(node->right, &next);
+		next->left = node->left;
+		next->right = right;
+		node->left = node->right = NULL;
+		node = next;
+	}
+	return vma_balance(node);
+}
+
+static vm_area* vma_tree_copy(vm_area* node)	{
+	if(node == NULL)	return NULL;
+
+	vm_area* a = (vm_area*)heap_malloc(sizeof(vm_area));
+	*a = *node;
+	a->left = vma_tree_copy(node->left);
+	a->right = vma_tree_copy(node->right);
+	return a;
+}
+
+
+
+
+//------------- Test-code -------------------------
+
+#ifdef TEST_KERNEL
+
+/** Free address for the demand-zero test, after all kernel regions. */
+#define VMA_TEST_ADDR FRAME_REFS_END
+
+int vma_test_insert()	{
+	memory_desc mm;
+	vm_area a = {VMA_MAPPED, KB4 * 4, KB4 * 8, 0, PMM_OWNERS, NULL, NULL, 0},
+		b = {VMA_MAPPED, KB4 * 8, KB4 * 9, 0, PMM_OWNERS, NULL, NULL, 0},
+		c = {VMA_MAPPED, KB4 * 1, KB4 * 5, 0, PMM_OWNERS, NULL, NULL, 0},
+		d = {VMA_MAPPED, KB4 * 2, KB4 * 2, 0, PMM_OWNERS, NULL, NULL, 0};
+	vma_init(&mm);
+
+	if(vma_insert(&mm, &a) != VMA_SUCCESS)	return 1;
+	if(vma_insert(&mm, &b) != VMA_SUCCESS)	return 2;
+	if(vma_insert(&mm, &c) != VMA_ERR_OVERLAP)	return 3;
+	if(vma_insert(&mm, &d) != VMA_ERR_INVALID)	return 4;
+
+	// Sorted and the end is not part of the area
+	if(mm.mem_regions != &a || a.right != &b || a.left != NULL)	return 5;
+	if(vma_find(&mm, KB4 * 4) != &a || vma_find(&mm, (KB4 * 8) - 1) != &a)
+		return 6;
+	if(vma_find(&mm, KB4 * 8) != &b || vma_find(&mm, KB4 * 9) != NULL)	return 7;
+	if(vma_find(&mm, 0) != NULL)	return 8;
+
+	if(vma_remove(&mm, KB4 * 5) != NULL)	return 9;
+	if(vma_remove(&mm, KB4 * 4) != &a || mm.mem_regions != &b)	return 10;
+	if(vma_insert(&mm, &c) != VMA_SUCCESS || b.left != &c)	return 11;
+
+	// The removed area is not found through the cache
+	if(vma_find(&mm, KB4 * 8) != &b || mm.cache != &b)	return 12;
+	if(vma_remove(&mm, KB4 * 8) != &b || vma_find(&mm, KB4 * 8) != NULL)	return 13;
+	return 0;
+}
+
+/** Number of areas in vma_test_balance. */
+#define VMA_TEST_AREAS 200
+
+/**
+* Check that the subtree is sorted and balanced.
+* \return Returns the height or -1 if it is wrong.
+*/
+static int32_t vma_test_check(vm_area* node, uint32_t low, uint32_t high)	{
+	if(node == NULL)	return 0;
+	if(node->vm_start < low || node->vm_end > high)	return -1;
+
+	int32_t l = vma_test_check(node->left, low, node->vm_start),
+		r = vma_test_check(node->right, node->vm_end, high);
+	if(l < 0 || r < 0 || l - r > 1 || r - l > 1)	return -1;
+	if(node->height != ((l > r) ? l : r) + 1)	return -1;
+	return node->height;
+}
+
+int vma_test_balance()	{
+	memory_desc mm;
+	vm_area* areas = (vm_area*)heap_malloc(sizeof(vm_area) * VMA_TEST_AREAS);
+	int ret = 0, i;
+	vma_init(&mm);
+
+	// In order, the worst case for a list and for a tree that is not balanced
+	for(i = 0; i < VMA_TEST_AREAS; i++)	{
+		vm_area a = {VMA_MAPPED, KB4 * 2 * i, KB4 * ((2 * i) + 1), 0, PMM_OWNERS,
+			NULL, NULL, 0};
+		areas[i] = a;
+		if(vma_insert(&mm, &areas[i]) != VMA_SUCCESS)	ret = 1;
+	}
+
+	// An AVL tree with 200 nodes is at most 10 high
+	int32_t h = vma_test_check(mm.mem_regions, 0, 0xFFFFFFFF);
+	if(ret == 0 && (h < 0 || h > 10))	ret = 2;
+
+	for(i = 0; ret == 0 && i < VMA_TEST_AREAS; i++)	{
+		if(vma_find(&mm, (KB4 * 2 * i) + 10) != &areas[i] ||
+			vma_find(&mm, KB4 * ((2 * i) + 1)) != NULL)
+			ret = 3;
+	}
+
+	// Every other area, the tree must stay balanced
+	for(i = 0; ret == 0 && i < VMA_TEST_AREAS; i += 2)	{
+		if(vma_remove(&mm, KB4 * 2 * i) != &areas[i])	ret = 4;
+	}
+	if(ret == 0 && vma_test_check(mm.mem_regions, 0, 0xFFFFFFFF) < 0)	ret = 5;
+	for(i = 0; ret == 0 && i < VMA_TEST_AREAS; i++)	{
+		if(vma_find(&mm, KB4 * 2 * i) != ((i % 2) ? &areas[i] : NULL))	ret = 6;
+	}
+
+	heap_free(areas);
+	return ret;
+}
+
+int vma_test_copy()	{
+	memory_desc from, to;
+	vm_area a = {VMA_DEMAND_ZERO, KB4, KB4 * 2, 0, PMM_OWNERS, NULL, NULL, 0},
+		b = {VMA_MAPPED, KB4 * 2, KB4 * 3, 0, PMM_OWNERS, NULL, NULL, 0};
+	vma_init(&from);
+	vma_init(&to);
+	vma_insert(&from, &b);
+	vma_insert(&from, &a);
+
+	vma_copy(&to, &from);
+	vm_area* x = vma_find(&to, KB4);
+	if(x == NULL || x == &a || x->vm_start != KB4 || x->type != VMA_DEMAND_ZERO)
+		return 1;
+	x = vma_find(&to, KB4 * 2);
+	if(x == NULL || x == &b || x->vm_end != KB4 * 3 || to.mem_regions->height != 2)
+		return 2;
+
+	heap_free(vma_remove(&to, KB4 * 2));
+	heap_free(vma_remove(&to, KB4));
+	return (to.mem_regions == NULL) ? 0 : 3;
+}
+
+int vma_test_fault()	{
+	vm_area a = {VMA_DEMAND_ZERO, VMA_TEST_ADDR, VMA_TEST_ADDR + KB4,
+		X86_PAGE_WRITABLE, PMM_OWNERS, NULL, NULL, 0};
+	uint32_t before = pmm_free_blocks(), i;
+	uint8_t* p = (uint8_t*)VMA_TEST_ADDR;
+	int ret = 0;
+
+	if(vma_insert(&vma_kernel, &a) != VMA_SUCCESS)	return 1;
+	if(vma_handle_fault(VMA_TEST_ADDR + KB4, true) ||
+		vma_handle_fault(VMA_TEST_ADDR - 1, true))
+		ret = 2;
+	if(ret == 0 && !vma_handle_fault(VMA_TEST_ADDR + 10, false))	ret = 3;
+
+	// The new page is zeroed and writable
+	for(i = 0; ret == 0 && i < KB4; i++)	{
+		if(p[i] != 0)	ret = 4;
+		p[i] = 0xAB;
+	}
+
+	// A second fault on the same page finds it mapped
+	if(ret == 0 && !vma_handle_fault(VMA_TEST_ADDR, true))	ret = 5;
+	if(ret == 0 && p[100] != 0xAB)	ret = 6;
+
+	void* frame = (void*)(uint32_t)vmm_virt_to_phys(VMA_TEST_ADDR);
+	vmm_unmap_page(VMA_TEST_ADDR);
+	pmm_free(frame);
+	vma_remove(&vma_kernel, VMA_TEST_ADDR);
+
+	if(ret == 0 && pmm_free_blocks() + PMM_CPU_CACHE_SZ < before)	ret = 7;
+	return ret;
+}
+
+bool vma_run_all_tests()	{
+	unit_test tests[5] = {
+		vma_test_insert,
+		vma_test_balance,
+		vma_test_copy,
+		vma_test_fault,
+		NULL
+	};
+	return kernel_generic_unit_test(tests, "vma_run_all_tests()");
+}
+
+#endif
@@ -4,13 +4,20 @@
 
 #include "sys/kernel.h"
 #include "sys/vmm.h"
+#include "sys/vma.h"
 #include "sys/pmm.h"
+#include "sys/lock.h"
+#include "sys/tlb.h"
+#include "sys/zswap.h"
 
 #include "hal/hal.h"
 
 
+extern cpu_info cpus[];
+
 /**
-* Address of the kernel directory (physical).
+* Address of the kernel directory (physical). With PAE this is the page
+* directory pointer table, which is what is loaded in CR3.
 */
 uint32_t* kernel_dir = NULL;
 
@@ -20,9 +27,81 @@ uint32_t* kernel_dir = NULL;
 uint32_t* current_dir = NULL;
 
 /**
-* Virtual address to the directory which is currently in use.
+* Virtual address to all the directory entries which are currently in use.
+*/
+vmm_entry* dir_virtual = (vmm_entry*)PAGE_DIR_VIRT;
+
+/**
+* Virtual address to all the page tables which are currently in use, the table
+* for directory entry i starts at index i * VMM_TABLE_ENTRIES.
+*/
+vmm_entry* ptables_virtual = (vmm_entry*)PAGE_TABLES_VIRT;
+
+/**
+* If large pages are used, without PAE they must also be enabled in CR4 (PSE).
+*/
+bool vmm_use_large = false;
+
+/**
+* If execute-disable is enabled in EFER, only possible with PAE.
+*/
+bool vmm_use_nx = false;
+
+/**
+* If the kernel pages are global, they are then kept in the TLB when CR3 is
+* loaded. Enabled with CR4.PGE.
+*/
+bool vmm_use_global = false;
+
+/**
+* If the PAT is programmed with VMM_PAT, VMM_CACHE_WC is then write-combining.
+*/
+bool vmm_use_pat = false;
+
+paddr_t vmm_zero_frame = 0;
+
+/**
+* The PAT for VMM_CACHE_*, WB, WT, UC- and UC as after reset and then WC. The
+* rest is not used.
+*/
+#define VMM_PAT 0x0007040100070406ULL
+
+/**
+* Held while a page or page table that is shared after fork is given to one
+* address space, so that two address spaces do not both think they have the
+* last reference.
+*/
+spinlock vmm_cow_lock;
+
+/** Number of directory entries for the kernel part of memory. */
+#define VMM_KERNEL_PDES (USERMODE_START / VMM_LARGE_PAGE_SZ)
+
+/** The directory entry that holds the generation, see vmm_sync_kernel. */
+#define VMM_GEN_PDE (PDIR_GEN_ADDR / VMM_LARGE_PAGE_SZ)
+
+/**
+* The kernel directory entries, the page tables they point to are shared by
+* all address spaces. An entry is only changed here and in the current address
+* space, the others get it in vmm_sync_kernel.
+*/
+static vmm_entry vmm_kernel_pdes[VMM_KERNEL_PDES];
+
+/** Changed each time an entry in vmm_kernel_pdes is changed. */
+static volatile uint32_t vmm_kernel_gen = 0;
+
+/** Protects vmm_kernel_pdes and vmm_kernel_gen. */
+spinlock vmm_kernel_lock;
+
+/** The directory entry that points to the counts, see vmm_count_add. */
+#define VMM_COUNT_PDE (PTABLE_COUNT_ADDR / VMM_LARGE_PAGE_SZ)
+
+/**
+* Number of present entries in each user page table of the current address
+* space, indexed by directory entry. Each address space has its own page with
+* the counts, it is the page table for VMM_COUNT_PDE.
 */
-uint32_t* dir_virtual = (uint32_t*)0xFFFFF000;
+static volatile uint16_t* vmm_counts =
+	(volatile uint16_t*)(PAGE_TABLES_VIRT + (VMM_COUNT_PDE * KB4));
 
 
 uint32_t vmm_handle_page_fault(Registers* regs);
@@ -35,194 +114,1044 @@ uint32_t vmm_return_kernel_dir()	{
 
 
 
+/** Get a zeroed page for a page directory or page table. */
 static inline uint32_t* vmm_get_physical_page()	{
-	uint32_t* ret = (uint32_t*)pmm_alloc_first();
-	memset(ret, 0x00, KB4);
-	return ret;
+	pmm_owner_add(PMM_OWNER_PTABLE, 1);
+	return (uint32_t*)pmm_alloc_zeroed();
 }
 
+/** diri is the directory entry and pagei the index in ptables_virtual. */
 #define ADDR2INDEX(addr,diri,pagei)\
 	addr &= ~(0xFFF);\
-	diri = addr / MB4;\
-	pagei = (addr % MB4) / KB4
+	diri = addr / VMM_LARGE_PAGE_SZ;\
+	pagei = addr / KB4
+
+/**
+* Write an entry that the CPU can be using. With PAE the entry is written in two
+* halves, the half with the present bit is written last when the entry is set
+* and first when it is cleared, so the CPU never uses half an entry.
+*/
+static inline void vmm_set_entry(vmm_entry* entry, vmm_entry val)	{
+#if PAE_ENABLE
+	volatile uint32_t* half = (volatile uint32_t*)entry;
+	if(val & X86_PAGE_PRESENT)	{
+		half[0] = 0;
+		half[1] = (uint32_t)(val >> 32);
+		half[0] = (uint32_t)val;
+	}
+	else	{
+		half[0] = (uint32_t)val;
+		half[1] = (uint32_t)(val >> 32);
+	}
+#else
+	*(volatile vmm_entry*)entry = val;
+#endif
+}
+
+/** Turn acl from the caller into the bits in a page table entry. */
+static inline vmm_entry vmm_acl_bits(uint32_t acl)	{
+	vmm_entry ret = acl & ~X86_PAGE_NOEXEC;
+#if PAE_ENABLE
+	if((acl & X86_PAGE_NOEXEC) && vmm_use_nx)	ret |= X86_PAGE_NX;
+#endif
+	// Uncached is as close as we get to write-combining
+	if((acl & X86_PAGE_PAT) && !vmm_use_pat)	{
+		ret = (ret & ~X86_PAGE_PAT) | X86_PAGE_CACHE_DIS;
+	}
+	return ret;
+}
+
+/** Same as vmm_acl_bits for a large page, the PAT bit is then bit 12. */
+static inline vmm_entry vmm_large_acl_bits(uint32_t acl)	{
+	vmm_entry ret = vmm_acl_bits(acl);
+	if(ret & X86_PAGE_PAT)	ret = (ret & ~X86_PAGE_PAT) | X86_PAGEDIR_LARGE_PAT;
+	return ret;
+}
+
+/**
+* Bits of a directory entry for a new page table. The access and memory type
+* are set on each page, so only the user bit is taken from acl. In a directory
+* entry X86_PAGE_PAT is X86_PAGEDIR_LARGE, and a read-only or X86_PAGE_CLONED
+* entry, as vmm_map_zero_page asks for, would make the whole table shared.
+*/
+static inline vmm_entry vmm_table_bits(uint32_t acl)	{
+	return X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE | (acl & X86_PAGE_USER);
+}
+
+/**
+* The global bit for a page at virt. The kernel part below KERNEL_MAX_VM is the
+* same in all address spaces, so it does not have to be flushed when CR3 is
+* loaded. The recursive mapping is different in each address space.
+*/
+static inline vmm_entry vmm_global_bit(uint32_t virt)	{
+	return (vmm_use_global && virt < KERNEL_MAX_VM) ? X86_PAGE_GLOBAL : 0;
+}
+
+/**
+* Add n to the number of present entries in the page table for diri. The
+* counts are stored times two, the CPU then never sees a present entry in the
+* page. The kernel tables are not counted since they are never freed.
+*/
+static inline void vmm_count_add(uint32_t diri, int32_t n)	{
+	if(diri >= VMM_KERNEL_PDES)	vmm_counts[diri] += (uint16_t)(n * 2);
+}
+
+/** Number of present entries in the user page table for diri. */
+static inline uint32_t vmm_count_get(uint32_t diri)	{
+	return vmm_counts[diri] >> 1;
+}
+
+/**
+* Check if an entry is used, also a page that is swapped out is counted since
+* the table must be kept for it.
+*/
+static inline bool vmm_pte_used(vmm_entry pte)	{
+	return (pte & (X86_PAGE_PRESENT | X86_PAGE_SWAPPED | X86_PAGE_SWAPPING)) != 0;
+}
+
+/** Enable execute-disable on this CPU, if it is used. */
+static inline void vmm_enable_nx()	{
+	if(vmm_use_nx)	write_msr(MSR_EFER, read_msr(MSR_EFER) | MSR_EFER_NXE);
+}
+
+/**
+* Load the PAT on this CPU, if it is used. All CPUs must have the same PAT,
+* nothing is mapped with the new type yet so the caches do not have to be
+* flushed.
+*/
+static inline void vmm_enable_pat()	{
+	if(vmm_use_pat)	write_msr(MSR_PAT, VMM_PAT);
+}
+
+/** Address of kmap slot i for CPU cpuid. */
+static inline uint32_t vmm_kmap_slot(int cpuid, uint32_t i)	{
+	return KMAP_START + ((((uint32_t)cpuid * KMAP_SLOTS) + i) * KB4);
+}
+
+void* vmm_kmap(paddr_t phys)	{
+	pushcli();
+	int id = lapic_cpuid();
+	if(cpus[id].kmap_used >= KMAP_SLOTS)	PANIC("No free kmap slot");
+
+	uint32_t virt = vmm_kmap_slot(id, cpus[id].kmap_used++);
+	vmm_set_entry(&ptables_virtual[virt / KB4], (phys & X86_PAGE_FRAME) |
+		X86_PAGE_PRESENT | vmm_acl_bits(X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) |
+		vmm_global_bit(virt));
+	flush_tlb_entry(virt);
+	return (void*)virt;
+}
+
+void vmm_kunmap(void* virt)	{
+	int id = lapic_cpuid();
+	if(cpus[id].kmap_used == 0 ||
+		(uint32_t)virt != vmm_kmap_slot(id, cpus[id].kmap_used - 1))
+		PANIC("kmap slots must be unmapped in reverse order");
+
+	vmm_set_entry(&ptables_virtual[(uint32_t)virt / KB4], 0);
+	flush_tlb_entry((uint32_t)virt);
+	cpus[id].kmap_used--;
+	popcli();
+}
+
+/**
+* Entry for a page that is shared after fork, writable pages become read-only
+* and X86_PAGE_CLONED. A page in the compressed swap gets one more reference to
+* its slot.
+* \param[in] ref If the page gets one more reference.
+*/
+static inline vmm_entry vmm_clone_pte(vmm_entry pte, bool ref)	{
+	if(!(pte & X86_PAGE_PRESENT))	{
+		if(ref && (pte & X86_PAGE_SWAPPED))	zswap_dup((uint32_t)pte >> 12);
+		return pte;
+	}
+
+	// The zero frame is never taken over, so it is not counted
+	if(ref && (pte & X86_PAGE_FRAME) != vmm_zero_frame)	pmm_ref_inc(pte & X86_PAGE_FRAME);
+	if(pte & X86_PAGE_WRITABLE)	pte = (pte & ~X86_PAGE_WRITABLE) | X86_PAGE_CLONED;
+	return pte;
+}
+
+/**
+* Directory entry i for a new address space. The kernel part is the same in all
+* address spaces, it is taken from vmm_kernel_pdes. With clone the user part is
+* shared with copy-on-write, each page table gets one more reference and is
+* read-only and X86_PAGE_CLONED in both address spaces. Large pages are shared
+* as they are.
+* \remark vmm_kernel_lock must be held.
+*/
+static vmm_entry vmm_new_pde(uint32_t i, bool clone)	{
+	vmm_entry pde = dir_virtual[i];
+	if(i == VMM_GEN_PDE)	return (vmm_entry)vmm_kernel_gen << 1;
+	if(i < VMM_KERNEL_PDES)	return vmm_kernel_pdes[i];
+	if(!clone || i == VMM_COUNT_PDE || i >= VMM_DIR_ENTRIES - VMM_DIRS ||
+		!(pde & X86_PAGEDIR_PRESENT))
+		return 0;
+	if(pde & X86_PAGEDIR_LARGE)	return pde;
+
+	if(pde & X86_PAGEDIR_WRITABLE)	{
+		pde = (pde & ~X86_PAGEDIR_WRITABLE) | X86_PAGE_CLONED;
+		vmm_set_entry(&dir_virtual[i], pde);
+	}
+	pmm_ref_inc(pde & X86_PAGEDIR_FRAME);
+	return pde;
+}
+
+/**
+* Give directory entry diri a page table of its own, the entry is
+* X86_PAGE_CLONED. If the table is still shared it is copied, otherwise it is
+* taken over. In both cases the writable pages in it become read-only and
+* X86_PAGE_CLONED, since they can still be shared.
+* \param[out] tlb Other CPUs can still walk the old table, they must flush it.
+* \remark vmm_cow_lock must be held.
+*/
+static void vmm_unshare_table(uint32_t diri, tlb_batch* tlb)	{
+	vmm_entry pde = dir_virtual[diri];
+	vmm_entry* old = &ptables_virtual[diri * VMM_TABLE_ENTRIES];
+	paddr_t frame = pde & X86_PAGEDIR_FRAME;
+	uint32_t i;
+
+	if(pmm_ref_count(frame) != 0)	{
+		// Every page in the copy is one more reference
+		uint32_t copy = (uint32_t)vmm_get_physical_page();
+		vmm_entry* table = (vmm_entry*)vmm_kmap(copy);
+		for(i = 0; i < VMM_TABLE_ENTRIES; i++)	{
+			table[i] = vmm_clone_pte(old[i], true);
+		}
+		vmm_kunmap(table);
+		pmm_ref_dec(frame);
+
+		vmm_set_entry(&dir_virtual[diri], copy | X86_PAGEDIR_WRITABLE |
+			(pde & ~(X86_PAGEDIR_FRAME | X86_PAGE_CLONED)));
+
+		// All pages in the table now come from another table
+		load_page_dir_addr(get_page_dir_addr());
+	}
+	else	{
+		// The table can only be changed when the entry is writable
+		vmm_set_entry(&dir_virtual[diri],
+			(pde & ~X86_PAGE_CLONED) | X86_PAGEDIR_WRITABLE);
+		flush_tlb_entry((uint32_t)old);
+		for(i = 0; i < VMM_TABLE_ENTRIES; i++)	{
+			old[i] = vmm_clone_pte(old[i], false);
+		}
+	}
+	tlb_batch_add_all(tlb);
+}
+
+/**
+* Give the page at addr a frame of its own, the page is X86_PAGE_CLONED. If the
+* frame is still shared it is copied, otherwise it is taken over.
+* \param[out] tlb Other CPUs can have the shared frame cached, they must flush it.
+* \remark vmm_cow_lock must be held.
+*/
+static void vmm_unshare_page(uint32_t addr, uint32_t pagei, tlb_batch* tlb)	{
+	vmm_entry pte = ptables_virtual[pagei];
+	paddr_t frame = pte & X86_PAGE_FRAME;
+
+	if(frame == vmm_zero_frame)	{
+		// Nothing to copy, first write to a page from vmm_map_zero_page
+		frame = pmm_alloc_phys();
+		if(frame == 0)	PANIC("No memory for zero page");
+		vmm_zero_page(frame);
+	}
+	else if(pmm_ref_count(frame) != 0)	{
+		paddr_t copy = pmm_alloc_phys();
+		if(copy == 0)	PANIC("No memory for copy-on-write");
+
+		void* dst = vmm_kmap(copy);
+		memcpy(dst, (void*)(addr & ~0xFFF), KB4);
+		vmm_kunmap(dst);
+		pmm_ref_dec(frame);
+		frame = copy;
+	}
+
+	vmm_set_entry(&ptables_virtual[pagei], frame | X86_PAGE_WRITABLE |
+		(pte & ~(X86_PAGE_FRAME | X86_PAGE_CLONED)));
+	flush_tlb_entry(addr);
+	tlb_batch_add(tlb, addr);
+}
+
+/**
+* Make sure the page table for directory entry diri is not shared, must be
+* done before the table is changed.
+* \remark The other CPUs are flushed here, the callers can hold locks since the
+* CPUs that wait for them answer in tlb_poll.
+*/
+static void vmm_own_table(uint32_t diri)	{
+	tlb_batch tlb;
+	if(!(dir_virtual[diri] & X86_PAGE_CLONED))	return;
+	tlb_batch_init(&tlb);
+
+	spinlock_acquire(&vmm_cow_lock);
+	if(dir_virtual[diri] & X86_PAGE_CLONED)	vmm_unshare_table(diri, &tlb);
+	spinlock_release(&vmm_cow_lock);
+	tlb_batch_flush(&tlb);
+}
+
+/**
+* Drop one reference to each frame, a frame that is not shared any more is
+* freed. Done with vmm_cow_lock, so that a frame is not taken over by
+* vmm_unshare_page at the same time.
+*/
+static void vmm_release_frames(paddr_t* frames, uint32_t n)	{
+	uint32_t i;
+	if(n == 0)	return;
+
+	spinlock_acquire(&vmm_cow_lock);
+	for(i = 0; i < n; i++)	{
+		if(pmm_ref_count(frames[i]) != 0)	pmm_ref_dec(frames[i]);
+		else	pmm_free_phys(frames[i]);
+	}
+	spinlock_release(&vmm_cow_lock);
+}
+
+/**
+* Change kernel directory entry diri in vmm_kernel_pdes and in the current
+* address space. The other address spaces get it in vmm_sync_kernel.
+* \remark vmm_kernel_lock must be held.
+*/
+static void vmm_set_kernel_pde(uint32_t diri, vmm_entry pde)	{
+	bool synced = ((dir_virtual[VMM_GEN_PDE] >> 1) == vmm_kernel_gen);
+	vmm_kernel_pdes[diri] = pde;
+	vmm_set_entry(&dir_virtual[diri], pde);
+	vmm_kernel_gen++;
+	if(synced)	vmm_set_entry(&dir_virtual[VMM_GEN_PDE], (vmm_entry)vmm_kernel_gen << 1);
+}
+
+/**
+* Set directory entry diri to a large page, for the kernel part it is also set
+* in vmm_kernel_pdes.
+* \return Returns false if the entry is present, in this or another address
+* space.
+*/
+static bool vmm_set_large_pde(uint32_t diri, vmm_entry pde)	{
+	bool ret = !(dir_virtual[diri] & X86_PAGEDIR_PRESENT);
+	if(diri >= VMM_KERNEL_PDES)	{
+		if(ret)	vmm_set_entry(&dir_virtual[diri], pde);
+		return ret;
+	}
+
+	spinlock_acquire(&vmm_kernel_lock);
+	ret = ret && !(vmm_kernel_pdes[diri] & X86_PAGEDIR_PRESENT);
+	if(ret)	vmm_set_kernel_pde(diri, pde);
+	spinlock_release(&vmm_kernel_lock);
+	return ret;
+}
+
+/**
+* Get a page table for directory entry diri that can be changed. If the entry
+* is not present a new table is created, a table that is shared after fork is
+* copied.
+* \param[in] acl Access bits for a new table.
+* \return Returns false if the entry is a large page.
+*/
+static bool vmm_get_table(uint32_t diri, uint32_t acl)	{
+	// The counts are not a page table
+	if(diri == VMM_COUNT_PDE)	return false;
+
+	if(dir_virtual[diri] & X86_PAGEDIR_PRESENT)	{
+		// Covered by a large page, there is no page table
+		if(dir_virtual[diri] & X86_PAGEDIR_LARGE)	return false;
+
+		// A table that is shared after fork must be copied before it is changed
+		vmm_own_table(diri);
+		return true;
+	}
+
+	// Another address space can already have created the kernel table
+	if(diri < VMM_KERNEL_PDES)	{
+		spinlock_acquire(&vmm_kernel_lock);
+		vmm_entry pde = vmm_kernel_pdes[diri];
+		if(!(pde & X86_PAGEDIR_PRESENT))	{
+			pde = (uint32_t)vmm_get_physical_page() | vmm_table_bits(acl);
+			vmm_set_kernel_pde(diri, pde);
+		}
+		else	{
+			vmm_set_entry(&dir_virtual[diri], pde);
+		}
+		spinlock_release(&vmm_kernel_lock);
+		return !(pde & X86_PAGEDIR_LARGE);
+	}
+
+	// Directory entry is NOT present, get a zeroed page and map it in
+	uint32_t new_ptable = (uint32_t)vmm_get_physical_page();
+	vmm_counts[diri] = 0;
+	vmm_set_entry(&dir_virtual[diri], new_ptable | vmm_table_bits(acl));
+	return true;
+}
+
+/**
+* Handle a write to addr that failed because the page or the page table is
+* shared after fork.
+* \param[in] user If the write was done in user mode.
+* \return Returns true if the write can be tried again.
+*/
+static bool vmm_copy_on_write(uint32_t addr, bool user)	{
+	uint32_t diri, pagei;
+	bool ret = false;
+	tlb_batch tlb;
+	ADDR2INDEX(addr, diri, pagei);
+
+	// Page tables are only unshared through the address they map
+	if(addr >= PAGE_TABLES_VIRT)	return false;
+	tlb_batch_init(&tlb);
+
+	spinlock_acquire(&vmm_cow_lock);
+	vmm_entry pde = dir_virtual[diri];
+	if((pde & X86_PAGEDIR_PRESENT) && !(pde & X86_PAGEDIR_LARGE))	{
+		if(pde & X86_PAGE_CLONED)	{
+			vmm_unshare_table(diri, &tlb);
+			ret = true;
+		}
+
+		vmm_entry pte = ptables_virtual[pagei],
+			allowed = dir_virtual[diri] & pte & (X86_PAGE_PRESENT | X86_PAGE_WRITABLE |
+			X86_PAGE_USER);
+		if((pte & X86_PAGE_PRESENT) && (pte & X86_PAGE_CLONED))	{
+			vmm_unshare_page(addr, pagei, &tlb);
+			ret = true;
+		}
+		else if((allowed & X86_PAGE_WRITABLE) && (allowed & X86_PAGE_PRESENT) &&
+			(!user || (allowed & X86_PAGE_USER)))	{
+			// Another CPU made the page private while this CPU still had the
+			// read-only entry, the fault has removed it from the TLB
+			ret = true;
+		}
+	}
+	spinlock_release(&vmm_cow_lock);
+	tlb_batch_flush(&tlb);
+	return ret;
+}
+
+/**
+* Get the page with the page table counts for a new address space, with clone
+* the tables are shared and so are the counts of the current address space.
+* \return Returns the physical address of the page.
+*/
+static uint32_t vmm_new_counts(bool clone)	{
+	uint32_t counts = (uint32_t)vmm_get_physical_page();
+	if(clone)	{
+		void* virt = vmm_kmap(counts);
+		memcpy(virt, (void*)vmm_counts, KB4);
+		vmm_kunmap(virt);
+	}
+	return counts;
+}
+
+/**
+* Create a new address space, see vmm_create_address_space and
+* vmm_clone_address_space.
+*/
+static uint32_t* vmm_new_address_space(bool clone)	{
+	uint32_t* addr_space = vmm_get_physical_page();
+	uint32_t counts = vmm_new_counts(clone);
+
+#if PAE_ENABLE
+	// addr_space is the pointer table, it and the directories are filled in
+	// through kmap since they are not mapped anywhere
+	uint32_t dirs[VMM_DIRS];
+	int i, j;
+	for(i = 0; i < VMM_DIRS; i++)	dirs[i] = (uint32_t)vmm_get_physical_page();
+
+	vmm_entry* ptable = (vmm_entry*)vmm_kmap((uint32_t)addr_space);
+	for(i = 0; i < VMM_DIRS; i++)	ptable[i] = dirs[i] | X86_PAGE_PRESENT;
+	vmm_kunmap(ptable);
+
+	// The directories are zeroed, only the kernel part and the user entries
+	// that are shared must be written
+	spinlock_acquire(&vmm_kernel_lock);
+	for(i = 0; i < VMM_DIRS; i++)	{
+		if(!clone && i * VMM_TABLE_ENTRIES >= VMM_KERNEL_PDES && i != VMM_DIRS - 1)
+			continue;
+		vmm_entry* dir = (vmm_entry*)vmm_kmap(dirs[i]);
+		for(j = 0; j < VMM_TABLE_ENTRIES; j++)	{
+			if(!clone && (i * VMM_TABLE_ENTRIES) + j >= VMM_KERNEL_PDES)	break;
+			dir[j] = vmm_new_pde((i * VMM_TABLE_ENTRIES) + j, clone);
+		}
+
+		if(i == VMM_COUNT_PDE / VMM_TABLE_ENTRIES)	{
+			dir[VMM_COUNT_PDE % VMM_TABLE_ENTRIES] = counts |
+				X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
+		}
+
+		// Map in itself, the last directory points to all of them
+		if(i == VMM_DIRS - 1)	{
+			for(j = 0; j < VMM_DIRS; j++)	{
+				dir[VMM_TABLE_ENTRIES - VMM_DIRS + j] = dirs[j] |
+					X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
+			}
+		}
+		vmm_kunmap(dir);
+	}
+	spinlock_release(&vmm_kernel_lock);
+#else
+	// The directory is zeroed, only the kernel part and the user entries that
+	// are shared must be written
+	uint32_t i, n = clone ? VMM_DIR_ENTRIES : VMM_KERNEL_PDES;
+	vmm_entry* dir = (vmm_entry*)vmm_kmap((uint32_t)addr_space);
+	spinlock_acquire(&vmm_kernel_lock);
+	for(i = 0; i < n; i++)	{
+		dir[i] = vmm_new_pde(i, clone);
+	}
+	spinlock_release(&vmm_kernel_lock);
+
+	// Map in itself
+	dir[VMM_COUNT_PDE] = counts | X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
+	dir[VMM_DIR_ENTRIES - 1] = (uint32_t)addr_space |
+		X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
+	vmm_kunmap(dir);
+#endif
+	return addr_space;
+}
 
 
 
 
 void vmm_init()	{
+	vmm_entry* dir, * ptable = NULL;
+	uint32_t i, cr4 = get_cr4();
 
-	// Allocate space for directory and 1 page (1st 4MB)
+	// Allocate space for directory
 	kernel_dir = vmm_get_physical_page();
-	uint32_t* ptable = vmm_get_physical_page();
 
+#if PAE_ENABLE
+	// PAE always has 2 MB pages. All the directories are created now, the
+	// pointer table is only read by the CPU when CR3 is loaded, so it must
+	// never change. They are consecutive, so they can be used as one directory.
+	vmm_use_large = PAGES_LARGE;
+	vmm_use_nx = ((cpu_ext_features() & CPUID_EXT_FEAT_NX) != 0);
+	dir = (vmm_entry*)pmm_alloc_aligned(VMM_DIRS, 1);
+	if(dir == NULL)	PANIC("Unable to allocate page directories");
+	pmm_owner_add(PMM_OWNER_PTABLE, VMM_DIRS);
+	memset(dir, 0x00, VMM_DIRS * KB4);
+	for(i = 0; i < VMM_DIRS; i++)	{
+		((vmm_entry*)kernel_dir)[i] = ((uint32_t)dir + (i * KB4)) |
+			X86_PAGE_PRESENT;
+	}
+	cr4 |= X86_CR4_PAE;
+#else
+	dir = (vmm_entry*)kernel_dir;
+	vmm_use_large = (PAGES_LARGE && (cpu_features() & CPUID_FEAT_PSE));
+	if(vmm_use_large)	cr4 |= X86_CR4_PSE;
+#endif
+	vmm_use_global = (PAGES_GLOBAL && (cpu_features() & CPUID_FEAT_PGE));
+	if(vmm_use_global)	cr4 |= X86_CR4_PGE;
+	set_cr4(cr4);
+	vmm_enable_nx();
+	vmm_use_pat = (PAGES_PAT && (cpu_features() & CPUID_FEAT_PAT));
+	vmm_enable_pat();
+
+	// Shared by all pages that have only been read, see vmm_map_zero_page
+	vmm_zero_frame = (uint32_t)pmm_alloc_zeroed();
+	if(vmm_zero_frame == 0)	PANIC("No memory for the zero page");
 
 	// Identity map 1st 4MB
-	int i;
-	for(i = 0; i < 1024; i++)	{
-		ptable[i] = (i*KB4);
-		ptable[i] |= 
-			X86_PAGE_PRESENT | X86_PAGE_WRITABLE | X86_PAGE_USER;
+	for(i = 0; i < MB4 / KB4; i++)	{
+		if(vmm_use_large)	{
+			if((i % VMM_TABLE_ENTRIES) == 0)	{
+				dir[i / VMM_TABLE_ENTRIES] = (i * KB4) | X86_PAGEDIR_PRESENT |
+					X86_PAGEDIR_WRITABLE | X86_PAGE_USER | X86_PAGEDIR_LARGE |
+					vmm_global_bit(i * KB4);
+			}
+			continue;
+		}
+		if((i % VMM_TABLE_ENTRIES) == 0)	{
+			ptable = (vmm_entry*)vmm_get_physical_page();
+			dir[i / VMM_TABLE_ENTRIES] = (uint32_t)ptable |
+				X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE | X86_PAGE_USER;
+		}
+		ptable[i % VMM_TABLE_ENTRIES] = (i*KB4) |
+			X86_PAGE_PRESENT | X86_PAGE_WRITABLE | X86_PAGE_USER |
+			vmm_global_bit(i * KB4);
 	}
 
-	// Map in the LAPIC address space
-	ptable[LAPIC_PHYS_VIRT_ADDR/KB4] = 0xFEE00000 |
-		X86_PAGE_PRESENT | X86_PAGE_WRITABLE | X86_PAGE_CACHE_DIS |
-		X86_PAGE_USER;
-	lapic_new_address(LAPIC_PHYS_VIRT_ADDR);
-
 	// Mark first 4 physical MB as taken
 	pmm_mark_mem_taken(0, MB4);
 
-	// TODO: Can unmark LAPIC addr, as that is not identity mapped
-
-
-	// Map in first 4MB
-	kernel_dir[0] = (uint32_t)ptable |
+	// Page table for the kmap slots, all address spaces get a copy of the
+	// entry and therefore share the table
+	vmm_entry* wtable = (vmm_entry*)vmm_get_physical_page();
+	dir[KMAP_START / VMM_LARGE_PAGE_SZ] = (uint32_t)wtable |
 		X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE | X86_PAGE_USER;
 
-	// Map intex on itself
+	// Map in the LAPIC address space
+	wtable[(LAPIC_PHYS_VIRT_ADDR % VMM_LARGE_PAGE_SZ)/KB4] = 0xFEE00000 |
+		X86_PAGE_PRESENT | X86_PAGE_CACHE_DIS | X86_PAGE_USER |
+		vmm_acl_bits(X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) |
+		vmm_global_bit(LAPIC_PHYS_VIRT_ADDR);
+
+	// Map intex on itself, the directories are then the last tables
 	// TODO: Could also have this as second 4MB block, makes more sense when I'm
 	// in the lower half
-	kernel_dir[1023] = (uint32_t)kernel_dir |
-		X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE | X86_PAGE_USER;
+	for(i = 0; i < VMM_DIRS; i++)	{
+		dir[VMM_DIR_ENTRIES - VMM_DIRS + i] = ((uint32_t)dir + (i * KB4)) |
+			X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE | X86_PAGE_USER;
+	}
+	dir[VMM_COUNT_PDE] = (uint32_t)vmm_get_physical_page() |
+		X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
 
+	init_spinlock(&vmm_cow_lock, LOCK_VMM);
+	init_spinlock(&vmm_kernel_lock, LOCK_VMM);
+
+	// All address spaces get the kernel part from here
+	for(i = 0; i < VMM_KERNEL_PDES; i++)	vmm_kernel_pdes[i] = dir[i];
 	register_interrupt_handler(14, vmm_handle_page_fault);
 
 	current_dir = kernel_dir;
 
 	paging_enable(current_dir);
+
+	// The LAPIC is used to find the current CPU, so the new address can not be
+	// used until paging is enabled
+	lapic_new_address(LAPIC_PHYS_VIRT_ADDR);
+	cpus[lapic_cpuid()].pdir = (uint32_t)current_dir;
+}
+
+
+void vmm_init_ap()	{
+	vmm_enable_nx();
+	vmm_enable_pat();
+	cpus[lapic_cpuid()].pdir = get_page_dir_addr();
+	vmm_sync_kernel();
+}
+
+
+bool vmm_sync_kernel()	{
+	uint32_t i;
+	bool ret = false;
+
+	// The common case, nothing has changed
+	if((dir_virtual[VMM_GEN_PDE] >> 1) == vmm_kernel_gen)	return false;
+
+	spinlock_acquire(&vmm_kernel_lock);
+	for(i = 0; i < VMM_KERNEL_PDES; i++)	{
+		vmm_entry pde = dir_virtual[i];
+		if(i == VMM_GEN_PDE || pde == vmm_kernel_pdes[i])	continue;
+
+		vmm_set_entry(&dir_virtual[i], vmm_kernel_pdes[i]);
+		if(pde & X86_PAGEDIR_PRESENT)	flush_tlb_entry(i * VMM_LARGE_PAGE_SZ);
+		ret = true;
+	}
+	vmm_set_entry(&dir_virtual[VMM_GEN_PDE], (vmm_entry)vmm_kernel_gen << 1);
+	spinlock_release(&vmm_kernel_lock);
+	return ret;
 }
 
 
 
 
-int vmm_map_page(uint32_t phys_addr, uint32_t virt_addr, uint32_t acl)	{
+int vmm_map_page(paddr_t phys_addr, uint32_t virt_addr, uint32_t acl)	{
 
 	// Get indexes and frame of virtual address
 	uint32_t diri, pagei;
 	ADDR2INDEX(virt_addr, diri, pagei);
 
+	if(!vmm_get_table(diri, acl) || vmm_pte_used(ptables_virtual[pagei]))
+		return VMM_ERR_PAGE_IN_USE;
 
-	// If directory entry is present
-	if(dir_virtual[diri] & X86_PAGEDIR_PRESENT)	{
-		uint32_t* ptable = (uint32_t*)(0xFFC00000 + (diri*KB4));
-		if( (ptable[pagei] & X86_PAGE_PRESENT))
-			return VMM_ERR_PAGE_IN_USE;
-		else
-			ptable[pagei] = phys_addr | X86_PAGE_PRESENT | acl;
+	// Map the page in
+	vmm_set_entry(&ptables_virtual[pagei],
+		phys_addr | X86_PAGE_PRESENT | vmm_acl_bits(acl) | vmm_global_bit(virt_addr));
+	vmm_count_add(diri, 1);
+	return VMM_SUCCESS;
+}
+
+
+int vmm_map_range(paddr_t phys_addr, uint32_t virt_addr, uint32_t size,
+	uint32_t acl)	{
+	uint32_t done = 0, diri, pagei, first, end;
+	vmm_entry bits = X86_PAGE_PRESENT | vmm_acl_bits(acl) |
+		vmm_global_bit(virt_addr);
+	bool ok = true;
+	if((phys_addr % KB4) != 0 || (virt_addr % KB4) != 0 || (size % KB4) != 0)
+		return VMM_ERR_NOT_ALIGNED;
+
+	while(ok && done < size)	{
+		uint32_t virt = virt_addr + done;
+		paddr_t phys = phys_addr + done;
+		diri = virt / VMM_LARGE_PAGE_SZ;
+
+		// The whole directory entry can be one large page
+		if(vmm_use_large && (virt % VMM_LARGE_PAGE_SZ) == 0 &&
+			(phys % VMM_LARGE_PAGE_SZ) == 0 && size - done >= VMM_LARGE_PAGE_SZ &&
+			vmm_set_large_pde(diri, phys | X86_PAGEDIR_PRESENT |
+				X86_PAGEDIR_LARGE | vmm_large_acl_bits(acl) | vmm_global_bit(virt)))	{
+			done += VMM_LARGE_PAGE_SZ;
+			continue;
+		}
+
+		if(!vmm_get_table(diri, acl))	{
+			ok = false;
+			break;
+		}
+
+		// All the pages that are in this table
+		pagei = first = virt / KB4;
+		end = (diri + 1) * VMM_TABLE_ENTRIES;
+		if(end - pagei > (size - done) / KB4)	end = pagei + ((size - done) / KB4);
+		for(; pagei < end; pagei++, done += KB4)	{
+			if(vmm_pte_used(ptables_virtual[pagei]))	{
+				ok = false;
+				break;
+			}
+			vmm_set_entry(&ptables_virtual[pagei], (phys_addr + done) | bits);
+		}
+		vmm_count_add(diri, pagei - first);
 	}
-	else	{
-		// Directory entry is NOT present
 
-		// Get page and map it in
-		uint32_t* new_ptable = pmm_alloc_first();
-		dir_virtual[diri] = (uint32_t)new_ptable | X86_PAGEDIR_PRESENT | acl;
+	if(ok)	return VMM_SUCCESS;
+
+	// Nothing is mapped if we fail
+	if(done != 0)	vmm_unmap_range(virt_addr, done);
+	return VMM_ERR_PAGE_IN_USE;
+}
 
-		// Get virtual address and zero it
-		uint32_t* ptable = (uint32_t*)(0xFFC00000 + (diri*KB4));
-		memset(ptable, 0x00, KB4);
 
-		// Map the page in
-		ptable[pagei] = phys_addr | X86_PAGE_PRESENT | acl;
+uint32_t vmm_map_frames(uint32_t* frames, uint32_t virt_addr, uint32_t n,
+	uint32_t acl)	{
+	uint32_t i = 0, ret = 0, pagei, diri, end, mapped;
+	vmm_entry bits = X86_PAGE_PRESENT | vmm_acl_bits(acl) |
+		vmm_global_bit(virt_addr);
+
+	while(i < n)	{
+		pagei = (virt_addr / KB4) + i;
+		diri = pagei / VMM_TABLE_ENTRIES;
+		end = (diri + 1) * VMM_TABLE_ENTRIES;
+		if(end - pagei > n - i)	end = pagei + (n - i);
+
+		bool table = vmm_get_table(diri, acl);
+		for(mapped = 0; pagei < end; pagei++, i++)	{
+			if(!table || vmm_pte_used(ptables_virtual[pagei]))	continue;
+			vmm_set_entry(&ptables_virtual[pagei], frames[i] | bits);
+			frames[i] = 0;
+			mapped++;
+		}
+		vmm_count_add(diri, mapped);
+		ret += mapped;
 	}
-	return VMM_SUCCESS;
+	return ret;
 }
 
 
 int vmm_unmap_page(uint32_t vaddr)	{
-	// Get indexes and frame of virtual address
-	uint32_t diri, pagei;
-	ADDR2INDEX(vaddr, diri, pagei);
+	if(!(dir_virtual[vaddr / VMM_LARGE_PAGE_SZ] & X86_PAGEDIR_PRESENT))
+		return VMM_ERR_NO_PAGEDIR_ENTRY;
+	return vmm_unmap_range(vaddr & ~(KB4 - 1), KB4);
+}
 
-	if(dir_virtual[diri] & X86_PAGEDIR_PRESENT)	{
-		uint32_t* ptable = (uint32_t*)(0xFFC00000 + (diri*KB4));
-		if(ptable[pagei] & X86_PAGE_PRESENT)	{
-			ptable[pagei] = 0;
+
+/**
+* Unmap a range, see vmm_unmap_range and vmm_release_range.
+* \param[in] release Drop a reference to the frames of the pages.
+*/
+static int vmm_unmap(uint32_t virt_addr, uint32_t size, bool release)	{
+	uint32_t pagei = virt_addr / KB4, last, diri, end, i, nfree = 0, cleared,
+		nframes = 0;
+	paddr_t tables[TLB_BATCH_SZ], frames[TLB_BATCH_SZ];
+	tlb_batch tlb;
+	if((virt_addr % KB4) != 0 || (size % KB4) != 0)	return VMM_ERR_NOT_ALIGNED;
+	last = pagei + (size / KB4);
+	tlb_batch_init(&tlb);
+
+	while(pagei < last)	{
+		diri = pagei / VMM_TABLE_ENTRIES;
+		end = (diri + 1) * VMM_TABLE_ENTRIES;
+		if(end > last)	end = last;
+
+		vmm_entry pde = dir_virtual[diri];
+		if(!(pde & X86_PAGEDIR_PRESENT))	{
+			pagei = end;
+			continue;
+		}
+
+		if(pde & X86_PAGEDIR_LARGE)	{
+			// One invlpg removes the whole large page from the TLB
+			if(diri < VMM_KERNEL_PDES)	{
+				spinlock_acquire(&vmm_kernel_lock);
+				vmm_set_kernel_pde(diri, 0);
+				spinlock_release(&vmm_kernel_lock);
+			}
+			else	{
+				vmm_set_entry(&dir_virtual[diri], 0);
+			}
+			tlb_batch_add(&tlb, diri * VMM_LARGE_PAGE_SZ);
+			pagei = end;
+			continue;
 		}
 
-		// Check if entire directory entry is empty
-		int i;
-		for(i = 0; i < 1024; i++)	{
-			if(ptable[i] & X86_PAGE_PRESENT)	break;
+		vmm_own_table(diri);
+		for(i = pagei, cleared = 0; i < end && nframes < TLB_BATCH_SZ; i++)	{
+			vmm_entry pte = ptables_virtual[i];
+			if(vmm_pte_used(pte))	{
+				vmm_set_entry(&ptables_virtual[i], 0);
+				if(pte & X86_PAGE_PRESENT)	tlb_batch_add(&tlb, i * KB4);
+				else if(pte & X86_PAGE_SWAPPED)	zswap_free((uint32_t)pte >> 12);
+				cleared++;
+
+				if(release && (pte & X86_PAGE_PRESENT) &&
+					(pte & X86_PAGE_FRAME) != vmm_zero_frame)
+					frames[nframes++] = pte & X86_PAGE_FRAME;
+			}
 		}
-		if(i >= 1024)	{
-			pmm_free( (void*)(dir_virtual[diri] & 0xFFFFF000));
-			dir_virtual[diri] = 0;
+		end = i;
+		vmm_count_add(diri, -(int32_t)cleared);
+
+		// The kernel tables are kept, other address spaces can point to them
+		if(diri >= VMM_KERNEL_PDES && vmm_count_get(diri) == 0)	{
+			tables[nfree++] = dir_virtual[diri] & X86_PAGEDIR_FRAME;
+			vmm_set_entry(&dir_virtual[diri], 0);
+			tlb_batch_add(&tlb, (uint32_t)&ptables_virtual[diri * VMM_TABLE_ENTRIES]);
 		}
+
+		// Other CPUs may walk the tables and use the frames until they have flushed
+		if(nfree == TLB_BATCH_SZ || nframes == TLB_BATCH_SZ)	{
+			tlb_batch_flush(&tlb);
+			for(i = 0; i < nfree; i++)	pmm_free((void*)(uint32_t)tables[i]);
+			if(nfree != 0)	pmm_owner_add(PMM_OWNER_PTABLE, -(int32_t)nfree);
+			vmm_release_frames(frames, nframes);
+			nfree = nframes = 0;
+		}
+		pagei = end;
 	}
-	else	{
-		return VMM_ERR_NO_PAGEDIR_ENTRY;
+
+	tlb_batch_flush(&tlb);
+	for(i = 0; i < nfree; i++)	pmm_free((void*)(uint32_t)tables[i]);
+	if(nfree != 0)	pmm_owner_add(PMM_OWNER_PTABLE, -(int32_t)nfree);
+	vmm_release_frames(frames, nframes);
+	return VMM_SUCCESS;
+}
+
+
+int vmm_unmap_range(uint32_t virt_addr, uint32_t size)	{
+	return vmm_unmap(virt_addr, size, false);
+}
+
+
+int vmm_release_range(uint32_t virt_addr, uint32_t size)	{
+	return vmm_unmap(virt_addr, size, true);
+}
+
+
+
+paddr_t vmm_virt_to_phys(uint32_t virt)	{
+	vmm_entry pde = dir_virtual[virt / VMM_LARGE_PAGE_SZ];
+	if(!(pde & X86_PAGEDIR_PRESENT))	return 0;
+	if(pde & X86_PAGEDIR_LARGE)	{
+		return (pde & X86_PAGEDIR_FRAME & ~(vmm_entry)(VMM_LARGE_PAGE_SZ - 1)) +
+			(virt % VMM_LARGE_PAGE_SZ);
+	}
+
+	vmm_entry pte = ptables_virtual[virt / KB4];
+	if(!(pte & X86_PAGE_PRESENT))	return 0;
+	return (pte & X86_PAGE_FRAME) + (virt % KB4);
+}
+
+
+
+int vmm_map_zero_page(uint32_t virt_addr, uint32_t acl)	{
+	// Only the page is read-only and shared, see vmm_table_bits
+	if(acl & X86_PAGE_WRITABLE)	acl = (acl & ~X86_PAGE_WRITABLE) | X86_PAGE_CLONED;
+	return vmm_map_page(vmm_zero_frame, virt_addr, acl);
+}
+
+
+paddr_t vmm_reclaim_page(uint32_t virt, tlb_batch* tlb, bool* dirty)	{
+	uint32_t diri, pagei;
+	ADDR2INDEX(virt, diri, pagei);
+
+	// Large pages and tables that are shared after fork are left alone
+	vmm_entry pde = dir_virtual[diri];
+	if(!(pde & X86_PAGEDIR_PRESENT) || (pde & (X86_PAGEDIR_LARGE | X86_PAGE_CLONED)))
+		return 0;
+
+	vmm_entry pte = ptables_virtual[pagei];
+	paddr_t frame = pte & X86_PAGE_FRAME;
+	if(!(pte & X86_PAGE_PRESENT) || (pte & X86_PAGE_CLONED) ||
+		frame == vmm_zero_frame || pmm_ref_count(frame) != 0)
+		return 0;
+
+	// A dirty page can only be taken if there is somewhere to put it. Kernel
+	// pages are kept, they can be read with locks held that the fault needs.
+	*dirty = ((pte & X86_PAGE_DIRTY) != 0);
+	if(*dirty && (!ZSWAP_ENABLE || virt < USERMODE_START))	return 0;
+
+	// The CPU sets the accessed and dirty bits in the low half, also with PAE
+	volatile uint32_t* low = (volatile uint32_t*)&ptables_virtual[pagei];
+	if(pte & X86_PAGE_ACCESSED)	{
+		// Bit 5 is X86_PAGE_ACCESSED. It is not flushed, a CPU that has the page
+		// cached only makes it look older than it is.
+		atomic_btr(low, 5);
+		return 0;
+	}
+
+	// The bits can be set until the entry is changed, so it is only changed if
+	// the page was not used since it was read
+	uint32_t old = (uint32_t)pte,
+		val = (*dirty) ? ((old & ~X86_PAGE_PRESENT) | X86_PAGE_SWAPPING) : 0;
+	if(cmpxchg(low, old, val) != old)	return 0;
+
+	// The entry of a dirty page is still used until vmm_swap_finish
+	if(!(*dirty))	{
+#if PAE_ENABLE
+		low[1] = 0;
+#endif
+		vmm_count_add(diri, -1);
+	}
+	tlb_batch_add(tlb, virt);
+	return frame;
+}
+
+
+bool vmm_swap_finish(uint32_t virt, paddr_t frame, uint32_t slot)	{
+	uint32_t diri, pagei;
+	ADDR2INDEX(virt, diri, pagei);
+	vmm_entry pte = (dir_virtual[diri] & X86_PAGEDIR_PRESENT) ? ptables_virtual[pagei] : 0;
+	bool same = ((pte & X86_PAGE_FRAME) == frame);
+
+	if(same && (pte & X86_PAGE_SWAPPING))	{
+		if(slot != 0)	{
+			vmm_set_entry(&ptables_virtual[pagei], ((vmm_entry)slot << 12) | X86_PAGE_SWAPPED);
+			return true;
+		}
+
+		// Did not compress, the page is kept
+		vmm_set_entry(&ptables_virtual[pagei], (pte & ~X86_PAGE_SWAPPING) | X86_PAGE_PRESENT);
+		return false;
+	}
+
+	// Faulted in again, or unmapped and then the frame is not used any more
+	if(slot != 0)	zswap_free(slot);
+	return !(same && (pte & X86_PAGE_PRESENT));
+}
+
+
+int vmm_swap_in(uint32_t virt, uint32_t acl)	{
+	uint32_t diri, pagei;
+	ADDR2INDEX(virt, diri, pagei);
+	vmm_entry pde = dir_virtual[diri];
+	if(!(pde & X86_PAGEDIR_PRESENT) || (pde & X86_PAGEDIR_LARGE))	return VMM_ERR_NOT_SWAPPED;
+	if(!(ptables_virtual[pagei] & (X86_PAGE_SWAPPED | X86_PAGE_SWAPPING)) ||
+		(ptables_virtual[pagei] & X86_PAGE_PRESENT))
+		return VMM_ERR_NOT_SWAPPED;
+
+	// A table that is shared after fork is copied first, each copy of the entry
+	// has a reference to the slot
+	vmm_own_table(diri);
+	vmm_entry pte = ptables_virtual[pagei];
+	if(pte & X86_PAGE_SWAPPING)	{
+		// Not compressed yet, the same frame is used again
+		vmm_set_entry(&ptables_virtual[pagei], (pte & ~X86_PAGE_SWAPPING) | X86_PAGE_PRESENT);
+		return VMM_SUCCESS;
 	}
-	flush_tlb_entry(vaddr);
 
+	paddr_t frame = pmm_alloc_phys();
+	if(frame == 0)	return VMM_ERR_NO_MEMORY;
+	void* page = vmm_kmap(frame);
+	bool ok = zswap_load((uint32_t)pte >> 12, page);
+	vmm_kunmap(page);
+	if(!ok)	PANIC("Compressed page is lost");
+
+	vmm_set_entry(&ptables_virtual[pagei], frame | X86_PAGE_PRESENT | X86_PAGE_DIRTY |
+		vmm_acl_bits(acl) | vmm_global_bit(virt));
 	return VMM_SUCCESS;
 }
 
 
 
-uint32_t* vmm_create_address_space(uint32_t* virt)	{
-//	uint32_t* addr_space = vmm_get_physical_page();
-	uint32_t* addr_space = (uint32_t*)pmm_alloc_first;
-	vmm_map_page((uint32_t)addr_space, (uint32_t)virt, X86_PAGE_WRITABLE);
-	memset(virt, 0x00, KB4);
+bool vmm_large_pages()	{
+	return vmm_use_large;
+}
+
+
+int vmm_map_large_page(paddr_t phys_addr, uint32_t virt_addr, uint32_t acl)	{
+	if(!vmm_use_large)	return VMM_ERR_NO_LARGE_PAGES;
+	if((phys_addr % VMM_LARGE_PAGE_SZ) != 0 || (virt_addr % VMM_LARGE_PAGE_SZ) != 0)
+		return VMM_ERR_NOT_ALIGNED;
+
+	uint32_t diri = virt_addr / VMM_LARGE_PAGE_SZ;
+	if(!vmm_set_large_pde(diri, phys_addr | X86_PAGEDIR_PRESENT |
+		X86_PAGEDIR_LARGE | vmm_large_acl_bits(acl) | vmm_global_bit(virt_addr)))
+		return VMM_ERR_PAGE_IN_USE;
+	return VMM_SUCCESS;
+}
+
+
+
+uint32_t* vmm_create_address_space()	{
+	return vmm_new_address_space(false);
+}
+
+uint32_t* vmm_clone_address_space()	{
+	uint32_t* ret = vmm_new_address_space(true);
+
+	// Our own user pages were made read-only. Other CPUs running in this address
+	// space could otherwise still write to the frames the clone now shares.
+	tlb_batch tlb;
+	tlb_batch_init(&tlb);
+	tlb_batch_add_all(&tlb);
+	tlb_batch_flush(&tlb);
+	return ret;
+}
 
 
-	// TODO: Only copy relevant pages, saves some time
-	int i;
-	for(i = 0; i < 1024; i++)	{
-		virt[i] = dir_virtual[i];
+
+void vmm_zero_page(paddr_t phys)	{
+	// Physical memory is accessed directly before paging is enabled
+	if(!paging_enabled())	{
+		memset((void*)(uint32_t)phys, 0x00, KB4);
+		return;
 	}
 
-	// Map in itself
-	virt[1023] = (uint32_t)addr_space |
-		X86_PAGEDIR_PRESENT | X86_PAGEDIR_WRITABLE;
-	return addr_space;
+	void* virt = vmm_kmap(phys);
+	memset(virt, 0x00, KB4);
+	vmm_kunmap(virt);
 }
 
 
 
 void vmm_switch_pdir(uint32_t* pdir)	{
 	current_dir = pdir;
+	cpus[lapic_cpuid()].pdir = (uint32_t)current_dir;
 	load_page_dir_addr( (uint32_t)current_dir);
+	vmm_sync_kernel();
 }
 
 void vmm_switch_kernel()	{
 	current_dir = kernel_dir;
+	cpus[lapic_cpuid()].pdir = (uint32_t)current_dir;
 	load_page_dir_addr( (uint32_t)current_dir);
+	vmm_sync_kernel();
 }
 
 
 
 
 uint32_t vmm_handle_page_fault(Registers* regs)	{
-	print_regs(regs, K_BOCHS_OUT);
-	PANIC("Page fault");
-
 	// Get the address that caused the exception
 	uint32_t addr;
 	read_cr2(addr);
 
 	// Check if address belongs to the process address space
 	if((regs->err_code & X86_PF_PROTECT) == 0)	{
-		// Fault was caused by a non-present page
+		// The kernel entry can have been added in another address space
+		if(addr < USERMODE_START && vmm_sync_kernel())	return 0;
+
+		// Fault was caused by a non-present page, can be a demand-zero area
+		if(vma_handle_fault(addr, (regs->err_code & X86_PF_WRITE) != 0))	return 0;
+
+		print_regs(regs, K_BOCHS_OUT);
 		PANIC("Page NOT present");
 	}
 	else	{
-		uint32_t diri, pagei;
-		ADDR2INDEX(addr, diri, pagei);
-		uint32_t* dir = 0x00;
-		if ((regs->err_code & X86_PF_WRITE))	{
-			// If it was a write to cloned directory entry
-			if(dir[diri] & X86_PAGE_CLONED)	{
+		// Write to a page or page table that is shared after fork
+		if((regs->err_code & X86_PF_WRITE) &&
+			vmm_copy_on_write(addr, (regs->err_code & X86_PF_USERMODE) != 0))
+			return 0;
 
-			}
-			uint32_t* ptable = dir[diri];
-			if(ptable[pagei] & X86_PAGE_CLONED)	{
-
-			}
-		}
+		print_regs(regs, K_BOCHS_OUT);
 		if((regs->err_code & X86_PF_USERMODE))	{
 			// Kill the process
+			PANIC("Page protection fault in user mode");
 		}
 		else	{
 			PANIC("Page protection fault in kernel");
@@ -231,3 +1160,306 @@ uint32_t vmm_handle_page_fault(Registers* regs)	{
 
 	return 0;
 }
+
+
+
+
+//------------- Test-code -------------------------
+
+#ifdef TEST_KERNEL
+
+/** Number of kernel pages read after each switch. */
+#define VMM_BENCH_PAGES 64
+
+/**
+* Average cycles to switch to other and back, after each switch the pages in
+* addrs are read.
+*/
+static uint32_t vmm_bench_rounds(uint32_t* other, uint32_t* addrs, uint32_t n,
+	uint32_t rounds)	{
+	uint32_t* mine = current_dir, r, i, sum = 0;
+	for(r = 0; r < rounds; r++)	{
+		uint64_t t = rdtsc();
+		vmm_switch_pdir(other);
+		for(i = 0; i < n; i++)	(void)*(volatile uint32_t*)addrs[i];
+		vmm_switch_pdir(mine);
+		for(i = 0; i < n; i++)	(void)*(volatile uint32_t*)addrs[i];
+		sum += (uint32_t)(rdtsc() - t);
+	}
+	return sum / rounds;
+}
+
+void vmm_bench_switch(uint32_t rounds)	{
+	uint32_t addrs[VMM_BENCH_PAGES], n = 0, a, cr4 = get_cr4(), with, without, i;
+
+	// Heap pages that are mapped, each of them is one TLB entry
+	for(a = HEAP_START; a < HEAP_END && n < VMM_BENCH_PAGES; a += KB4)	{
+		if(vmm_virt_to_phys(a) != 0)	addrs[n++] = a;
+	}
+	uint32_t* other = vmm_create_address_space();
+
+	// Disabling PGE flushes the global pages, the bits are then ignored
+	pushcli();
+	set_cr4(cr4 & ~X86_CR4_PGE);
+	without = vmm_bench_rounds(other, addrs, n, rounds);
+	set_cr4(cr4);
+	with = vmm_bench_rounds(other, addrs, n, rounds);
+	popcli();
+
+	kprintf(K_LOW_INFO, "[VMM] switch and read %i kernel pages: %i cycles, "
+		"%i with global pages%s\n", n, without, with,
+		vmm_use_global ? "" : " (not supported)");
+
+	// Free the counts and the directories, with PAE other is the pointer table
+	vmm_entry* ptable = (vmm_entry*)vmm_kmap((uint32_t)other);
+#if PAE_ENABLE
+	vmm_entry* dir = (vmm_entry*)vmm_kmap(
+		ptable[VMM_COUNT_PDE / VMM_TABLE_ENTRIES] & X86_PAGE_FRAME);
+	pmm_free((void*)(uint32_t)(dir[VMM_COUNT_PDE % VMM_TABLE_ENTRIES] &
+		X86_PAGEDIR_FRAME));
+	vmm_kunmap(dir);
+
+	for(i = 0; i < VMM_DIRS; i++)	{
+		pmm_free((void*)(uint32_t)(ptable[i] & X86_PAGE_FRAME));
+	}
+	pmm_owner_add(PMM_OWNER_PTABLE, -VMM_DIRS);
+#else
+	pmm_free((void*)(uint32_t)(ptable[VMM_COUNT_PDE] & X86_PAGEDIR_FRAME));
+	(void)i;
+#endif
+	vmm_kunmap(ptable);
+	pmm_free(other);
+	pmm_owner_add(PMM_OWNER_PTABLE, -2);
+}
+
+int vmm_test_counts()	{
+	// Two pages at the end of one user table and two in the next
+	uint32_t addr = USERMODE_START + VMM_LARGE_PAGE_SZ - (KB4 * 2),
+		diri = addr / VMM_LARGE_PAGE_SZ;
+	if((dir_virtual[diri] | dir_virtual[diri + 1]) & X86_PAGEDIR_PRESENT)	return 1;
+
+	// The physical pages are never accessed
+	if(vmm_map_range(0, addr, KB4 * 4, X86_PAGE_WRITABLE) != VMM_SUCCESS)	return 2;
+	if(vmm_count_get(diri) != 2 || vmm_count_get(diri + 1) != 2)	return 3;
+	if(vmm_map_page(0, addr, X86_PAGE_WRITABLE) != VMM_ERR_PAGE_IN_USE ||
+		vmm_count_get(diri) != 2)
+		return 4;
+
+	// The table is only freed when the last page is unmapped
+	vmm_unmap_page(addr);
+	if(vmm_count_get(diri) != 1 || !(dir_virtual[diri] & X86_PAGEDIR_PRESENT))
+		return 5;
+	vmm_unmap_range(addr, KB4 * 4);
+	if((dir_virtual[diri] | dir_virtual[diri + 1]) & X86_PAGEDIR_PRESENT)	return 6;
+	return 0;
+}
+
+int vmm_test_kmap()	{
+	paddr_t frame = pmm_alloc_phys();
+	int ret = 0, used = cpus[lapic_cpuid()].kmap_used;
+	if(frame == 0)	return 1;
+
+	// Two slots with the same frame, the second write is seen through the first
+	volatile uint32_t* a = (volatile uint32_t*)vmm_kmap(frame);
+	volatile uint32_t* b = (volatile uint32_t*)vmm_kmap(frame);
+	if(a == b || cpus[lapic_cpuid()].kmap_used != (uint32_t)used + 2)	ret = 2;
+	a[0] = 0x1234;
+	b[0] = 0xABCD;
+	if(ret == 0 && a[0] != 0xABCD)	ret = 3;
+	vmm_kunmap((void*)b);
+	vmm_kunmap((void*)a);
+
+	if(ret == 0 && cpus[lapic_cpuid()].kmap_used != (uint32_t)used)	ret = 4;
+	pmm_free_phys(frame);
+	return ret;
+}
+
+int vmm_test_cache()	{
+	uint32_t addr = USERMODE_START + (VMM_LARGE_PAGE_SZ * 4),
+		diri = addr / VMM_LARGE_PAGE_SZ;
+	volatile uint32_t* p = (volatile uint32_t*)addr;
+	paddr_t frame = pmm_alloc_phys();
+	int ret = 0;
+	if(frame == 0)	return 1;
+	if(dir_virtual[diri] & X86_PAGEDIR_PRESENT)	ret = 2;
+
+	// The memory type of the first page in a new table is only on the page,
+	// X86_PAGE_PAT would make the directory entry a large page
+	if(ret == 0 && vmm_map_page(frame, addr, X86_PAGE_WRITABLE | VMM_CACHE_WC) !=
+		VMM_SUCCESS)
+		ret = 3;
+	vmm_entry pde = dir_virtual[diri];
+	if(ret == 0 && (!(pde & X86_PAGEDIR_PRESENT) || (pde & (X86_PAGEDIR_LARGE |
+		X86_PAGEDIR_WRITE_THROUGH | X86_PAGEDIR_CACHE))))
+		ret = 4;
+	if(ret == 0 && !(ptables_virtual[addr / KB4] & (X86_PAGE_PAT | X86_PAGE_CACHE_DIS)))
+		ret = 5;
+
+	// Written through the new table
+	if(ret == 0)	p[0] = 0x5A5A;
+	volatile uint32_t* k = (volatile uint32_t*)vmm_kmap(frame);
+	if(ret == 0 && k[0] != 0x5A5A)	ret = 6;
+	vmm_kunmap((void*)k);
+
+	vmm_unmap_range(addr, KB4);
+	pmm_free_phys(frame);
+	return ret;
+}
+
+int vmm_test_cow_retry()	{
+	uint32_t addr = USERMODE_START + (VMM_LARGE_PAGE_SZ * 4);
+	int ret = 0;
+
+	// A write fault on a page that is already private is only a stale TLB entry,
+	// the frame is never used
+	if(vmm_map_page(0, addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	return 1;
+	if(vmm_map_page(0, addr + KB4, 0) != VMM_SUCCESS)	ret = 2;
+	if(ret == 0 && !vmm_copy_on_write(addr, false))	ret = 3;
+
+	// Real protection faults, not writable or not a user page
+	if(ret == 0 && (vmm_copy_on_write(addr + KB4, false) ||
+		vmm_copy_on_write(addr, true)))
+		ret = 4;
+
+	vmm_unmap_range(addr, KB4 * 2);
+	return ret;
+}
+
+int vmm_test_release()	{
+	uint32_t addr = USERMODE_START + (VMM_LARGE_PAGE_SZ * 4);
+	paddr_t frame = pmm_alloc_phys();
+	int ret = 0;
+	if(frame == 0)	return 1;
+
+	// Shared with another address space, only the reference is dropped
+	pmm_ref_inc(frame);
+	if(vmm_map_page(frame, addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	ret = 2;
+	if(ret == 0 && (vmm_release_range(addr, KB4) != VMM_SUCCESS ||
+		vmm_virt_to_phys(addr) != 0 || pmm_ref_count(frame) != 0))
+		ret = 3;
+
+	// The last reference, the frame is freed and can be handed out again
+	uint32_t before = pmm_free_blocks() + cpus[lapic_cpuid()].frames.count;
+	if(ret == 0 && vmm_map_page(frame, addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	ret = 4;
+	if(ret == 0 && (vmm_release_range(addr, KB4) != VMM_SUCCESS ||
+		pmm_free_blocks() + cpus[lapic_cpuid()].frames.count != before + 1))
+		ret = 5;
+
+	// The frame was already given back if the count was wrong
+	if(ret != 0 && ret != 5)	{
+		vmm_unmap_range(addr, KB4);
+		if(pmm_ref_count(frame) != 0)	pmm_ref_dec(frame);
+		pmm_free_phys(frame);
+	}
+	return ret;
+}
+
+int vmm_test_zero_page()	{
+	uint32_t addr = USERMODE_START + (VMM_LARGE_PAGE_SZ * 2);
+	vm_area a = {VMA_DEMAND_ZERO, addr, addr + (KB4 * 2),
+		X86_PAGE_WRITABLE | X86_PAGE_USER, PMM_OWNERS, NULL, NULL, 0};
+	memory_desc mm, * old = vma_user;
+	volatile uint32_t* p = (volatile uint32_t*)addr;
+	int ret = 0;
+
+	vma_init(&mm);
+	if(vma_insert(&mm, &a) != VMA_SUCCESS)	return 1;
+	vma_user = &mm;
+
+	// Both pages are read first, they share the zero frame. The table is new
+	// and is not read-only or shared itself.
+	if(dir_virtual[addr / VMM_LARGE_PAGE_SZ] & X86_PAGEDIR_PRESENT)	ret = 6;
+	if(ret == 0 && (p[0] != 0 || p[KB4 / 4] != 0))	ret = 2;
+	vmm_entry pde = dir_virtual[addr / VMM_LARGE_PAGE_SZ];
+	if(ret == 0 && (vmm_virt_to_phys(addr) != vmm_zero_frame ||
+		vmm_virt_to_phys(addr + KB4) != vmm_zero_frame ||
+		!(pde & X86_PAGEDIR_WRITABLE) || (pde & X86_PAGE_CLONED)))
+		ret = 3;
+
+	// Other pages in the table are not copy-on-write, the frame is never used
+	if(ret == 0 && (vmm_map_page(0, addr + (KB4 * 2),
+		X86_PAGE_WRITABLE) != VMM_SUCCESS ||
+		(ptables_virtual[(addr / KB4) + 2] & X86_PAGE_CLONED) ||
+		!(ptables_virtual[(addr / KB4) + 2] & X86_PAGE_WRITABLE)))
+		ret = 7;
+	vmm_unmap_page(addr + (KB4 * 2));
+
+	// A write gives the page a zeroed frame of its own
+	p[1] = 0xABCD;
+	paddr_t frame = vmm_virt_to_phys(addr);
+	if(ret == 0 && (frame == vmm_zero_frame || p[0] != 0 || p[1] != 0xABCD))	ret = 4;
+	if(ret == 0 && (p[(KB4 / 4) + 1] != 0 ||
+		vmm_virt_to_phys(addr + KB4) != vmm_zero_frame))
+		ret = 5;
+
+	vmm_unmap_range(addr, KB4 * 2);
+	if(frame != vmm_zero_frame)	pmm_free_phys(frame);
+	vma_user = old;
+	return ret;
+}
+
+int vmm_test_reclaim()	{
+	uint32_t addr = USERMODE_START + (VMM_LARGE_PAGE_SZ * 3), slot;
+	volatile uint32_t* p = (volatile uint32_t*)addr;
+	paddr_t frame = pmm_alloc_phys(), back = 0;
+	bool dirty;
+	tlb_batch tlb;
+	int ret = 0;
+	if(frame == 0)	return 1;
+	tlb_batch_init(&tlb);
+
+	// An accessed page gets a second chance, then it is taken
+	if(vmm_map_page(frame, addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	ret = 2;
+	if(ret == 0)	(void)p[0];
+	if(ret == 0 && (vmm_reclaim_page(addr, &tlb, &dirty) != 0 ||
+		(ptables_virtual[addr / KB4] & X86_PAGE_ACCESSED) || tlb.count != 0))
+		ret = 3;
+	if(ret == 0 && (vmm_reclaim_page(addr, &tlb, &dirty) != frame || dirty ||
+		vmm_virt_to_phys(addr) != 0 || tlb.count != 1))
+		ret = 4;
+	tlb_batch_flush(&tlb);
+
+	// A dirty page is compressed and comes back when it is touched
+	if(ret == 0 && vmm_map_page(frame, addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	ret = 5;
+	if(ret == 0)	p[0] = 0xABCD;
+	if(ret == 0 && ZSWAP_ENABLE)	{
+		if(vmm_reclaim_page(addr, &tlb, &dirty) != 0 ||
+			vmm_reclaim_page(addr, &tlb, &dirty) != frame || !dirty)
+			ret = 6;
+		tlb_batch_flush(&tlb);
+
+		void* page = vmm_kmap(frame);
+		slot = (ret == 0) ? zswap_store(page) : 0;
+		vmm_kunmap(page);
+		if(ret == 0 && (slot == 0 || !vmm_swap_finish(addr, frame, slot) ||
+			!(ptables_virtual[addr / KB4] & X86_PAGE_SWAPPED)))
+			ret = 7;
+		if(ret == 0 && vmm_swap_in(addr, X86_PAGE_WRITABLE) != VMM_SUCCESS)	ret = 8;
+		back = vmm_virt_to_phys(addr);
+		if(ret == 0 && (back == 0 || p[0] != 0xABCD))	ret = 9;
+	}
+	else if(ret == 0 && vmm_reclaim_page(addr, &tlb, &dirty) != 0)	{
+		ret = 6;
+	}
+
+	vmm_unmap_range(addr, KB4);
+	if(back != 0 && back != frame)	pmm_free_phys(back);
+	pmm_free_phys(frame);
+	return ret;
+}
+
+bool vmm_run_all_tests()	{
+	unit_test tests[8] = {
+		vmm_test_counts,
+		vmm_test_kmap,
+		vmm_test_cache,
+		vmm_test_cow_retry,
+		vmm_test_release,
+		vmm_test_zero_page,
+		vmm_test_reclaim,
+		NULL
+	};
+	return kernel_generic_unit_test(tests, "vmm_run_all_tests()");
+}
+
+#endif
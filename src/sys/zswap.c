@@ -0,0 +1,401 @@
+/**
+* \ingroup paging
+* \file zswap.c
+* Compressed swap in memory, see zswap.h.
+*/
+
+#include "sys/kernel.h"
+#include "sys/zswap.h"
+#include "sys/vmm.h"
+#include "sys/pmm.h"
+#include "sys/lock.h"
+
+#include "lib/lz4.h"
+
+
+/** Number of units in the arena. */
+#define ZSWAP_UNITS (ZSWAP_SIZE / ZSWAP_UNIT)
+
+/** Number of units in one page of the arena. */
+#define ZSWAP_PAGE_UNITS (KB4 / ZSWAP_UNIT)
+
+/** Number of pages in the arena. */
+#define ZSWAP_PAGES (ZSWAP_SIZE / KB4)
+
+/** Set in zswap_pages if the page has a frame. */
+#define ZSWAP_PAGE_MAPPED 0x80
+
+/** No free run of units. */
+#define ZSWAP_NO_UNIT 0xFFFFFFFF
+
+/** Max number of frames given back in one call to zswap_shrink. */
+#define ZSWAP_SHRINK_BATCH 16
+
+
+typedef struct	{
+	/**
+	* First unit of the data in the arena, or the value of all words if len is
+	* 0. For a free slot, the next free slot.
+	*/
+	uint32_t unit;
+
+	/** Bytes of compressed data, 0 if all words are the same. */
+	uint16_t len;
+
+	/** Number of page table entries with the slot, 0 if it is free. */
+	uint16_t refs;
+} zswap_slot;
+
+
+/** Protects everything below. Initialized here, like reclaim_lock. */
+static spinlock zswap_lock = {LOCK_ZSWAP, 0, 0, NULL};
+
+/** Slot 0 is never used, 0 means no slot. */
+static zswap_slot zswap_slots[ZSWAP_SLOTS];
+
+/** First slot in the list of free slots, 0 if the list is empty. */
+static uint32_t zswap_free_slots = 0;
+
+/** Slots from here and up have never been used. */
+static uint32_t zswap_new_slot = 1;
+
+/** Bit i is set if unit i is used. */
+static uint32_t zswap_units[ZSWAP_UNITS / 32];
+
+/** Number of used units in each page of the arena, and ZSWAP_PAGE_MAPPED. */
+static uint8_t zswap_pages[ZSWAP_PAGES];
+
+/** Where the search for free units starts, after the last run. */
+static uint32_t zswap_hint = 0;
+
+static zswap_stats zswap_info;
+
+/** The compressed page before it is copied to the arena. */
+static uint8_t zswap_buf[ZSWAP_MAX_LEN];
+
+/** Work area for lz4_compress. */
+static uint16_t zswap_table[LZ4_TABLE_SZ];
+
+
+
+//--------------- Internal function definitions ---------------------------
+
+/** Take a free slot, returns 0 if there is none. */
+static uint32_t zswap_slot_alloc();
+
+/** Put the slot first in the list of free slots. */
+static void zswap_slot_free(uint32_t slot);
+
+/** Drop one reference, the data and the slot are freed with the last one. */
+static void zswap_put(uint32_t slot);
+
+/**
+* Find n free units in a row and mark them as used, the pages they are in get
+* a frame if they do not have one.
+* \return Returns the first unit or ZSWAP_NO_UNIT.
+*/
+static uint32_t zswap_units_alloc(uint32_t n);
+
+static inline bool zswap_unit_used(uint32_t u)	{
+	return (zswap_units[u / 32] & (1U << (u % 32))) != 0;
+}
+
+static inline void* zswap_unit_addr(uint32_t u)	{
+	return (void*)(ZSWAP_START + (u * ZSWAP_UNIT));
+}
+
+
+
+
+//------------------- Public API function implementations ------------------
+
+uint32_t zswap_store(const void* page)	{
+	const uint32_t* w = (const uint32_t*)page;
+	uint32_t i, slot, first;
+	size_t len;
+
+	spinlock_acquire(&zswap_lock);
+	if((slot = zswap_slot_alloc()) == 0)	{
+		zswap_info.rejected++;
+		spinlock_release(&zswap_lock);
+		return 0;
+	}
+
+	for(i = 1; i < KB4 / sizeof(uint32_t) && w[i] == w[0]; i++);
+	if(i == KB4 / sizeof(uint32_t))	{
+		zswap_slots[slot] = (zswap_slot){w[0], 0, 1};
+		zswap_info.same++;
+	}
+	else	{
+		len = lz4_compress(page, KB4, zswap_buf, ZSWAP_MAX_LEN, zswap_table);
+		first = (len == 0) ? ZSWAP_NO_UNIT :
+			zswap_units_alloc((len + ZSWAP_UNIT - 1) / ZSWAP_UNIT);
+		if(first == ZSWAP_NO_UNIT)	{
+			zswap_slot_free(slot);
+			zswap_info.rejected++;
+			spinlock_release(&zswap_lock);
+			return 0;
+		}
+
+		memcpy(zswap_unit_addr(first), zswap_buf, len);
+		zswap_slots[slot] = (zswap_slot){first, (uint16_t)len, 1};
+		zswap_info.bytes += len;
+	}
+	zswap_info.stored++;
+	spinlock_release(&zswap_lock);
+	return slot;
+}
+
+
+bool zswap_load(uint32_t slot, void* page)	{
+	bool ret = true;
+	uint32_t i;
+
+	spinlock_acquire(&zswap_lock);
+	zswap_slot* s = &zswap_slots[slot];
+	if(slot == 0 || slot >= ZSWAP_SLOTS || s->refs == 0)	{
+		spinlock_release(&zswap_lock);
+		return false;
+	}
+
+	if(s->len == 0)	{
+		for(i = 0; i < KB4 / sizeof(uint32_t); i++)	((uint32_t*)page)[i] = s->unit;
+	}
+	else	{
+		ret = (lz4_decompress(zswap_unit_addr(s->unit), s->len, page, KB4) == KB4);
+	}
+	zswap_put(slot);
+	spinlock_release(&zswap_lock);
+	return ret;
+}
+
+
+void zswap_dup(uint32_t slot)	{
+	spinlock_acquire(&zswap_lock);
+	zswap_slots[slot].refs++;
+	spinlock_release(&zswap_lock);
+}
+
+
+void zswap_free(uint32_t slot)	{
+	spinlock_acquire(&zswap_lock);
+	zswap_put(slot);
+	spinlock_release(&zswap_lock);
+}
+
+
+uint32_t zswap_shrink()	{
+	uint32_t pages[ZSWAP_SHRINK_BATCH], n = 0, i, p, w;
+
+	// Nothing can be stored in the pages while they are unmapped, since all
+	// their units look used
+	spinlock_acquire(&zswap_lock);
+	for(p = 0; p < ZSWAP_PAGES && n < ZSWAP_SHRINK_BATCH; p++)	{
+		if(zswap_pages[p] != ZSWAP_PAGE_MAPPED)	continue;
+		for(w = 0; w < ZSWAP_PAGE_UNITS / 32; w++)
+			zswap_units[((p * ZSWAP_PAGE_UNITS) / 32) + w] = 0xFFFFFFFF;
+		pages[n++] = p;
+	}
+	spinlock_release(&zswap_lock);
+	if(n == 0)	return 0;
+
+	for(i = 0; i < n; i++)	{
+		uint32_t virt = ZSWAP_START + (pages[i] * KB4);
+		paddr_t frame = vmm_virt_to_phys(virt);
+		vmm_unmap_page(virt);
+		pmm_free_phys(frame);
+	}
+	pmm_owner_add(PMM_OWNER_ZSWAP, -(int32_t)n);
+
+	spinlock_acquire(&zswap_lock);
+	for(i = 0; i < n; i++)	{
+		for(w = 0; w < ZSWAP_PAGE_UNITS / 32; w++)
+			zswap_units[((pages[i] * ZSWAP_PAGE_UNITS) / 32) + w] = 0;
+		zswap_pages[pages[i]] = 0;
+	}
+	zswap_info.frames -= n;
+	spinlock_release(&zswap_lock);
+	return n;
+}
+
+
+void zswap_get_stats(zswap_stats* stats)	{
+	spinlock_acquire(&zswap_lock);
+	*stats = zswap_info;
+	spinlock_release(&zswap_lock);
+}
+
+
+
+
+//------------------- Internal function implementation ------------------------
+
+static uint32_t zswap_slot_alloc()	{
+	uint32_t slot = zswap_free_slots;
+	if(slot != 0)	zswap_free_slots = zswap_slots[slot].unit;
+	else if(zswap_new_slot < ZSWAP_SLOTS)	slot = zswap_new_slot++;
+	return slot;
+}
+
+static void zswap_slot_free(uint32_t slot)	{
+	zswap_slots[slot].refs = 0;
+	zswap_slots[slot].unit = zswap_free_slots;
+	zswap_free_slots = slot;
+}
+
+static void zswap_put(uint32_t slot)	{
+	zswap_slot* s = &zswap_slots[slot];
+	uint32_t i, units = (s->len + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+	if(s->refs == 0 || --s->refs != 0)	return;
+
+	for(i = s->unit; i < s->unit + units; i++)	{
+		zswap_units[i / 32] &= ~(1U << (i % 32));
+		zswap_pages[i / ZSWAP_PAGE_UNITS]--;
+	}
+	if(s->len == 0)	zswap_info.same--;
+	zswap_info.bytes -= s->len;
+	zswap_info.stored--;
+	zswap_slot_free(slot);
+}
+
+static uint32_t zswap_units_alloc(uint32_t n)	{
+	uint32_t i, u, p, run = 0, first = ZSWAP_NO_UNIT;
+
+	// First fit from the hint, a run does not wrap around the end
+	for(i = 0; i < ZSWAP_UNITS && run < n; i++)	{
+		u = (zswap_hint + i) % ZSWAP_UNITS;
+		if(u == 0)	run = 0;
+		if(zswap_unit_used(u))	{
+			run = 0;
+		}
+		else if(run++ == 0)	{
+			first = u;
+		}
+	}
+	if(run < n)	return ZSWAP_NO_UNIT;
+
+	for(p = first / ZSWAP_PAGE_UNITS; p <= (first + n - 1) / ZSWAP_PAGE_UNITS; p++)	{
+		if(zswap_pages[p] & ZSWAP_PAGE_MAPPED)	continue;
+
+		// A page that got a frame stays mapped until zswap_shrink
+		paddr_t frame = pmm_alloc_phys();
+		if(frame == 0)	return ZSWAP_NO_UNIT;
+		if(vmm_map_page(frame, ZSWAP_START + (p * KB4),
+			X86_PAGE_WRITABLE | X86_PAGE_NOEXEC) != VMM_SUCCESS)	{
+			pmm_free_phys(frame);
+			return ZSWAP_NO_UNIT;
+		}
+		zswap_pages[p] = ZSWAP_PAGE_MAPPED;
+		pmm_owner_add(PMM_OWNER_ZSWAP, 1);
+		zswap_info.frames++;
+	}
+
+	for(u = first; u < first + n; u++)	{
+		zswap_units[u / 32] |= (1U << (u % 32));
+		zswap_pages[u / ZSWAP_PAGE_UNITS]++;
+	}
+	zswap_hint = first + n;
+	return first;
+}
+
+
+
+
+#ifdef TEST_KERNEL
+
+static uint32_t zswap_test_page[KB4 / sizeof(uint32_t)],
+	zswap_test_back[KB4 / sizeof(uint32_t)];
+
+int zswap_test_same()	{
+	zswap_stats before, after;
+	uint32_t i, slot;
+	zswap_get_stats(&before);
+
+	// Only a slot is used, the word is kept in it
+	for(i = 0; i < KB4 / sizeof(uint32_t); i++)	zswap_test_page[i] = 0xDEADBEEF;
+	if((slot = zswap_store(zswap_test_page)) == 0)	return 1;
+	zswap_get_stats(&after);
+	if(after.same != before.same + 1 || after.bytes != before.bytes)	return 2;
+
+	if(!zswap_load(slot, zswap_test_back) ||
+		memcmp(zswap_test_page, zswap_test_back, KB4) != 0)
+		return 3;
+
+	// The last reference was dropped
+	if(zswap_load(slot, zswap_test_back))	return 4;
+	zswap_get_stats(&after);
+	if(after.stored != before.stored || after.same != before.same)	return 5;
+	return 0;
+}
+
+int zswap_test_compress()	{
+	zswap_stats before, after;
+	uint32_t i, slot, seed = 54321;
+	char* text = (char*)zswap_test_page;
+	zswap_get_stats(&before);
+
+	for(i = 0; i < KB4; i++)	text[i] = "compressed swap "[i % 16];
+	text[100] = 'X';
+	if((slot = zswap_store(zswap_test_page)) == 0)	return 1;
+	zswap_get_stats(&after);
+	if(after.stored != before.stored + 1 || after.bytes <= before.bytes ||
+		after.bytes - before.bytes > KB4 / 8 || after.frames == 0)
+		return 2;
+
+	// Copied after fork, both copies are loaded
+	zswap_dup(slot);
+	memset(zswap_test_back, 0x00, KB4);
+	if(!zswap_load(slot, zswap_test_back) ||
+		memcmp(zswap_test_page, zswap_test_back, KB4) != 0)
+		return 3;
+	memset(zswap_test_back, 0x00, KB4);
+	if(!zswap_load(slot, zswap_test_back) ||
+		memcmp(zswap_test_page, zswap_test_back, KB4) != 0)
+		return 4;
+	zswap_get_stats(&after);
+	if(after.stored != before.stored || after.bytes != before.bytes)	return 5;
+
+	// Random data does not compress and is not stored
+	for(i = 0; i < KB4 / sizeof(uint32_t); i++)	{
+		seed = (seed * 1103515245) + 12345;
+		zswap_test_page[i] = seed;
+	}
+	if(zswap_store(zswap_test_page) != 0)	return 6;
+	zswap_get_stats(&after);
+	if(after.rejected != before.rejected + 1)	return 7;
+	return 0;
+}
+
+int zswap_test_shrink()	{
+	zswap_stats before, after;
+	uint32_t i, slot;
+	char* text = (char*)zswap_test_page;
+
+	for(i = 0; i < KB4; i++)	text[i] = "shrink "[i % 7];
+	if((slot = zswap_store(zswap_test_page)) == 0)	return 1;
+	zswap_get_stats(&before);
+	if(before.frames == 0)	return 2;
+
+	// The page with data is kept
+	zswap_shrink();
+	zswap_get_stats(&after);
+	if(after.frames == 0)	return 3;
+
+	zswap_free(slot);
+	if(zswap_shrink() == 0)	return 4;
+	zswap_get_stats(&after);
+	if(after.frames >= before.frames)	return 5;
+	return 0;
+}
+
+bool zswap_run_all_tests()	{
+	unit_test tests[4] = {
+		zswap_test_same,
+		zswap_test_compress,
+		zswap_test_shrink,
+		NULL
+	};
+	return kernel_generic_unit_test(tests, "zswap_run_all_tests()");
+}
+
+#endif